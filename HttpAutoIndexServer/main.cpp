@@ -1,11 +1,40 @@
 #include <string>
+#include <cstring>
 #include <valarray>
+#include <vector>
+#include <deque>
 #include <regex>
 #include <list>
 #include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <algorithm>
 #include <cctype>
 #include <sstream>
 #include <map>
+#include <unordered_map>
+#include <set>
+#include <shared_mutex>
+#include <chrono>
+#ifdef HAIS_TLS
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+#endif
+
+#if defined(__x86_64__) || defined(__i386__) || defined(_M_X64)
+#define ShaNiAvailable
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#define ShaNiTarget
+#else
+#include <cpuid.h>
+#define ShaNiTarget __attribute__((target("sha,ssse3,sse4.1")))
+#endif
+#endif
 
 #define VERSION "hais/1.2"
 
@@ -35,6 +64,7 @@
 }
 
 #define close closesocket
+#define strcasecmp _stricmp
 
 void DisplayError(const char* msg)
 {
@@ -95,10 +125,21 @@ std::string ToWindowsPath(const char* uri)
 #include <dirent.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <netdb.h>
 #include <err.h>
 #include <unistd.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/sendfile.h>
+#include <sys/inotify.h>
+#include <sys/mman.h>
+#include <sys/xattr.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <poll.h>
+#include <climits>
+#include <fcntl.h>
 #include <csignal>
 
 #endif
@@ -116,6 +157,692 @@ std::valarray<uint8_t> UrlEncodeTableGenerate()
 
 static auto UrlEncodeTable = UrlEncodeTableGenerate();
 
+static std::map<std::string, std::string> Options;
+
+std::string GetOption(const char* name, const char* def)
+{
+	const auto opt = Options.find(name);
+	return opt == Options.end() ? def : opt->second;
+}
+
+int64_t GetOptionInt(const char* name, const int64_t def)
+{
+	const auto opt = Options.find(name);
+	return opt == Options.end() ? def : std::strtoll(opt->second.c_str(), nullptr, 10);
+}
+
+std::string JsonString(const std::string& s)
+{
+	std::string out = "\"";
+	for (const auto c : s)
+	{
+		if (c == '"' || c == '\\') out += '\\';
+		if (static_cast<uint8_t>(c) >= 0x20)
+		{
+			out += c;
+			continue;
+		}
+		char esc[8];
+		snprintf(esc, sizeof(esc), "\\u%04x", c);
+		out += esc;
+	}
+	return out + "\"";
+}
+
+// Sampled request tracing. One request in --trace gets a trace id, and every phase it passes
+// through is recorded as a span into a ring owned by the thread that ran the phase, so threads
+// never contend while recording and an untraced request pays one branch per phase.
+// Timestamps are steady_clock nanoseconds; Export() renders all rings as Chrome trace-event JSON.
+class Tracer
+{
+public:
+	struct Span
+	{
+		const char* name = nullptr;
+		uint64_t id = 0;
+		int64_t start = 0;
+		int64_t duration = 0;
+		// Spans that cross threads (a whole request, a transfer) are exported as async slices of the request.
+		bool async = false;
+		std::string detail;
+	};
+
+	static void Configure(const int64_t every, const int64_t capacity)
+	{
+		Every = every;
+		Capacity = static_cast<size_t>(std::max<int64_t>(16, capacity));
+	}
+
+	static bool Enabled()
+	{
+		return Every > 0;
+	}
+
+	// A new trace id for one request in Every, 0 for the others.
+	static uint64_t Sample()
+	{
+		if (Every <= 0 || Requests++ % Every) return 0;
+		return ++Traced;
+	}
+
+	static int64_t Now()
+	{
+		return std::chrono::duration_cast<std::chrono::nanoseconds>(
+			std::chrono::steady_clock::now().time_since_epoch()).count();
+	}
+
+	// The start of a span of request id, or 0 when the request is not traced.
+	static int64_t Start(const uint64_t id)
+	{
+		return id ? Now() : 0;
+	}
+
+	// Ends a span begun at start, now.
+	static void Record(const uint64_t id, const char* name, const int64_t start, std::string detail = std::string(), const bool async = false)
+	{
+		if (!id || !start) return;
+		const auto end = Now();
+		auto& b = Local();
+		std::lock_guard<std::mutex> lock(b.mtx);
+		const auto slot = b.next++ % Capacity;
+		if (slot == b.spans.size()) b.spans.emplace_back();
+		else ++Overwritten;
+		auto& s = b.spans[slot];
+		s.name = name;
+		s.id = id;
+		s.start = start;
+		s.duration = end - start;
+		s.async = async;
+		s.detail = std::move(detail);
+	}
+
+	// Names the calling thread in exported traces.
+	static void Name(const std::string& name)
+	{
+		ThreadName = name;
+	}
+
+	class Scope
+	{
+	public:
+		Scope(const uint64_t id, const char* name) : id(id), name(name), start(Start(id)) {}
+
+		~Scope()
+		{
+			Record(id, name, start);
+		}
+
+	private:
+		uint64_t id;
+		const char* name;
+		int64_t start;
+	};
+
+	static std::string Export()
+	{
+		std::vector<std::pair<int, std::string>> threads;
+		std::vector<std::pair<int, Span>> spans;
+		{
+			std::lock_guard<std::mutex> lock(Mtx);
+			for (const auto& b : Buffers)
+			{
+				std::lock_guard<std::mutex> bufferLock(b->mtx);
+				threads.emplace_back(b->tid, b->thread);
+				for (const auto& s : b->spans) spans.emplace_back(b->tid, s);
+			}
+		}
+		const auto us = [](const int64_t ns)
+		{
+			char buf[32];
+			snprintf(buf, sizeof(buf), "%lld.%03lld", static_cast<long long>(ns / 1000), static_cast<long long>(ns % 1000));
+			return std::string(buf);
+		};
+		std::ostringstream oss;
+		oss << "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[";
+		auto sep = "\n";
+		for (const auto& t : threads)
+		{
+			oss << sep << "{\"ph\":\"M\",\"pid\":1,\"tid\":" << t.first <<
+				",\"name\":\"thread_name\",\"args\":{\"name\":" << JsonString(t.second) << "}}";
+			sep = ",\n";
+		}
+		for (const auto& p : spans)
+		{
+			const auto& s = p.second;
+			const auto common = ",\"pid\":1,\"tid\":" + std::to_string(p.first) + ",\"id\":" + std::to_string(s.id);
+			if (s.async)
+			{
+				const auto name = JsonString(s.detail.empty() ? s.name : s.detail);
+				const auto cat = s.detail.empty() ? "phase" : "request";
+				oss << sep << "{\"ph\":\"b\",\"cat\":\"" << cat << "\",\"name\":" << name << common <<
+					",\"ts\":" << us(s.start) << ",\"args\":{\"request\":" << s.id << "}}";
+				oss << sep << "{\"ph\":\"e\",\"cat\":\"" << cat << "\",\"name\":" << name << common <<
+					",\"ts\":" << us(s.start + s.duration) << "}";
+			}
+			else
+			{
+				oss << sep << "{\"ph\":\"X\",\"cat\":\"phase\",\"name\":" << JsonString(s.name) << common <<
+					",\"ts\":" << us(s.start) << ",\"dur\":" << us(s.duration) <<
+					",\"args\":{\"request\":" << s.id;
+				if (!s.detail.empty()) oss << ",\"detail\":" << JsonString(s.detail);
+				oss << "}}";
+			}
+			sep = ",\n";
+		}
+		oss << "\n]}\n";
+		return oss.str();
+	}
+
+	static std::string Stats()
+	{
+		size_t threads = 0, spans = 0;
+		{
+			std::lock_guard<std::mutex> lock(Mtx);
+			for (const auto& b : Buffers)
+			{
+				std::lock_guard<std::mutex> bufferLock(b->mtx);
+				++threads;
+				spans += b->spans.size();
+			}
+		}
+		std::ostringstream oss;
+		oss << "trace every=" << Every <<
+			" requests=" << Requests.load() <<
+			" traced=" << Traced.load() <<
+			" threads=" << threads <<
+			" spans=" << spans <<
+			" overwritten=" << Overwritten.load();
+		return oss.str();
+	}
+
+private:
+	struct Buffer
+	{
+		std::mutex mtx;
+		int tid = 0;
+		std::string thread;
+		bool owned = false;
+		std::vector<Span> spans;
+		uint64_t next = 0;
+	};
+
+	// Gives the calling thread's ring back when the thread exits, for the next new thread to take over.
+	struct Owner
+	{
+		Buffer* buffer = nullptr;
+
+		~Owner()
+		{
+			if (!buffer) return;
+			std::lock_guard<std::mutex> lock(Mtx);
+			buffer->owned = false;
+		}
+	};
+
+	static Buffer& Local()
+	{
+		thread_local Owner owner;
+		if (owner.buffer) return *owner.buffer;
+		std::lock_guard<std::mutex> lock(Mtx);
+		for (const auto& b : Buffers)
+		{
+			if (!b->owned) owner.buffer = b.get();
+		}
+		if (!owner.buffer)
+		{
+			Buffers.emplace_back(std::make_unique<Buffer>());
+			owner.buffer = Buffers.back().get();
+			owner.buffer->tid = static_cast<int>(Buffers.size());
+		}
+		owner.buffer->owned = true;
+		owner.buffer->thread = ThreadName.empty() ? "thread-" + std::to_string(owner.buffer->tid) : ThreadName;
+		return *owner.buffer;
+	}
+
+	inline static int64_t Every = 0;
+	inline static size_t Capacity = 16384;
+	inline static std::atomic<uint64_t> Requests{0};
+	inline static std::atomic<uint64_t> Traced{0};
+	inline static std::atomic<uint64_t> Overwritten{0};
+	inline static std::mutex Mtx;
+	inline static std::vector<std::unique_ptr<Buffer>> Buffers;
+	inline static thread_local std::string ThreadName;
+};
+
+// Memory held by the caches and by responses in flight, charged by class against --memory and
+// against each class's --memory-<class>. A charge that takes either over its limit reclaims at
+// once: a class over its own limit evicts its own entries, and over the total the caches give
+// back in order of fewest hits per byte held since the last reclaim, so a burst of requests pushes
+// out cold listings and digests instead of growing the process. Classes without an evictor
+// (buffers in flight) are only counted; the scheduler's transfer slots are what bound them.
+// Charges must be made with no cache lock held, as reclaiming calls back into the caches.
+class Memory
+{
+public:
+	enum Class
+	{
+		Listings,
+		Digests,
+		Transfers,
+		Responses,
+		Classes
+	};
+
+	// Drops about n bytes of cold entries from a cache and returns how many it dropped; the caller releases them.
+	typedef std::function<int64_t(int64_t)> Evictor;
+
+	// The default --memory: an eighth of physical memory.
+	static int64_t Share()
+	{
+#ifdef _MSC_VER
+		MEMORYSTATUSEX status;
+		status.dwLength = sizeof(status);
+		if (!GlobalMemoryStatusEx(&status)) return 0;
+		return static_cast<int64_t>(status.ullTotalPhys / 8);
+#else
+		const auto pages = sysconf(_SC_PHYS_PAGES);
+		const auto pageSize = sysconf(_SC_PAGE_SIZE);
+		return pages > 0 && pageSize > 0 ? static_cast<int64_t>(pages) * pageSize / 8 : 0;
+#endif
+	}
+
+	static void Configure(const int64_t total)
+	{
+		Limit = total;
+		for (auto c = 0; c < Classes; ++c) ClassLimit[c] = GetOptionInt((std::string("memory-") + Names[c]).c_str(), 0);
+	}
+
+	static void SetEvictor(const Class c, Evictor evict)
+	{
+		std::lock_guard<std::mutex> lock(Mtx);
+		Evictors[c] = std::move(evict);
+	}
+
+	static void Charge(const Class c, const int64_t n)
+	{
+		const auto bytes = Bytes[c] += n;
+		const auto total = Total += n;
+		Raise(Peak[c], bytes);
+		Raise(TotalPeak, total);
+		if ((Limit && total > Limit) || (ClassLimit[c] && bytes > ClassLimit[c])) Reclaim();
+	}
+
+	static void Release(const Class c, const int64_t n)
+	{
+		Bytes[c] -= n;
+		Total -= n;
+	}
+
+	static void Hit(const Class c)
+	{
+		++Hits[c];
+	}
+
+	static void Miss(const Class c)
+	{
+		++Misses[c];
+	}
+
+	// Holds n bytes of a class for as long as it lives.
+	class Lease
+	{
+	public:
+		Lease(const Class c, const int64_t n) : c(c), n(n)
+		{
+			Charge(c, n);
+		}
+
+		~Lease()
+		{
+			Release(c, n);
+		}
+
+	private:
+		const Class c;
+		const int64_t n;
+	};
+
+	// When a cache evicting by uses per byte halves its use counts: once a cache's worth has been
+	// evicted since the last time, not at every call, as a reclaim evicts in many small steps and
+	// halving at each would flatten the hot entries to nothing.
+	class Aging
+	{
+	public:
+		// freed of the held bytes were just evicted; true when the counts are due.
+		bool Due(const int64_t freed, const int64_t held)
+		{
+			evicted += freed;
+			if (evicted < held - freed) return false;
+			evicted = 0;
+			return true;
+		}
+
+	private:
+		int64_t evicted = 0;
+	};
+
+	static std::string Stats()
+	{
+		std::ostringstream oss;
+		oss << "memory limit=" << Limit <<
+			" bytes=" << Total.load() <<
+			" peak=" << TotalPeak.load() <<
+			" reclaims=" << Reclaims.load() <<
+			" overruns=" << Overruns.load();
+		for (auto c = 0; c < Classes; ++c)
+		{
+			oss << "\nmemory-" << Names[c] <<
+				" limit=" << ClassLimit[c] <<
+				" bytes=" << Bytes[c].load() <<
+				" peak=" << Peak[c].load() <<
+				" hits=" << Hits[c].load() <<
+				" misses=" << Misses[c].load() <<
+				" evicted=" << Evicted[c].load();
+		}
+		return oss.str();
+	}
+
+private:
+	static void Raise(std::atomic<int64_t>& peak, const int64_t value)
+	{
+		auto seen = peak.load();
+		while (value > seen && !peak.compare_exchange_weak(seen, value))
+		{
+		}
+	}
+
+	static void Evict(const int c, const int64_t n)
+	{
+		const auto freed = Evictors[c](n);
+		Evicted[c] += freed;
+		Release(static_cast<Class>(c), freed);
+	}
+
+	// Evicts down to 15/16 of the limit that was crossed, so a full cache is not reclaimed on every charge.
+	static void Reclaim()
+	{
+		std::unique_lock<std::mutex> lock(Mtx, std::try_to_lock);
+		if (!lock.owns_lock()) return;
+		++Reclaims;
+		for (auto c = 0; c < Classes; ++c)
+		{
+			if (ClassLimit[c] && Bytes[c] > ClassLimit[c] && Evictors[c]) Evict(c, Bytes[c] - ClassLimit[c] / 16 * 15);
+		}
+		bool tried[Classes] = {};
+		while (Limit && Total > Limit)
+		{
+			auto victim = -1;
+			double value = 0;
+			for (auto c = 0; c < Classes; ++c)
+			{
+				if (tried[c] || !Evictors[c] || Bytes[c] <= 0) continue;
+				const auto v = (Hits[c] - HitsSeen[c] + 1.0) / Bytes[c];
+				if (victim < 0 || v < value)
+				{
+					victim = c;
+					value = v;
+				}
+			}
+			if (victim < 0)
+			{
+				++Overruns;
+				break;
+			}
+			tried[victim] = true;
+			Evict(victim, Total - Limit / 16 * 15);
+		}
+		for (auto c = 0; c < Classes; ++c) HitsSeen[c] = Hits[c].load();
+	}
+
+	inline static const char* const Names[Classes] = {"listings", "digests", "transfers", "responses"};
+	inline static int64_t Limit = 0;
+	inline static int64_t ClassLimit[Classes] = {};
+	inline static std::atomic<int64_t> Total{0};
+	inline static std::atomic<int64_t> TotalPeak{0};
+	inline static std::atomic<int64_t> Bytes[Classes] = {};
+	inline static std::atomic<int64_t> Peak[Classes] = {};
+	inline static std::atomic<uint64_t> Hits[Classes] = {};
+	inline static std::atomic<uint64_t> Misses[Classes] = {};
+	inline static std::atomic<int64_t> Evicted[Classes] = {};
+	inline static uint64_t HitsSeen[Classes] = {};
+	inline static std::atomic<uint64_t> Reclaims{0};
+	inline static std::atomic<uint64_t> Overruns{0};
+	inline static std::mutex Mtx;
+	inline static Evictor Evictors[Classes];
+};
+
+// A pool of threads serving one stage of the request pipeline.
+// Each worker owns a deque: it pops its own tasks LIFO and steals from the others FIFO when idle,
+// so a task submitted from inside the stage stays on the submitting thread unless another is free.
+class Stage
+{
+public:
+	Stage(std::string name, const int threadNum) : name(std::move(name))
+	{
+		for (auto i = 0; i < threadNum; ++i) workers.emplace_back(std::make_unique<Worker>());
+		for (auto i = 0; i < threadNum; ++i) threads.emplace_back([this, i]() { Run(i); });
+	}
+
+	void Submit(std::function<void()> task)
+	{
+		const auto i = Current == this ? CurrentWorker : next++ % workers.size();
+		{
+			std::lock_guard<std::mutex> lock(workers[i]->mtx);
+			workers[i]->tasks.push_back(std::move(task));
+		}
+		const auto depth = ++queued;
+		auto peak = peakDepth.load();
+		while (depth > peak && !peakDepth.compare_exchange_weak(peak, depth))
+		{
+		}
+		{
+			std::lock_guard<std::mutex> lock(sleepMtx);
+		}
+		wake.notify_one();
+	}
+
+	std::string Stats() const
+	{
+		std::ostringstream oss;
+		oss << name <<
+			" threads=" << workers.size() <<
+			" depth=" << queued.load() <<
+			" peak=" << peakDepth.load() <<
+			" active=" << active.load() <<
+			" executed=" << executed.load() <<
+			" steals=" << steals.load();
+		return oss.str();
+	}
+
+	void Join()
+	{
+		for (auto& t : threads) t.join();
+	}
+
+private:
+	struct Worker
+	{
+		std::mutex mtx;
+		std::deque<std::function<void()>> tasks;
+	};
+
+	bool TryPop(const size_t self, std::function<void()>& task)
+	{
+		{
+			std::lock_guard<std::mutex> lock(workers[self]->mtx);
+			if (!workers[self]->tasks.empty())
+			{
+				task = std::move(workers[self]->tasks.back());
+				workers[self]->tasks.pop_back();
+				return true;
+			}
+		}
+		for (size_t i = 1; i < workers.size(); ++i)
+		{
+			auto& victim = *workers[(self + i) % workers.size()];
+			std::lock_guard<std::mutex> lock(victim.mtx);
+			if (victim.tasks.empty()) continue;
+			task = std::move(victim.tasks.front());
+			victim.tasks.pop_front();
+			++steals;
+			return true;
+		}
+		return false;
+	}
+
+	void Run(const size_t self)
+	{
+		Current = this;
+		CurrentWorker = self;
+		Tracer::Name(name + "-" + std::to_string(self));
+		std::function<void()> task;
+		while (true)
+		{
+			if (TryPop(self, task))
+			{
+				--queued;
+				++active;
+				task();
+				task = nullptr;
+				--active;
+				++executed;
+				continue;
+			}
+			std::unique_lock<std::mutex> lock(sleepMtx);
+			wake.wait(lock, [this]() { return queued > 0; });
+		}
+	}
+
+	inline static thread_local Stage* Current = nullptr;
+	inline static thread_local size_t CurrentWorker = 0;
+
+	std::string name;
+	std::vector<std::unique_ptr<Worker>> workers;
+	std::vector<std::thread> threads;
+	std::mutex sleepMtx;
+	std::condition_variable wake;
+	std::atomic<uint64_t> queued{0};
+	std::atomic<uint64_t> peakDepth{0};
+	std::atomic<uint64_t> active{0};
+	std::atomic<uint64_t> executed{0};
+	std::atomic<uint64_t> steals{0};
+	std::atomic<uint64_t> next{0};
+};
+
+// Network threads parse requests and send responses; disk threads do every blocking filesystem call.
+static Stage* NetStage = nullptr;
+static Stage* DiskStage = nullptr;
+
+#ifndef _MSC_VER
+// Waits on sockets for the stages, so that a slow peer holds no stage thread in a blocking recv or
+// connect. Each watch fires once: its callback goes to the network stage with true when the socket
+// is ready (or in error, which the next call will report), or with false when the timeout ran out.
+class Poller
+{
+public:
+	Poller()
+	{
+		if (pipe2(wakePipe, O_CLOEXEC | O_NONBLOCK) < 0) err(EXIT_FAILURE, "Can't create pipe");
+		std::thread([this]() { Run(); }).detach();
+	}
+
+	void Watch(const int fd, const short events, const int timeoutSeconds, std::function<void(bool)> ready)
+	{
+		Waiter w;
+		w.fd = fd;
+		w.events = events;
+		w.deadline = timeoutSeconds > 0 ?
+			std::chrono::steady_clock::now() + std::chrono::seconds(timeoutSeconds) :
+			std::chrono::steady_clock::time_point::max();
+		w.ready = std::move(ready);
+		{
+			std::lock_guard<std::mutex> lock(mtx);
+			added.push_back(std::move(w));
+		}
+		const auto wake = write(wakePipe[1], "x", 1);
+		(void)wake;
+	}
+
+	std::string Stats() const
+	{
+		std::ostringstream oss;
+		oss << "poller waiting=" << waiting.load() <<
+			" ready=" << readied.load() <<
+			" timeouts=" << timeouts.load();
+		return oss.str();
+	}
+
+private:
+	struct Waiter
+	{
+		int fd = -1;
+		short events = 0;
+		std::chrono::steady_clock::time_point deadline;
+		std::function<void(bool)> ready;
+	};
+
+	void Run()
+	{
+		Tracer::Name("poller");
+		std::vector<Waiter> watched;
+		std::vector<pollfd> fds;
+		while (true)
+		{
+			{
+				std::lock_guard<std::mutex> lock(mtx);
+				for (auto& w : added) watched.push_back(std::move(w));
+				added.clear();
+			}
+			waiting = watched.size();
+			fds.assign(1, {wakePipe[0], POLLIN, 0});
+			auto next = std::chrono::steady_clock::time_point::max();
+			for (const auto& w : watched)
+			{
+				fds.push_back({w.fd, w.events, 0});
+				next = std::min(next, w.deadline);
+			}
+			auto timeout = -1;
+			if (next != std::chrono::steady_clock::time_point::max())
+			{
+				const auto left = std::chrono::duration_cast<std::chrono::milliseconds>(next - std::chrono::steady_clock::now()).count();
+				timeout = static_cast<int>(std::max<int64_t>(0, std::min<int64_t>(left + 1, INT_MAX)));
+			}
+			if (poll(fds.data(), fds.size(), timeout) < 0 && errno != EINTR) err(EXIT_FAILURE, "Can't poll");
+			char drain[64];
+			while (read(wakePipe[0], drain, sizeof(drain)) > 0)
+			{
+			}
+			const auto now = std::chrono::steady_clock::now();
+			size_t kept = 0;
+			for (size_t i = 0; i < watched.size(); ++i)
+			{
+				const auto ready = fds[i + 1].revents != 0;
+				if (!ready && watched[i].deadline > now)
+				{
+					if (kept != i) watched[kept] = std::move(watched[i]);
+					++kept;
+					continue;
+				}
+				++(ready ? readied : timeouts);
+				NetStage->Submit([callback = std::move(watched[i].ready), ready]() { callback(ready); });
+			}
+			watched.resize(kept);
+		}
+	}
+
+	int wakePipe[2] = {-1, -1};
+	std::mutex mtx;
+	std::vector<Waiter> added;
+	std::atomic<uint64_t> waiting{0};
+	std::atomic<uint64_t> readied{0};
+	std::atomic<uint64_t> timeouts{0};
+};
+
+static Poller* Sockets = nullptr;
+#endif
+
+#define TransferChunk 65536
+
 int FileExists(const char* path)
 {
 #ifdef _MSC_VER
@@ -256,44 +983,135 @@ std::string PathCombine(const char* lp, const char* rp)
 	return path;
 }
 
-void GetFiles(const char* path, std::ostringstream& dirs, std::ostringstream& files)
+std::string PathHref(const std::string& path)
 {
-#define AddFile(oss, href, display, size) \
-	((oss) << "<tr><td><a href=\"" << (href) << "\">" << (display) << "</a></td><td align=\"right\">" << (size) << "</td></tr>");
-#define AddDir(oss, href, display) \
-	((oss) << "<a href=\"" << (href) << "\">" << (display) << "</a><br/>")
 #ifdef _MSC_VER
-	WIN32_FIND_DATA ffd;
-	LARGE_INTEGER filesize;
-	size_t lengthOfArg;
-	auto hFind = INVALID_HANDLE_VALUE;
-	DWORD dwError = 0;
-	StringCchLength(path, MAX_PATH, &lengthOfArg);
-	if (lengthOfArg > (MAX_PATH - 3))
-	err(EXIT_FAILURE, "Filename too long");
-	const auto szDir = PathCombine(path, "*");
-	hFind = FindFirstFile(szDir.c_str(), &ffd);
-	if (INVALID_HANDLE_VALUE == hFind) DisplayError(szDir.c_str());
-	do
+	const auto href = ToUnixPath(path.c_str());
+#else
+	const auto& href = path;
+#endif
+	return UrlEncode(href.c_str(), href.length());
+}
+
+std::string HtmlEscape(const std::string& text)
+{
+	std::string out;
+	out.reserve(text.length());
+	for (const auto c : text)
 	{
-		if (!strcmp(ffd.cFileName, ".") || !strcmp(ffd.cFileName, "..")) continue;
-		if (ffd.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY)
+		switch (c)
 		{
-			auto dir = PathCombine(ffd.cFileName, "");
-			auto href = ToUnixPath(PathCombine(path, dir.c_str()).c_str());
-			AddDir(dirs, UrlEncode(href.c_str(), href.length()), dir);
+		case '&': out += "&amp;"; break;
+		case '<': out += "&lt;"; break;
+		case '>': out += "&gt;"; break;
+		case '"': out += "&quot;"; break;
+		case '\'': out += "&#39;"; break;
+		default: out += c;
 		}
-		else
+	}
+	return out;
+}
+
+struct ArchiveEntry
+{
+	std::string rel;
+	uint64_t size = 0;
+	int64_t mtime = 0;
+	bool dir = false;
+	bool crcKnown = false;
+	uint32_t crc = 0;
+	uint64_t offset = 0;
+};
+
+// List the directories and regular files directly below root/rel, sorted by name.
+void ListDirectory(const std::string& root, const std::string& rel, std::vector<ArchiveEntry>& children)
+{
+	const auto dirPath = PathCombine(root.c_str(), rel.c_str());
+#ifdef _MSC_VER
+	WIN32_FIND_DATA ffd;
+	const auto hFind = FindFirstFile(PathCombine(dirPath.c_str(), "*").c_str(), &ffd);
+	if (INVALID_HANDLE_VALUE == hFind) return;
+	do
+	{
+		if (!strcmp(ffd.cFileName, ".") || !strcmp(ffd.cFileName, "..")) continue;
+		ArchiveEntry e;
+		LARGE_INTEGER time;
+		time.LowPart = ffd.ftLastWriteTime.dwLowDateTime;
+		time.HighPart = ffd.ftLastWriteTime.dwHighDateTime;
+		e.mtime = time.QuadPart / 10000000ULL - 11644473600ULL;
+		e.dir = ffd.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY;
+		e.rel = rel + ffd.cFileName + (e.dir ? SplitChar : "");
+		if (!e.dir)
+		{
+			LARGE_INTEGER size;
+			size.LowPart = ffd.nFileSizeLow;
+			size.HighPart = ffd.nFileSizeHigh;
+			e.size = size.QuadPart;
+		}
+		children.push_back(std::move(e));
+	}
+	while (FindNextFile(hFind, &ffd) != 0);
+	FindClose(hFind);
+#else
+	const auto dir = opendir(dirPath.c_str());
+	if (!dir)
+	{
+		warn("Can't open %s", dirPath.c_str());
+		return;
+	}
+	struct dirent* dent;
+	struct stat st {};
+	while ((dent = readdir(dir)))
+	{
+		if (!strcmp(dent->d_name, ".") || !strcmp(dent->d_name, "..")) continue;
+		const auto fn = PathCombine(dirPath.c_str(), dent->d_name);
+		if (lstat(fn.c_str(), &st) == -1 || (S_ISLNK(st.st_mode) && (stat(fn.c_str(), &st) == -1 || !S_ISREG(st.st_mode))))
+			continue;
+		if (!S_ISDIR(st.st_mode) && !S_ISREG(st.st_mode)) continue;
+		ArchiveEntry e;
+		e.mtime = st.st_mtime;
+		e.dir = S_ISDIR(st.st_mode);
+		e.rel = rel + dent->d_name + (e.dir ? SplitChar : "");
+		if (!e.dir) e.size = st.st_size;
+		children.push_back(std::move(e));
+	}
+	closedir(dir);
+#endif
+	std::sort(children.begin(), children.end(), [](const ArchiveEntry& a, const ArchiveEntry& b)
+	{
+		return a.rel < b.rel;
+	});
+}
+
+// The entries directly below path, in directory order: everything but . and .., directories
+// named with a trailing separator, anything else by the size stat() gives for it.
+void GetFiles(const char* path, std::vector<ArchiveEntry>& entries)
+{
+#ifdef _MSC_VER
+	WIN32_FIND_DATA ffd;
+	LARGE_INTEGER filesize;
+	size_t lengthOfArg;
+	auto hFind = INVALID_HANDLE_VALUE;
+	DWORD dwError = 0;
+	StringCchLength(path, MAX_PATH, &lengthOfArg);
+	if (lengthOfArg > (MAX_PATH - 3))
+	err(EXIT_FAILURE, "Filename too long");
+	const auto szDir = PathCombine(path, "*");
+	hFind = FindFirstFile(szDir.c_str(), &ffd);
+	if (INVALID_HANDLE_VALUE == hFind) DisplayError(szDir.c_str());
+	do
+	{
+		if (!strcmp(ffd.cFileName, ".") || !strcmp(ffd.cFileName, "..")) continue;
+		ArchiveEntry e;
+		e.dir = ffd.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY;
+		e.rel = e.dir ? PathCombine(ffd.cFileName, "") : ffd.cFileName;
+		if (!e.dir)
 		{
 			filesize.LowPart = ffd.nFileSizeLow;
 			filesize.HighPart = ffd.nFileSizeHigh;
-			auto href = ToUnixPath(PathCombine(path, ffd.cFileName).c_str());
-			AddFile(
-				files,
-				UrlEncode(href.c_str(), href.length()),
-				ffd.cFileName,
-				std::to_string(filesize.QuadPart));
+			e.size = filesize.QuadPart;
 		}
+		entries.push_back(std::move(e));
 	}
 	while (FindNextFile(hFind, &ffd) != 0);
 	dwError = GetLastError();
@@ -308,7 +1126,11 @@ void GetFiles(const char* path, std::ostringstream& dirs, std::ostringstream& fi
 	strcpy(fn, path);
 	if (fn[len - 1] != '/')fn[len++] = '/';
 	const auto dir = opendir(path);
-	if (!dir) err(EXIT_FAILURE, "Can't open %s", path);
+	if (!dir)
+	{
+		warn("Can't open %s", path);
+		return;
+	}
 	while ((dent = readdir(dir)))
 	{
 		if (!strcmp(dent->d_name, ".") || !strcmp(dent->d_name, "..")) continue;
@@ -318,80 +1140,1089 @@ void GetFiles(const char* path, std::ostringstream& dirs, std::ostringstream& fi
 			warn("Can't stat %s", fn);
 			continue;
 		}
-		auto _fn = std::string(fn);
-		if (S_ISDIR(st.st_mode))
+		ArchiveEntry e;
+		e.dir = S_ISDIR(st.st_mode);
+		e.rel = e.dir ? PathCombine(dent->d_name, "") : dent->d_name;
+		if (!e.dir) e.size = S_ISLNK(st.st_mode) ? FileSize(fn) : st.st_size;
+		entries.push_back(std::move(e));
+	}
+	closedir(dir);
+#endif
+}
+
+// Collect every directory and regular file below root, sorted per directory so the layout is stable across requests.
+void WalkTree(const std::string& root, const std::string& rel, std::vector<ArchiveEntry>& entries)
+{
+	std::vector<ArchiveEntry> children;
+	ListDirectory(root, rel, children);
+	for (auto& e : children)
+	{
+		const auto dir = e.dir;
+		const auto sub = e.rel;
+		entries.push_back(std::move(e));
+		if (dir) WalkTree(root, sub, entries);
+	}
+}
+
+// Sorted strings stored front-coded in buckets of 16: the first string of a bucket is kept whole,
+// the rest as (shared prefix length, suffix). Lookups binary search the bucket heads.
+class FrontCodedArray
+{
+public:
+	void Append(const std::string& s)
+	{
+		if (count % Bucket == 0)
+		{
+			heads.push_back(data.size());
+			PutVarint(s.length());
+			data.insert(data.end(), s.begin(), s.end());
+		}
+		else
+		{
+			size_t shared = 0;
+			const auto max = std::min(s.length(), last.length());
+			while (shared < max && s[shared] == last[shared]) ++shared;
+			PutVarint(shared);
+			PutVarint(s.length() - shared);
+			data.insert(data.end(), s.begin() + shared, s.end());
+		}
+		last = s;
+		++count;
+	}
+
+	size_t Size() const { return count; }
+
+	uint64_t Bytes() const { return data.capacity() + heads.capacity() * sizeof(uint64_t); }
+
+	void ShrinkToFit()
+	{
+		data.shrink_to_fit();
+		heads.shrink_to_fit();
+		last.clear();
+	}
+
+	// Index of the first string for which pred is false; pred must be true for a prefix of the array.
+	template <typename Pred>
+	size_t PartitionPoint(Pred pred) const
+	{
+		size_t lo = 0, hi = heads.size();
+		std::string s;
+		while (lo < hi)
+		{
+			const auto mid = (lo + hi) / 2;
+			auto p = data.data() + heads[mid];
+			const auto len = GetVarint(p);
+			s.assign(p, len);
+			if (pred(s)) lo = mid + 1;
+			else hi = mid;
+		}
+		if (!lo) return 0;
+		auto i = (lo - 1) * Bucket;
+		Scan(i, std::min(lo * Bucket, count), [&](const std::string& str)
+		{
+			if (!pred(str)) return false;
+			++i;
+			return true;
+		});
+		return i;
+	}
+
+	size_t LowerBound(const std::string& key) const
+	{
+		return PartitionPoint([&](const std::string& s) { return s < key; });
+	}
+
+	size_t PrefixEnd(const std::string& prefix) const
+	{
+		return PartitionPoint([&](const std::string& s) { return s.compare(0, prefix.length(), prefix) <= 0; });
+	}
+
+	bool Contains(const std::string& key) const
+	{
+		auto found = false;
+		Scan(LowerBound(key), count, [&](const std::string& s)
+		{
+			found = s == key;
+			return false;
+		});
+		return found;
+	}
+
+	// Decode [from, to) in order; f returns false to stop early.
+	template <typename F>
+	void Scan(const size_t from, const size_t to, F f) const
+	{
+		if (from >= to) return;
+		std::string s;
+		auto p = data.data() + heads[from / Bucket];
+		for (auto i = from / Bucket * Bucket; i < to; ++i)
+		{
+			if (i % Bucket == 0)
+			{
+				p = data.data() + heads[i / Bucket];
+				const auto len = GetVarint(p);
+				s.assign(p, len);
+				p += len;
+			}
+			else
+			{
+				const auto shared = GetVarint(p);
+				const auto len = GetVarint(p);
+				s.resize(shared);
+				s.append(p, len);
+				p += len;
+			}
+			if (i >= from && !f(s)) return;
+		}
+	}
+
+private:
+	static const size_t Bucket = 16;
+
+	void PutVarint(uint64_t v)
+	{
+		for (; v >= 0x80; v >>= 7) data.push_back(static_cast<char>(v | 0x80));
+		data.push_back(static_cast<char>(v));
+	}
+
+	static uint64_t GetVarint(const char*& p)
+	{
+		uint64_t v = 0;
+		for (auto shift = 0;; shift += 7)
+		{
+			const auto b = static_cast<uint8_t>(*p++);
+			v |= static_cast<uint64_t>(b & 0x7f) << shift;
+			if (!(b & 0x80)) return v;
+		}
+	}
+
+	std::vector<char> data;
+	std::vector<uint64_t> heads;
+	size_t count = 0;
+	std::string last;
+};
+
+bool GlobMatch(const char* p, const char* s)
+{
+	const char* star = nullptr;
+	const char* resume = nullptr;
+	while (*s)
+	{
+		if (*p == '*')
+		{
+			star = ++p;
+			resume = s;
+			continue;
+		}
+		auto ok = false;
+		auto next = p + 1;
+		if (*p == '?')
+		{
+			ok = true;
+		}
+		else if (*p == '[')
 		{
-			auto href = PathCombine(fn, "");
-			AddDir(dirs, UrlEncode(href.c_str(), href.length()), PathCombine(_fn.substr(len).c_str(), ""));
+			auto q = p + 1;
+			const auto negate = *q == '!' || *q == '^';
+			if (negate) ++q;
+			auto in = false;
+			for (auto first = true; *q && (first || *q != ']'); first = false, ++q)
+			{
+				if (q[1] == '-' && q[2] && q[2] != ']')
+				{
+					in |= *s >= *q && *s <= q[2];
+					q += 2;
+				}
+				else in |= *s == *q;
+			}
+			if (*q == ']')
+			{
+				ok = in != negate;
+				next = q + 1;
+			}
+			else ok = *s == '[';
 		}
 		else
 		{
-			AddFile(files, UrlEncode(_fn.c_str(), _fn.length()), _fn.substr(len), std::to_string(FileSize(_fn.c_str())));
+			ok = *p && *p == *s;
+		}
+		if (ok)
+		{
+			p = next;
+			++s;
 		}
+		else if (star)
+		{
+			p = star;
+			s = ++resume;
+		}
+		else return false;
+	}
+	while (*p == '*') ++p;
+	return !*p;
+}
+
+struct SnapshotHeader
+{
+	char magic[8];
+	uint32_t version;
+	uint32_t endian;
+	uint32_t headerSize;
+	uint32_t nodeSize;
+	uint64_t nodeCount;
+	uint64_t nodesOffset;
+	uint64_t namesOffset;
+	uint64_t namesSize;
+	int64_t created;
+};
+
+// Children of a directory are contiguous and sorted like ListDirectory, directories comparing with their trailing separator.
+// Node 0 is the root and carries the full IndexPath as its name.
+struct SnapshotNode
+{
+	enum { Directory = 1 };
+
+	uint64_t nameOffset;
+	uint64_t size;
+	int64_t mtime;
+	uint64_t firstChild;
+	uint64_t childCount;
+	uint32_t nameLen;
+	uint32_t flags;
+};
+
+#define SnapshotMagic "HAISSNAP"
+#define SnapshotVersion 1
+#define SnapshotEndian 0x01020304
+
+// A read-only memory mapping of a snapshot file; nothing is parsed, nodes are read in place.
+// Directories are served from it until the background reconciler has listed them live.
+class TreeSnapshot
+{
+public:
+	static const uint64_t npos = ~0ULL;
+
+	static std::shared_ptr<TreeSnapshot> Load(const std::string& file, const std::string& root)
+	{
+		const auto start = std::chrono::steady_clock::now();
+		auto snap = std::make_shared<TreeSnapshot>();
+		if (!snap->Map(file)) return nullptr;
+		const auto h = reinterpret_cast<const SnapshotHeader*>(snap->data);
+		if (snap->length < sizeof(SnapshotHeader) ||
+			memcmp(h->magic, SnapshotMagic, 8) ||
+			h->version != SnapshotVersion ||
+			h->endian != SnapshotEndian ||
+			h->headerSize != sizeof(SnapshotHeader) ||
+			h->nodeSize != sizeof(SnapshotNode) ||
+			!h->nodeCount ||
+			h->nodesOffset > snap->length ||
+			h->nodeCount > (snap->length - h->nodesOffset) / sizeof(SnapshotNode) ||
+			h->namesOffset > snap->length ||
+			h->namesSize > snap->length - h->namesOffset)
+		{
+			fprintf(stderr, "%s is not a usable snapshot, ignoring it\n", file.c_str());
+			return nullptr;
+		}
+		snap->header = h;
+		snap->nodes = reinterpret_cast<const SnapshotNode*>(snap->data + h->nodesOffset);
+		snap->names = snap->data + h->namesOffset;
+		// Child ranges come after their parent and after every earlier range, as WriteSnapshot lays
+		// them out breadth first, so every node has at most one parent and walks always end.
+		uint64_t claimed = 1;
+		for (uint64_t i = 0; i < h->nodeCount; ++i)
+		{
+			const auto& n = snap->nodes[i];
+			if (!n.childCount) continue;
+			if (n.firstChild <= i || n.firstChild < claimed || n.firstChild > h->nodeCount || n.childCount > h->nodeCount - n.firstChild)
+			{
+				fprintf(stderr, "%s has a bad child range at node %llu, ignoring it\n", file.c_str(), static_cast<unsigned long long>(i));
+				return nullptr;
+			}
+			claimed = n.firstChild + n.childCount;
+		}
+		if (PathCombine(snap->Name(snap->nodes[0]).c_str(), "") != PathCombine(root.c_str(), ""))
+		{
+			fprintf(stderr, "%s was taken of %s, ignoring it\n", file.c_str(), snap->Name(snap->nodes[0]).c_str());
+			return nullptr;
+		}
+		snap->reconciled.reset(new std::atomic<uint8_t>[h->nodeCount]());
+		snap->loadUs = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count();
+		return snap;
+	}
+
+	~TreeSnapshot()
+	{
+#ifdef _MSC_VER
+		if (data) UnmapViewOfFile(data);
+		if (mapping) CloseHandle(mapping);
+		if (handle != INVALID_HANDLE_VALUE) CloseHandle(handle);
+#else
+		if (data) munmap(const_cast<char*>(data), length);
+#endif
+	}
+
+	uint64_t Size() const { return header->nodeCount; }
+
+	const SnapshotNode& Node(const uint64_t i) const { return nodes[i]; }
+
+	std::string Name(const SnapshotNode& n) const
+	{
+		if (n.nameOffset > header->namesSize || n.nameLen > header->namesSize - n.nameOffset) return std::string();
+		return std::string(names + n.nameOffset, n.nameLen);
+	}
+
+	// Node of an absolute directory path, or npos when it is outside the snapshot.
+	uint64_t Find(const std::string& path) const
+	{
+		const auto base = PathCombine(Name(nodes[0]).c_str(), "");
+		const auto full = PathCombine(path.c_str(), "");
+		if (full.compare(0, base.length(), base)) return npos;
+		uint64_t idx = 0;
+		for (auto pos = base.length(); pos < full.length();)
+		{
+			const auto next = full.find(SplitChar[0], pos);
+			idx = Child(idx, full.substr(pos, next - pos + 1));
+			if (idx == npos) return npos;
+			pos = next + 1;
+		}
+		return idx;
+	}
+
+	bool Reconciled(const uint64_t i) const { return reconciled[i].load(std::memory_order_relaxed); }
+
+	void MarkReconciled(const uint64_t i)
+	{
+		if (!reconciled[i].exchange(1)) ++reconciledCount;
+	}
+
+	// Lists the same entries as GetFiles.
+	void Render(const uint64_t idx, std::vector<ArchiveEntry>& entries) const
+	{
+		const auto& node = nodes[idx];
+		for (auto i = node.firstChild; i < node.firstChild + node.childCount && i < header->nodeCount; ++i)
+		{
+			ArchiveEntry e;
+			e.dir = nodes[i].flags & SnapshotNode::Directory;
+			e.rel = e.dir ? PathCombine(Name(nodes[i]).c_str(), "") : Name(nodes[i]);
+			e.size = nodes[i].size;
+			entries.push_back(std::move(e));
+		}
+	}
+
+	std::string Stats() const
+	{
+		std::ostringstream oss;
+		oss << "snapshot nodes=" << header->nodeCount <<
+			" reconciled=" << reconciledCount.load() <<
+			" bytes=" << length <<
+			" load-us=" << loadUs;
+		return oss.str();
+	}
+
+private:
+	bool Map(const std::string& file)
+	{
+#ifdef _MSC_VER
+		handle = CreateFile(file.c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_DELETE, nullptr, OPEN_EXISTING, 0, nullptr);
+		if (handle == INVALID_HANDLE_VALUE) return false;
+		LARGE_INTEGER size;
+		if (!GetFileSizeEx(handle, &size) || !size.QuadPart) return false;
+		length = size.QuadPart;
+		mapping = CreateFileMapping(handle, nullptr, PAGE_READONLY, 0, 0, nullptr);
+		if (!mapping) return false;
+		data = static_cast<const char*>(MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0));
+#else
+		const auto fd = open(file.c_str(), O_RDONLY | O_CLOEXEC);
+		if (fd < 0) return false;
+		struct stat st {};
+		if (fstat(fd, &st) < 0 || !st.st_size)
+		{
+			::close(fd);
+			return false;
+		}
+		length = st.st_size;
+		const auto p = mmap(nullptr, length, PROT_READ, MAP_SHARED, fd, 0);
+		::close(fd);
+		data = p == MAP_FAILED ? nullptr : static_cast<const char*>(p);
+#endif
+		return data != nullptr;
+	}
+
+	uint64_t Child(const uint64_t idx, const std::string& key) const
+	{
+		const auto& node = nodes[idx];
+		if (!(node.flags & SnapshotNode::Directory)) return npos;
+		auto lo = node.firstChild;
+		auto hi = std::min(node.firstChild + node.childCount, header->nodeCount);
+		while (lo < hi)
+		{
+			const auto mid = lo + (hi - lo) / 2;
+			const auto name = Name(nodes[mid]) + (nodes[mid].flags & SnapshotNode::Directory ? SplitChar : "");
+			const auto c = name.compare(key);
+			if (!c) return mid;
+			if (c < 0) lo = mid + 1;
+			else hi = mid;
+		}
+		return npos;
 	}
-	if (dir) closedir(dir);
+
+#ifdef _MSC_VER
+	HANDLE handle = INVALID_HANDLE_VALUE;
+	HANDLE mapping = nullptr;
 #endif
+	const char* data = nullptr;
+	uint64_t length = 0;
+	const SnapshotHeader* header = nullptr;
+	const SnapshotNode* nodes = nullptr;
+	const char* names = nullptr;
+	std::unique_ptr<std::atomic<uint8_t>[]> reconciled;
+	std::atomic<uint64_t> reconciledCount{0};
+	int64_t loadUs = 0;
+};
+
+static std::mutex SnapMtx;
+static std::shared_ptr<TreeSnapshot> Snap;
+
+std::shared_ptr<TreeSnapshot> CurrentSnapshot()
+{
+	std::lock_guard<std::mutex> lock(SnapMtx);
+	return Snap;
 }
 
-#define GetHttpUrl(url, http, sm)\
-	std::regex_search(http, sm, std::regex("(POST|GET) .+? HTTP"));\
-	const auto (url) = std::regex_replace((sm)[0].str(), std::regex("(POST |GET | HTTP|)"), "")
+// Most matches one search returns, whatever its limit asks for.
+#define SearchMaxLimit 10000
 
-static const std::map<std::string, std::string> ContentTypeTable =
+// Every path below IndexPath, relative to it, with directories suffixed by the separator.
+// The bulk lives in an immutable front-coded array; inotify changes collect in small added/removed
+// sets that are folded into a new array once they grow.
+class PathIndex
 {
-	{"tif", "image/tiff"},
-	{"001", "application/x-001"},
-	{"301", "application/x-301"},
-	{"323", "text/h323"},
-	{"906", "application/x-906"},
-	{"907", "drawing/907"},
-	{"a11", "application/x-a11"},
-	{"acp", "audio/x-mei-aac"},
-	{"ai", "application/postscript"},
-	{"aif", "audio/aiff"},
-	{"aifc", "audio/aiff"},
-	{"aiff", "audio/aiff"},
-	{"anv", "application/x-anv"},
-	{"asa", "text/asa"},
-	{"asf", "video/x-ms-asf"},
-	{"asp", "text/asp"},
-	{"asx", "video/x-ms-asf"},
-	{"au", "audio/basic"},
-	{"avi", "video/avi"},
-	{"awf", "application/vnd.adobe.workflow"},
-	{"biz", "text/xml"},
-	{"bmp", "application/x-bmp"},
-	{"bot", "application/x-bot"},
-	{"c4t", "application/x-c4t"},
-	{"c90", "application/x-c90"},
-	{"cal", "application/x-cals"},
-	{"cat", "application/vnd.ms-pki.seccat"},
-	{"cdf", "application/x-netcdf"},
-	{"cdr", "application/x-cdr"},
-	{"cel", "application/x-cel"},
-	{"cer", "application/x-x509-ca-cert"},
-	{"cg4", "application/x-g4"},
-	{"cgm", "application/x-cgm"},
-	{"cit", "application/x-cit"},
-	{"class", "java/*"},
-	{"cml", "text/xml"},
-	{"cmp", "application/x-cmp"},
-	{"cmx", "application/x-cmx"},
-	{"cot", "application/x-cot"},
-	{"crl", "application/pkix-crl"},
-	{"crt", "application/x-x509-ca-cert"},
-	{"csi", "application/x-csi"},
-	{"css", "text/css"},
-	{"cut", "application/x-cut"},
-	{"dbf", "application/x-dbf"},
-	{"dbm", "application/x-dbm"},
-	{"dbx", "application/x-dbx"},
-	{"dcd", "text/xml"},
-	{"dcx", "application/x-dcx"},
-	{"der", "application/x-x509-ca-cert"},
-	{"dgn", "application/x-dgn"},
-	{"dib", "application/x-dib"},
-	{"dll", "application/x-msdownload"},
+public:
+	explicit PathIndex(std::string root) : root(std::move(root)), base(std::make_shared<FrontCodedArray>())
+	{
+	}
+
+	// Walks the tree with one disk-stage task per directory, so the walk fans out over every disk thread.
+	void Build()
+	{
+		const auto start = std::chrono::steady_clock::now();
+		std::mutex mtx;
+		std::condition_variable cv;
+		size_t pending = 1;
+		std::vector<std::string> all;
+		std::function<void(const std::string&)> visit = [&](const std::string& rel)
+		{
+			AddWatch(rel);
+			std::vector<ArchiveEntry> children;
+			ListDirectory(root, rel, children);
+			std::vector<std::string> dirs;
+			{
+				std::lock_guard<std::mutex> lock(mtx);
+				for (auto& e : children)
+				{
+					if (e.dir) dirs.push_back(e.rel);
+					all.push_back(std::move(e.rel));
+				}
+				pending += dirs.size();
+			}
+			for (auto& d : dirs) DiskStage->Submit([&visit, d]() { visit(d); });
+			std::lock_guard<std::mutex> lock(mtx);
+			if (!--pending) cv.notify_all();
+		};
+		DiskStage->Submit([&visit]() { visit(""); });
+		{
+			std::unique_lock<std::mutex> lock(mtx);
+			cv.wait(lock, [&]() { return !pending; });
+		}
+		std::sort(all.begin(), all.end());
+		auto fresh = std::make_shared<FrontCodedArray>();
+		for (auto& s : all) fresh->Append(s);
+		Publish(fresh, start);
+	}
+
+	// Snapshot children are stored in path order, so a depth-first walk yields the sorted array directly.
+	void BuildFrom(const TreeSnapshot& snap)
+	{
+		const auto start = std::chrono::steady_clock::now();
+		auto fresh = std::make_shared<FrontCodedArray>();
+		std::vector<std::pair<uint64_t, std::string>> stack{{0, ""}};
+		while (!stack.empty())
+		{
+			const auto item = std::move(stack.back());
+			stack.pop_back();
+			const auto& node = snap.Node(item.first);
+			if (item.first) fresh->Append(item.second);
+			if (!(node.flags & SnapshotNode::Directory)) continue;
+			AddWatch(item.second);
+			const auto end = std::min(node.firstChild + node.childCount, snap.Size());
+			for (auto i = end; i-- > node.firstChild && i > item.first;)
+			{
+				const auto& child = snap.Node(i);
+				stack.emplace_back(i, item.second + snap.Name(child) + (child.flags & SnapshotNode::Directory ? SplitChar : ""));
+			}
+		}
+		Publish(fresh, start);
+	}
+
+	// Applies inotify events for as long as the process runs.
+	void Watch()
+	{
+#ifndef _MSC_VER
+		if (inotifyFd < 0) return;
+		alignas(inotify_event) char buf[65536];
+		ssize_t len;
+		while ((len = read(inotifyFd, buf, sizeof(buf))) > 0)
+		{
+			for (auto p = buf; p < buf + len;)
+			{
+				const auto ev = reinterpret_cast<inotify_event*>(p);
+				p += sizeof(inotify_event) + ev->len;
+				if (ev->mask & IN_Q_OVERFLOW)
+				{
+					warn("inotify queue overflow, rebuilding path index");
+					Build();
+					break;
+				}
+				std::string dir;
+				{
+					std::lock_guard<std::mutex> lock(watchMtx);
+					const auto w = watches.find(ev->wd);
+					if (w == watches.end()) continue;
+					if (ev->mask & IN_IGNORED)
+					{
+						watched.erase(w->second);
+						watches.erase(w);
+						continue;
+					}
+					dir = w->second;
+				}
+				if (!ev->len) continue;
+				const auto isDir = (ev->mask & IN_ISDIR) != 0;
+				const auto rel = dir + ev->name + (isDir ? SplitChar : "");
+				if (ev->mask & (IN_CREATE | IN_MOVED_TO))
+				{
+					if (isDir) AddTree(rel);
+					else Add(rel);
+				}
+				else if (ev->mask & (IN_DELETE | IN_MOVED_FROM))
+				{
+					if (isDir) RemoveTree(rel);
+					else Remove(rel);
+				}
+			}
+			if (DeltaSize() > std::max<size_t>(65536, base->Size() / 16)) Compact();
+		}
+#endif
+	}
+
+	struct Query
+	{
+		std::string scope;
+		std::string mode;
+		std::string pattern;
+		size_t limit;
+	};
+
+	// Scans the matching range in parallel on the disk stage and calls done with sorted relative paths.
+	void Search(const Query& q, std::function<void(std::vector<std::string>)> done)
+	{
+		std::shared_ptr<const FrontCodedArray> snapshot;
+		{
+			std::lock_guard<std::mutex> lock(baseMtx);
+			snapshot = base;
+		}
+		const auto prefix = q.mode == "prefix" ? q.scope + q.pattern : q.scope;
+		const auto lo = snapshot->LowerBound(prefix);
+		const auto hi = snapshot->PrefixEnd(prefix);
+		const auto slices = std::max<size_t>(1, std::min<size_t>((hi - lo) / 65536 + 1, 64));
+		struct State
+		{
+			std::vector<std::vector<std::string>> results;
+			std::atomic<size_t> left;
+		};
+		auto state = std::make_shared<State>();
+		state->results.resize(slices);
+		state->left = slices;
+		const auto match = Matcher(q);
+		for (size_t i = 0; i < slices; ++i)
+		{
+			const auto from = lo + (hi - lo) * i / slices;
+			const auto to = lo + (hi - lo) * (i + 1) / slices;
+			DiskStage->Submit([this, snapshot, state, match, q, prefix, from, to, i, done]()
+			{
+				auto& out = state->results[i];
+				snapshot->Scan(from, to, [&](const std::string& s)
+				{
+					if (match(s)) out.push_back(s);
+					return out.size() < q.limit;
+				});
+				if (--state->left) return;
+				std::vector<std::string> res;
+				for (auto& r : state->results) res.insert(res.end(), r.begin(), r.end());
+				{
+					std::shared_lock<std::shared_mutex> lock(deltaMtx);
+					res.erase(std::remove_if(res.begin(), res.end(), [&](const std::string& s)
+					{
+						return removed.count(s) != 0;
+					}), res.end());
+					for (auto a = added.lower_bound(prefix); a != added.end() && !a->compare(0, prefix.length(), prefix); ++a)
+					{
+						if (match(*a)) res.push_back(*a);
+					}
+				}
+				std::sort(res.begin(), res.end());
+				if (res.size() > q.limit) res.resize(q.limit);
+				done(std::move(res));
+			});
+		}
+	}
+
+	bool Ready() const { return ready; }
+
+	const std::string& Root() const { return root; }
+
+	std::string Stats()
+	{
+		std::shared_ptr<const FrontCodedArray> snapshot;
+		{
+			std::lock_guard<std::mutex> lock(baseMtx);
+			snapshot = base;
+		}
+		std::shared_lock<std::shared_mutex> lock(deltaMtx);
+		uint64_t deltaBytes = 0;
+		for (auto& s : added) deltaBytes += s.capacity() + 64;
+		for (auto& s : removed) deltaBytes += s.capacity() + 64;
+		std::ostringstream oss;
+		oss << "path-index ready=" << ready.load() <<
+			" entries=" << snapshot->Size() <<
+			" added=" << added.size() <<
+			" removed=" << removed.size() <<
+			" bytes=" << snapshot->Bytes() + deltaBytes <<
+			" build-ms=" << buildMs.load() <<
+			" watches=" << WatchCount();
+		return oss.str();
+	}
+
+private:
+	std::function<bool(const std::string&)> Matcher(const Query& q) const
+	{
+		const auto skip = q.scope.length();
+		if (q.mode == "prefix") return [](const std::string&) { return true; };
+		if (q.mode == "glob")
+		{
+			const auto path = q.pattern.find_first_of("/\\") != std::string::npos;
+			return [pattern = q.pattern, skip, path](const std::string& s)
+			{
+				auto name = s.substr(skip);
+				if (!name.empty() && (name.back() == '/' || name.back() == '\\')) name.pop_back();
+				if (!path) name = name.substr(name.find_last_of("/\\") + 1);
+				return GlobMatch(pattern.c_str(), name.c_str());
+			};
+		}
+		return [pattern = q.pattern, skip](const std::string& s) { return s.find(pattern, skip) != std::string::npos; };
+	}
+
+	void AddWatch(const std::string& rel)
+	{
+#ifndef _MSC_VER
+		if (inotifyFd < 0) return;
+		const auto wd = inotify_add_watch(
+			inotifyFd,
+			PathCombine(root.c_str(), rel.c_str()).c_str(),
+			IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_ONLYDIR);
+		if (wd < 0)
+		{
+			if (!watchWarned.exchange(true)) warn("Can't watch %s, path index will miss later changes", rel.c_str());
+			return;
+		}
+		std::lock_guard<std::mutex> lock(watchMtx);
+		watches[wd] = rel;
+		watched[rel] = wd;
+#endif
+	}
+
+	size_t WatchCount()
+	{
+		std::lock_guard<std::mutex> lock(watchMtx);
+		return watches.size();
+	}
+
+	size_t DeltaSize()
+	{
+		std::shared_lock<std::shared_mutex> lock(deltaMtx);
+		return added.size() + removed.size();
+	}
+
+	bool InBase(const std::string& rel)
+	{
+		std::lock_guard<std::mutex> lock(baseMtx);
+		return base->Contains(rel);
+	}
+
+public:
+	// Writers may come from the inotify thread and the snapshot reconciler at once; writeMtx orders them against Compact.
+	void Add(const std::string& rel)
+	{
+		std::lock_guard<std::mutex> writeLock(writeMtx);
+		const auto inBase = InBase(rel);
+		std::unique_lock<std::shared_mutex> lock(deltaMtx);
+		if (inBase) removed.erase(rel);
+		else added.insert(rel);
+	}
+
+	void Remove(const std::string& rel)
+	{
+		std::lock_guard<std::mutex> writeLock(writeMtx);
+		const auto inBase = InBase(rel);
+		std::unique_lock<std::shared_mutex> lock(deltaMtx);
+		added.erase(rel);
+		if (inBase) removed.insert(rel);
+	}
+
+	void AddDirectory(const std::string& rel)
+	{
+		Add(rel);
+		AddWatch(rel);
+	}
+
+	void AddTree(const std::string& rel)
+	{
+		Add(rel);
+		AddWatch(rel);
+		std::vector<ArchiveEntry> entries;
+		WalkTree(root, rel, entries);
+		for (auto& e : entries)
+		{
+			Add(e.rel);
+			if (e.dir) AddWatch(e.rel);
+		}
+	}
+
+	// A directory's subtree is a contiguous range of the sorted array, so it is removed entry by entry.
+	void RemoveTree(const std::string& rel)
+	{
+		std::shared_ptr<const FrontCodedArray> snapshot;
+		{
+			std::lock_guard<std::mutex> lock(baseMtx);
+			snapshot = base;
+		}
+		{
+			std::lock_guard<std::mutex> writeLock(writeMtx);
+			std::unique_lock<std::shared_mutex> lock(deltaMtx);
+			snapshot->Scan(snapshot->LowerBound(rel), snapshot->PrefixEnd(rel), [&](const std::string& s)
+			{
+				removed.insert(s);
+				return true;
+			});
+			for (auto a = added.lower_bound(rel); a != added.end() && !a->compare(0, rel.length(), rel);)
+				a = added.erase(a);
+		}
+#ifndef _MSC_VER
+		std::lock_guard<std::mutex> lock(watchMtx);
+		for (auto w = watched.lower_bound(rel); w != watched.end() && !w->first.compare(0, rel.length(), rel);)
+		{
+			inotify_rm_watch(inotifyFd, w->second);
+			watches.erase(w->second);
+			w = watched.erase(w);
+		}
+#endif
+	}
+
+private:
+	void Publish(const std::shared_ptr<FrontCodedArray>& fresh, const std::chrono::steady_clock::time_point start)
+	{
+		fresh->ShrinkToFit();
+		std::lock_guard<std::mutex> writeLock(writeMtx);
+		{
+			std::lock_guard<std::mutex> lock(baseMtx);
+			base = fresh;
+		}
+		{
+			std::unique_lock<std::shared_mutex> lock(deltaMtx);
+			added.clear();
+			removed.clear();
+		}
+		buildMs = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start).count();
+		ready = true;
+	}
+
+	// Merge the base with the delta into a new array; searches keep using the old one until the swap.
+	void Compact()
+	{
+		std::lock_guard<std::mutex> writeLock(writeMtx);
+		std::shared_ptr<const FrontCodedArray> old;
+		{
+			std::lock_guard<std::mutex> lock(baseMtx);
+			old = base;
+		}
+		auto fresh = std::make_shared<FrontCodedArray>();
+		{
+			std::shared_lock<std::shared_mutex> lock(deltaMtx);
+			auto a = added.begin();
+			old->Scan(0, old->Size(), [&](const std::string& s)
+			{
+				for (; a != added.end() && *a < s; ++a) fresh->Append(*a);
+				if (!removed.count(s)) fresh->Append(s);
+				return true;
+			});
+			for (; a != added.end(); ++a) fresh->Append(*a);
+		}
+		fresh->ShrinkToFit();
+		std::unique_lock<std::shared_mutex> lock(deltaMtx);
+		{
+			std::lock_guard<std::mutex> baseLock(baseMtx);
+			base = fresh;
+		}
+		added.clear();
+		removed.clear();
+	}
+
+	std::string root;
+	std::mutex baseMtx;
+	std::shared_ptr<const FrontCodedArray> base;
+	std::shared_mutex deltaMtx;
+	std::mutex writeMtx;
+	std::set<std::string> added;
+	std::set<std::string> removed;
+	std::atomic<bool> ready{false};
+	std::atomic<int64_t> buildMs{0};
+	std::mutex watchMtx;
+	std::map<int, std::string> watches;
+	std::map<std::string, int> watched;
+	std::atomic<bool> watchWarned{false};
+#ifdef _MSC_VER
+	int inotifyFd = -1;
+#else
+	int inotifyFd = inotify_init1(IN_CLOEXEC);
+#endif
+};
+
+static PathIndex* Paths = nullptr;
+
+// Lists the live tree breadth-first into a new snapshot next to file, then renames it over file.
+// Breadth-first order keeps every directory's children contiguous, and since directories are listed in node order,
+// only the nodes after the one being listed are still waiting for their child range and need to stay in memory.
+// When old is given, each of its directories is marked reconciled once listed and differences go to diff.
+bool WriteSnapshot(
+	const std::string& root,
+	const std::string& file,
+	TreeSnapshot* old,
+	const std::function<void(const std::string&, bool)>& diff)
+{
+	// The reconcile loop and a handoff may both rewrite file; they share the temp names.
+	static std::mutex writing;
+	std::lock_guard<std::mutex> lock(writing);
+	const auto tmp = file + ".tmp";
+	const auto namesTmp = file + ".names.tmp";
+	const auto fp = fopen(tmp.c_str(), "wb");
+	const auto names = fopen(namesTmp.c_str(), "w+b");
+	if (!fp || !names)
+	{
+		if (fp) fclose(fp);
+		if (names) fclose(names);
+		fprintf(stderr, "Can't write snapshot %s\n", file.c_str());
+		return false;
+	}
+	SnapshotHeader header{};
+	memcpy(header.magic, SnapshotMagic, 8);
+	header.version = SnapshotVersion;
+	header.endian = SnapshotEndian;
+	header.headerSize = sizeof(SnapshotHeader);
+	header.nodeSize = sizeof(SnapshotNode);
+	header.nodesOffset = sizeof(SnapshotHeader);
+	header.created = time(nullptr);
+	fwrite(&header, sizeof(header), 1, fp);
+
+	std::deque<SnapshotNode> pending;
+	uint64_t flushed = 0;
+	uint64_t count = 0;
+	uint64_t namesSize = 0;
+	const auto append = [&](const std::string& name, const ArchiveEntry* e)
+	{
+		SnapshotNode node{};
+		node.nameOffset = namesSize;
+		node.nameLen = name.length();
+		node.flags = !e || e->dir ? SnapshotNode::Directory : 0;
+		node.size = e ? e->size : 0;
+		node.mtime = e ? e->mtime : 0;
+		fwrite(name.data(), 1, name.length(), names);
+		namesSize += name.length();
+		pending.push_back(node);
+		return count++;
+	};
+	struct Dir
+	{
+		std::string rel;
+		uint64_t idx;
+		uint64_t oldIdx;
+	};
+	std::deque<Dir> queue;
+	queue.push_back({"", append(root, nullptr), old ? 0 : TreeSnapshot::npos});
+	while (!queue.empty())
+	{
+		const auto dir = std::move(queue.front());
+		queue.pop_front();
+		for (; flushed < dir.idx; ++flushed)
+		{
+			fwrite(&pending.front(), sizeof(SnapshotNode), 1, fp);
+			pending.pop_front();
+		}
+		std::vector<ArchiveEntry> children;
+		ListDirectory(root, dir.rel, children);
+		auto& node = pending.front();
+		node.firstChild = count;
+		node.childCount = children.size();
+
+		std::vector<std::pair<std::string, uint64_t>> oldChildren;
+		if (dir.oldIdx != TreeSnapshot::npos)
+		{
+			const auto& o = old->Node(dir.oldIdx);
+			for (auto i = o.firstChild; i < o.firstChild + o.childCount && i < old->Size(); ++i)
+			{
+				const auto isDir = (old->Node(i).flags & SnapshotNode::Directory) != 0;
+				oldChildren.emplace_back(dir.rel + old->Name(old->Node(i)) + (isDir ? SplitChar : ""), i);
+			}
+		}
+		auto o = oldChildren.begin();
+		for (auto& e : children)
+		{
+			for (; o != oldChildren.end() && o->first < e.rel; ++o)
+			{
+				if (diff) diff(o->first, false);
+			}
+			const auto matched = o != oldChildren.end() && o->first == e.rel;
+			if (!matched && diff && dir.oldIdx != TreeSnapshot::npos) diff(e.rel, true);
+			auto name = e.rel.substr(dir.rel.length());
+			if (e.dir) name.pop_back();
+			const auto idx = append(name, &e);
+			if (e.dir) queue.push_back({e.rel, idx, matched ? o->second : TreeSnapshot::npos});
+			if (matched) ++o;
+		}
+		for (; o != oldChildren.end(); ++o)
+		{
+			if (diff) diff(o->first, false);
+		}
+		// Children of a directory that is new since the old snapshot are new as well.
+		if (old && dir.oldIdx == TreeSnapshot::npos && diff)
+		{
+			for (auto& e : children) diff(e.rel, true);
+		}
+		if (dir.oldIdx != TreeSnapshot::npos) old->MarkReconciled(dir.oldIdx);
+	}
+	for (auto& node : pending) fwrite(&node, sizeof(SnapshotNode), 1, fp);
+
+	header.nodeCount = count;
+	header.namesOffset = header.nodesOffset + count * sizeof(SnapshotNode);
+	header.namesSize = namesSize;
+	rewind(names);
+	char buf[TransferChunk];
+	size_t len;
+	while ((len = fread(buf, 1, sizeof(buf), names))) fwrite(buf, 1, len, fp);
+	fclose(names);
+	remove(namesTmp.c_str());
+	rewind(fp);
+	fwrite(&header, sizeof(header), 1, fp);
+	const auto ok = !ferror(fp);
+	if (fclose(fp) || !ok)
+	{
+		remove(tmp.c_str());
+		fprintf(stderr, "Can't write snapshot %s\n", file.c_str());
+		return false;
+	}
+#ifdef _MSC_VER
+	return MoveFileEx(tmp.c_str(), file.c_str(), MOVEFILE_REPLACE_EXISTING) != 0;
+#else
+	return !rename(tmp.c_str(), file.c_str());
+#endif
+}
+
+// Serves from an existing snapshot while every directory is listed live once in the background,
+// then drops the mapping and rewrites the file; with --snapshot-interval the rewrite repeats.
+void ReconcileSnapshot(const std::string& root, const std::string& file, std::shared_ptr<TreeSnapshot> old, const bool seeded)
+{
+	const auto interval = GetOptionInt("snapshot-interval", 0);
+	while (true)
+	{
+		const auto start = std::chrono::steady_clock::now();
+		WriteSnapshot(root, file, old.get(), seeded && old && Paths ? [](const std::string& rel, const bool added)
+		{
+			const auto dir = rel.back() == SplitChar[0];
+			if (added && dir) Paths->AddDirectory(rel);
+			else if (added) Paths->Add(rel);
+			else if (dir) Paths->RemoveTree(rel);
+			else Paths->Remove(rel);
+		} : std::function<void(const std::string&, bool)>());
+		printf("snapshot %s written in %lld ms\n", file.c_str(), static_cast<long long>(
+			std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start).count()));
+		old = nullptr;
+		{
+			std::lock_guard<std::mutex> lock(SnapMtx);
+			Snap = nullptr;
+		}
+		if (interval <= 0) return;
+		std::this_thread::sleep_for(std::chrono::seconds(interval));
+	}
+}
+
+#define GetHttpUrl(url, http, sm)\
+	std::regex_search(http, sm, std::regex("(POST|GET) .+? HTTP"));\
+	const auto (url) = std::regex_replace((sm)[0].str(), std::regex("(POST |GET | HTTP|)"), "")
+
+static const std::map<std::string, std::string> ContentTypeTable =
+{
+	{"tif", "image/tiff"},
+	{"001", "application/x-001"},
+	{"301", "application/x-301"},
+	{"323", "text/h323"},
+	{"906", "application/x-906"},
+	{"907", "drawing/907"},
+	{"a11", "application/x-a11"},
+	{"acp", "audio/x-mei-aac"},
+	{"ai", "application/postscript"},
+	{"aif", "audio/aiff"},
+	{"aifc", "audio/aiff"},
+	{"aiff", "audio/aiff"},
+	{"anv", "application/x-anv"},
+	{"asa", "text/asa"},
+	{"asf", "video/x-ms-asf"},
+	{"asp", "text/asp"},
+	{"asx", "video/x-ms-asf"},
+	{"au", "audio/basic"},
+	{"avi", "video/avi"},
+	{"awf", "application/vnd.adobe.workflow"},
+	{"biz", "text/xml"},
+	{"bmp", "application/x-bmp"},
+	{"bot", "application/x-bot"},
+	{"c4t", "application/x-c4t"},
+	{"c90", "application/x-c90"},
+	{"cal", "application/x-cals"},
+	{"cat", "application/vnd.ms-pki.seccat"},
+	{"cdf", "application/x-netcdf"},
+	{"cdr", "application/x-cdr"},
+	{"cel", "application/x-cel"},
+	{"cer", "application/x-x509-ca-cert"},
+	{"cg4", "application/x-g4"},
+	{"cgm", "application/x-cgm"},
+	{"cit", "application/x-cit"},
+	{"class", "java/*"},
+	{"cml", "text/xml"},
+	{"cmp", "application/x-cmp"},
+	{"cmx", "application/x-cmx"},
+	{"cot", "application/x-cot"},
+	{"crl", "application/pkix-crl"},
+	{"crt", "application/x-x509-ca-cert"},
+	{"csi", "application/x-csi"},
+	{"css", "text/css"},
+	{"cut", "application/x-cut"},
+	{"dbf", "application/x-dbf"},
+	{"dbm", "application/x-dbm"},
+	{"dbx", "application/x-dbx"},
+	{"dcd", "text/xml"},
+	{"dcx", "application/x-dcx"},
+	{"der", "application/x-x509-ca-cert"},
+	{"dgn", "application/x-dgn"},
+	{"dib", "application/x-dib"},
+	{"dll", "application/x-msdownload"},
 	{"doc", "application/msword"},
 	{"dot", "application/msword"},
 	{"drw", "application/x-drw"},
@@ -687,222 +2518,5259 @@ std::string GetContentType(const char* path)
 	{
 		if (*i == '.') break;
 	}
-	const auto ct = ContentTypeTable.find(std::string(i + 1));
-	if (ct != ContentTypeTable.end()) return ct->second;
-	return "application/octet-stream";
+	const auto ct = ContentTypeTable.find(std::string(i + 1));
+	if (ct != ContentTypeTable.end()) return ct->second;
+	return "application/octet-stream";
+}
+
+std::string GetHttpUrlWithoutGet(const char* http, const uint32_t size)
+{
+	auto start = 0, end = 0;
+	for (auto i = 0; i < size; ++i)
+	{
+		if (http[i] == ' ')
+		{
+			start = i + 1;
+			break;
+		}
+	}
+	for (auto i = start; i < size; ++i)
+	{
+		if (http[i] == ' ' || http[i] == '?')
+		{
+			end = i;
+			break;
+		}
+	}
+	return !start && !end ? std::string() : std::string(http + start, end - start);
+}
+
+struct Connection;
+int Send(Connection& conn, const char* data, size_t len);
+
+void HttpNotFound(Connection& conn)
+{
+
+	static const auto html =
+		"<html><head><title>404 Not Found</title></head>"
+		"<body>"
+		"<center><h1>404 Not Found</h1></center>"
+		"<hr><center>iriszero/" VERSION "</center>"
+		"</body></html>";
+	static const auto len = strlen(html);
+	std::ostringstream oss;
+	oss <<
+		"HTTP/1.1 404 Not Found\r\n"
+		"Content-Length: " << std::to_string(len) << "\r\n"
+		"Content-Type: text/html\r\n"
+		"Server: iriszero/" VERSION "\r\n"
+		"Connection: close\r\n\r\n" <<
+		html;
+	const auto http = oss.str();
+	printf("<========================\n%s\n", http.c_str());
+	Send(conn, http.c_str(), http.length());
+}
+
+void HttpNotModified(Connection& conn, const char* lastModified)
+{
+	std::ostringstream oss;
+	oss << "HTTP/1.1 304 Not Modified\r\n"
+		"Server: iriszero/" VERSION "\r\n"
+		"Last-Modified: " << lastModified << "\r\n"
+		"Connection: close\r\n\r\n";
+	const auto http = oss.str();
+	printf("<========================\n%s\n", http.c_str());
+	Send(conn, http.c_str(), http.length());
+}
+
+struct TokenBucket
+{
+	double tokens = 0;
+	std::chrono::steady_clock::time_point last{};
+
+	// How long until n bytes fit at rate bytes/s; 0 when they fit now. Never refills past one second of rate.
+	std::chrono::nanoseconds Wait(const uint64_t n, const double rate, const std::chrono::steady_clock::time_point now)
+	{
+		if (rate <= 0) return std::chrono::nanoseconds(0);
+		const auto burst = std::max(rate, static_cast<double>(TransferChunk));
+		if (last == std::chrono::steady_clock::time_point{}) tokens = burst;
+		else tokens = std::min(burst, tokens + rate * std::chrono::duration<double>(now - last).count());
+		last = now;
+		if (tokens >= n) return std::chrono::nanoseconds(0);
+		return std::chrono::nanoseconds(static_cast<int64_t>((n - tokens) / rate * 1e9) + 1);
+	}
+
+	void Take(const uint64_t n, const double rate)
+	{
+		if (rate > 0) tokens -= n;
+	}
+};
+
+class ListingTemplate;
+class ListingCache;
+
+// One tree served by this process. The command line's IndexPath is the first root and --roots adds
+// more, each reached by its Host names or by request paths below it, with its own charset, icon,
+// listing template and cache, and options that override the command line's for its requests.
+struct Root
+{
+	std::string path;
+	std::string coding;
+	std::string icoPath;
+	// Lower case, without a port.
+	std::vector<std::string> hosts;
+	std::map<std::string, std::string> options;
+	ListingTemplate* listingTemplate = nullptr;
+	ListingCache* listings = nullptr;
+	// --rate-conn, looked up once since the transfer scheduler needs it for every slice.
+	double rateConn = 0;
+
+	std::string Option(const char* name, const char* def) const
+	{
+		const auto opt = options.find(name);
+		return opt == options.end() ? GetOption(name, def) : opt->second;
+	}
+
+	int64_t OptionInt(const char* name, const int64_t def) const
+	{
+		const auto opt = options.find(name);
+		return opt == options.end() ? GetOptionInt(name, def) : std::strtoll(opt->second.c_str(), nullptr, 10);
+	}
+};
+
+// The first is the command line's. Never freed, as requests and their tasks point into them.
+static std::vector<Root*> Roots;
+
+// Whether any root turns option on.
+bool AnyRoot(const char* option)
+{
+	for (const auto r : Roots) if (r->OptionInt(option, 0)) return true;
+	return false;
+}
+
+struct H2Stream;
+
+struct Connection
+{
+	int fd = -1;
+	sockaddr_in addr{};
+	// Only touched by the transfer scheduler thread.
+	TokenBucket bucket;
+	// Set when this is one stream of an HTTP/2 connection: responses written here are reframed onto it, and fd is unused.
+	std::shared_ptr<H2Stream> stream;
+	// With stream, the HTTP/2 connection itself: its streams all draw from its bucket, so --rate-conn holds per socket.
+	std::shared_ptr<Connection> parent;
+	// The root Dispatch chose for the request, before anything is read or sent for it.
+	const Root* root = nullptr;
+#ifdef HAIS_TLS
+	// Set once an HTTPS handshake is done; ktlsSend/ktlsRecv when the kernel took over that direction's records.
+	SSL* ssl = nullptr;
+	bool ktlsSend = false;
+	bool ktlsRecv = false;
+#endif
+	// Trace id when this request was sampled by --trace, else 0; the request span runs from start until destruction.
+	uint64_t trace = 0;
+	int64_t start = Tracer::Now();
+	std::string request;
+
+	Connection()
+	{
+		++Live;
+	}
+
+	~Connection();
+
+	// Connections not yet closed, counted so a handed-off instance knows when it has drained.
+	inline static std::atomic<uint64_t> Live{0};
+};
+
+int SendFile(Connection& conn, FILE* fp, uint64_t offset, size_t len);
+bool Defer(Connection& conn, std::function<void(bool)> then);
+
+int SendAll(const int fd, const char* data, size_t len, const int flags = 0)
+{
+	while (len)
+	{
+		const auto sent = send(fd, data, len, flags);
+		if (sent <= 0) return -1;
+		data += sent;
+		len -= sent;
+	}
+	return 0;
+}
+
+#ifndef _MSC_VER
+int SendAllv(const int fd, std::vector<iovec>& iov)
+{
+	size_t i = 0;
+	while (i < iov.size())
+	{
+		const auto sent = writev(fd, &iov[i], static_cast<int>(std::min<size_t>(iov.size() - i, IOV_MAX)));
+		if (sent <= 0) return -1;
+		auto left = static_cast<size_t>(sent);
+		for (; i < iov.size() && left >= iov[i].iov_len; ++i) left -= iov[i].iov_len;
+		if (left)
+		{
+			iov[i].iov_base = static_cast<char*>(iov[i].iov_base) + left;
+			iov[i].iov_len -= left;
+		}
+	}
+	return 0;
+}
+#endif
+
+// Send pieces in order with as few writes as the transport allows.
+int SendGather(Connection& conn, const std::vector<std::pair<const char*, size_t>>& pieces)
+{
+#ifndef _MSC_VER
+#ifdef HAIS_TLS
+	if (!conn.stream && (!conn.ssl || conn.ktlsSend))
+#else
+	if (!conn.stream)
+#endif
+	{
+		std::vector<iovec> iov;
+		iov.reserve(pieces.size());
+		for (const auto& p : pieces)
+		{
+			if (p.second) iov.push_back({const_cast<char*>(p.first), p.second});
+		}
+		return SendAllv(conn.fd, iov);
+	}
+#endif
+	// Every write to an HTTP/2 stream (or a userspace TLS session) becomes frames (records) of its own, so join the pieces first.
+	size_t length = 0;
+	for (const auto& p : pieces) length += p.second;
+	Memory::Lease lease(Memory::Responses, length);
+	std::string joined;
+	joined.reserve(length);
+	for (const auto& p : pieces) joined.append(p.first, p.second);
+	return Send(conn, joined.c_str(), joined.length());
+}
+
+int SendFileAll(const int fd, FILE* fp, uint64_t offset, size_t len)
+{
+#ifdef _MSC_VER
+	std::vector<char> buf(std::min<size_t>(len, TransferChunk));
+	_fseeki64(fp, offset, SEEK_SET);
+	while (len)
+	{
+		const auto read = fread(buf.data(), sizeof(char), std::min(len, buf.size()), fp);
+		if (!read || SendAll(fd, buf.data(), read) < 0) return -1;
+		len -= read;
+	}
+#else
+	auto off = static_cast<off_t>(offset);
+	while (len)
+	{
+		const auto sent = sendfile(fd, fileno(fp), &off, len);
+		if (sent <= 0) return -1;
+		len -= sent;
+	}
+#endif
+	return 0;
+}
+
+struct Transfer
+{
+	std::shared_ptr<Connection> conn;
+	FILE* fp = nullptr;
+	uint64_t offset = 0;
+	uint64_t remaining = 0;
+	size_t len = 0;
+	std::function<void()> done;
+	// Sees every chunk before it is sent; forces a userspace copy when set.
+	std::function<void(const char*, size_t)> observe;
+	// Scheduler state, only touched by the transfer scheduler thread.
+	uint64_t total = 0;
+	uint64_t deficit = 0;
+	bool turn = false;
+	int64_t started = 0;
+	// The chunk being read, while it is copied through user space rather than sent from the page cache.
+	std::unique_ptr<char[]> buf;
+	size_t bufSize = 0;
+
+	void Hold(const size_t n)
+	{
+		buf.reset(new char[n]);
+		bufSize = n;
+		Memory::Charge(Memory::Transfers, n);
+	}
+
+	void Drop()
+	{
+		if (!buf) return;
+		buf.reset();
+		Memory::Release(Memory::Transfers, bufSize);
+		bufSize = 0;
+	}
+
+	~Transfer()
+	{
+		Drop();
+		if (fp) fclose(fp);
+		if (started) Tracer::Record(conn->trace, "transfer", started, std::string(), true);
+	}
+};
+
+void ReadSlice(const std::shared_ptr<Transfer>& t);
+
+// Admits transfer slices onto the disk stage by weighted deficit round robin.
+// Every transfer with a slice ready waits here; at most `inflight` slices are being read at once,
+// which leaves disk threads free for listings and stats, and small transfers get a larger quantum
+// so they finish in a few rounds while multi-GB downloads share what is left.
+// Per-connection and per-IP token buckets hold a transfer back until its next slice fits.
+class TransferScheduler
+{
+public:
+	TransferScheduler(const int inflight, const double connRate, const double ipRate, const uint64_t smallSize) :
+		inflightMax(std::max(1, inflight)), connRate(connRate), ipRate(ipRate), smallSize(smallSize)
+	{
+		std::thread([this]() { Run(); }).detach();
+	}
+
+	void Enqueue(const std::shared_ptr<Transfer>& t)
+	{
+		std::lock_guard<std::mutex> lock(mtx);
+		if (!t->total)
+		{
+			t->total = t->remaining;
+			++ips[t->conn->addr.sin_addr.s_addr].refs;
+		}
+		// A transfer whose turn is not used up keeps it, so its weight holds although only one slice is ever pending.
+		if (t->turn && t->deficit >= Slice(t)) active.push_front(t);
+		else
+		{
+			t->turn = false;
+			active.push_back(t);
+		}
+		wake.notify_one();
+	}
+
+	// Called once per dispatched slice when its disk read is over.
+	void SliceRead()
+	{
+		std::lock_guard<std::mutex> lock(mtx);
+		--inflight;
+		wake.notify_one();
+	}
+
+	// Called once when a transfer that went through Enqueue ends, successfully or not.
+	void Finished(const std::shared_ptr<Transfer>& t)
+	{
+		std::lock_guard<std::mutex> lock(mtx);
+		if (!t->total) return;
+		const auto ip = ips.find(t->conn->addr.sin_addr.s_addr);
+		if (ip != ips.end() && !--ip->second.refs) ips.erase(ip);
+	}
+
+	std::string Stats()
+	{
+		std::lock_guard<std::mutex> lock(mtx);
+		std::ostringstream oss;
+		oss << "scheduler active=" << active.size() <<
+			" throttled=" << throttled.size() <<
+			" inflight=" << inflight << "/" << inflightMax <<
+			" slices=" << slices <<
+			" bytes=" << bytes <<
+			" throttles=" << throttles <<
+			" clients=" << ips.size();
+		return oss.str();
+	}
+
+private:
+	struct Ip
+	{
+		TokenBucket bucket;
+		size_t refs = 0;
+	};
+
+	static uint64_t Slice(const std::shared_ptr<Transfer>& t)
+	{
+		return std::min<uint64_t>(t->remaining, TransferChunk);
+	}
+
+	uint64_t Quantum(const std::shared_ptr<Transfer>& t) const
+	{
+		return (t->total <= smallSize ? 4 : 1) * TransferChunk;
+	}
+
+	void Run()
+	{
+		Tracer::Name("scheduler");
+		std::unique_lock<std::mutex> lock(mtx);
+		while (true)
+		{
+			auto now = std::chrono::steady_clock::now();
+			while (!throttled.empty() && throttled.begin()->first <= now)
+			{
+				active.push_back(throttled.begin()->second);
+				throttled.erase(throttled.begin());
+			}
+			if (active.empty() || inflight >= inflightMax)
+			{
+				if (throttled.empty()) wake.wait(lock);
+				else wake.wait_until(lock, throttled.begin()->first);
+				continue;
+			}
+			const auto t = active.front();
+			active.pop_front();
+			if (!t->turn)
+			{
+				t->turn = true;
+				t->deficit += Quantum(t);
+			}
+			const auto slice = Slice(t);
+			if (slice > t->deficit)
+			{
+				t->turn = false;
+				active.push_back(t);
+				continue;
+			}
+			auto& ip = ips[t->conn->addr.sin_addr.s_addr];
+			const auto rate = t->conn->root ? t->conn->root->rateConn : connRate;
+			auto& bucket = (t->conn->parent ? t->conn->parent : t->conn)->bucket;
+			const auto wait = std::max(bucket.Wait(slice, rate, now), ip.bucket.Wait(slice, ipRate, now));
+			if (wait.count())
+			{
+				++throttles;
+				throttled.emplace(now + wait, t);
+				continue;
+			}
+			bucket.Take(slice, rate);
+			ip.bucket.Take(slice, ipRate);
+			t->deficit -= slice;
+			if (!t->deficit) t->turn = false;
+			++inflight;
+			++slices;
+			bytes += slice;
+			lock.unlock();
+			ReadSlice(t);
+			lock.lock();
+		}
+	}
+
+	std::mutex mtx;
+	std::condition_variable wake;
+	std::deque<std::shared_ptr<Transfer>> active;
+	std::multimap<std::chrono::steady_clock::time_point, std::shared_ptr<Transfer>> throttled;
+	std::map<uint32_t, Ip> ips;
+	int inflight = 0;
+	const int inflightMax;
+	const double connRate;
+	const double ipRate;
+	const uint64_t smallSize;
+	uint64_t slices = 0;
+	uint64_t bytes = 0;
+	uint64_t throttles = 0;
+};
+
+static TransferScheduler* Scheduler = nullptr;
+
+int SendChunk(const std::shared_ptr<Transfer>& t)
+{
+	Tracer::Scope span(t->conn->trace, "send");
+#ifndef _MSC_VER
+	if (!t->observe) return SendFile(*t->conn, t->fp, t->offset, t->len);
+#endif
+	return Send(*t->conn, t->buf.get(), t->len);
+}
+
+// Alternate between a disk read and a socket send, one chunk at a time,
+// so neither a slow disk nor a slow client holds the other stage's thread.
+// Each read waits its turn in the transfer scheduler.
+void Pump(const std::shared_ptr<Transfer>& t)
+{
+	if (!t->started) t->started = Tracer::Start(t->conn->trace);
+	Scheduler->Enqueue(t);
+}
+
+void ReadSlice(const std::shared_ptr<Transfer>& t)
+{
+	DiskStage->Submit([t]()
+	{
+		const auto reading = Tracer::Start(t->conn->trace);
+		const auto want = static_cast<size_t>(std::min<uint64_t>(t->remaining, TransferChunk));
+#ifdef _MSC_VER
+		t->Hold(want);
+		t->len = fread(t->buf.get(), sizeof(uint8_t), want, t->fp);
+#else
+		if (t->observe)
+		{
+			t->Hold(want);
+			const auto len = pread(fileno(t->fp), t->buf.get(), want, t->offset);
+			t->len = len < 0 ? 0 : len;
+		}
+		else
+		{
+			// Fault the chunk into the page cache here, so sendfile on the network thread never waits on the disk.
+			readahead(fileno(t->fp), t->offset, want);
+			t->len = want;
+		}
+#endif
+		Scheduler->SliceRead();
+		Tracer::Record(t->conn->trace, "read", reading);
+		if (!t->len)
+		{
+			Scheduler->Finished(t);
+			return;
+		}
+		if (t->observe) t->observe(t->buf.get(), t->len);
+		NetStage->Submit([t]()
+		{
+			const auto sent = SendChunk(t);
+			t->Drop();
+			if (sent < 0)
+			{
+				Scheduler->Finished(t);
+				return;
+			}
+			const auto next = [t](const bool ok)
+			{
+				if (!ok)
+				{
+					Scheduler->Finished(t);
+					return;
+				}
+				t->offset += t->len;
+				t->remaining -= t->len;
+				if (t->remaining) Pump(t);
+				else
+				{
+					Scheduler->Finished(t);
+					if (t->done) t->done();
+				}
+			};
+			// A chunk an HTTP/2 stream had to park holds the next one back until the peer's window has taken it.
+			if (!Defer(*t->conn, next)) next(true);
+		});
+	});
+}
+
+// Content digests: SHA-256 for Repr-Digest and manifests, and XXH64 as a fast
+// non-cryptographic alternative. Each file version is hashed once; the result
+// is kept in memory by inode and in an extended attribute beside the data.
+
+class Sha256
+{
+public:
+	Sha256()
+	{
+		static const uint32_t init[8] =
+		{
+			0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+		};
+		memcpy(state, init, sizeof(state));
+	}
+
+	void Update(const char* data, size_t len)
+	{
+		total += len;
+		if (bufLen)
+		{
+			const auto n = std::min(len, sizeof(buf) - bufLen);
+			memcpy(buf + bufLen, data, n);
+			bufLen += n;
+			data += n;
+			len -= n;
+			if (bufLen < sizeof(buf)) return;
+			Compress(state, buf, 1);
+			bufLen = 0;
+		}
+		Compress(state, reinterpret_cast<const uint8_t*>(data), len / 64);
+		memcpy(buf, data + len / 64 * 64, len % 64);
+		bufLen = len % 64;
+	}
+
+	// The 32-byte digest.
+	std::string Final()
+	{
+		const auto bits = total * 8;
+		const char pad = static_cast<char>(0x80);
+		Update(&pad, 1);
+		const char zeros[64] = {0};
+		Update(zeros, (120 - bufLen) % 64);
+		char length[8];
+		for (auto i = 0; i < 8; ++i) length[i] = static_cast<char>(bits >> (56 - 8 * i));
+		Update(length, sizeof(length));
+		std::string out(32, '\0');
+		for (auto i = 0; i < 32; ++i) out[i] = static_cast<char>(state[i / 4] >> (24 - 8 * (i % 4)));
+		return out;
+	}
+
+	static const char* Kernel()
+	{
+		return Compress == CompressShaNi ? "sha-ni" : "scalar";
+	}
+
+private:
+	static const uint32_t K[64];
+
+	static void CompressScalar(uint32_t* s, const uint8_t* p, size_t blocks)
+	{
+#define Ror(x, n) ((x) >> (n) | (x) << (32 - (n)))
+		for (; blocks--; p += 64)
+		{
+			uint32_t w[64];
+			for (auto i = 0; i < 16; ++i)
+			{
+				w[i] = static_cast<uint32_t>(p[4 * i]) << 24 | p[4 * i + 1] << 16 | p[4 * i + 2] << 8 | p[4 * i + 3];
+			}
+			for (auto i = 16; i < 64; ++i)
+			{
+				const auto s0 = Ror(w[i - 15], 7) ^ Ror(w[i - 15], 18) ^ (w[i - 15] >> 3);
+				const auto s1 = Ror(w[i - 2], 17) ^ Ror(w[i - 2], 19) ^ (w[i - 2] >> 10);
+				w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+			}
+			auto a = s[0], b = s[1], c = s[2], d = s[3], e = s[4], f = s[5], g = s[6], h = s[7];
+			for (auto i = 0; i < 64; ++i)
+			{
+				const auto t1 = h + (Ror(e, 6) ^ Ror(e, 11) ^ Ror(e, 25)) + ((e & f) ^ (~e & g)) + K[i] + w[i];
+				const auto t2 = (Ror(a, 2) ^ Ror(a, 13) ^ Ror(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+				h = g;
+				g = f;
+				f = e;
+				e = d + t1;
+				d = c;
+				c = b;
+				b = a;
+				a = t1 + t2;
+			}
+			s[0] += a;
+			s[1] += b;
+			s[2] += c;
+			s[3] += d;
+			s[4] += e;
+			s[5] += f;
+			s[6] += g;
+			s[7] += h;
+		}
+#undef Ror
+	}
+
+#ifdef ShaNiAvailable
+	// The x86 SHA extensions do two rounds per instruction and most of the message schedule.
+	static ShaNiTarget void CompressShaNi(uint32_t* s, const uint8_t* p, size_t blocks)
+	{
+		const auto mask = _mm_set_epi64x(0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL);
+		auto tmp = _mm_shuffle_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i*>(s)), 0xB1);
+		auto state1 = _mm_shuffle_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i*>(s + 4)), 0x1B);
+		auto state0 = _mm_alignr_epi8(tmp, state1, 8);
+		state1 = _mm_blend_epi16(state1, tmp, 0xF0);
+		for (; blocks--; p += 64)
+		{
+			const auto abef = state0;
+			const auto cdgh = state1;
+			auto w0 = _mm_shuffle_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i*>(p)), mask);
+			auto w1 = _mm_shuffle_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i*>(p + 16)), mask);
+			auto w2 = _mm_shuffle_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i*>(p + 32)), mask);
+			auto w3 = _mm_shuffle_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i*>(p + 48)), mask);
+			__m128i msg;
+			// Rounds 4g..4g+3 on schedule words cur, extending the schedule into next and prev as far as it goes.
+#define ShaNiQuad(g, cur, next, prev) \
+			msg = _mm_add_epi32(cur, _mm_loadu_si128(reinterpret_cast<const __m128i*>(K + 4 * (g)))); \
+			state1 = _mm_sha256rnds2_epu32(state1, state0, msg); \
+			if ((g) >= 3 && (g) <= 14) next = _mm_sha256msg2_epu32(_mm_add_epi32(next, _mm_alignr_epi8(cur, prev, 4)), cur); \
+			state0 = _mm_sha256rnds2_epu32(state0, state1, _mm_shuffle_epi32(msg, 0x0E)); \
+			if ((g) >= 1 && (g) <= 12) prev = _mm_sha256msg1_epu32(prev, cur)
+			ShaNiQuad(0, w0, w1, w3); ShaNiQuad(1, w1, w2, w0); ShaNiQuad(2, w2, w3, w1); ShaNiQuad(3, w3, w0, w2);
+			ShaNiQuad(4, w0, w1, w3); ShaNiQuad(5, w1, w2, w0); ShaNiQuad(6, w2, w3, w1); ShaNiQuad(7, w3, w0, w2);
+			ShaNiQuad(8, w0, w1, w3); ShaNiQuad(9, w1, w2, w0); ShaNiQuad(10, w2, w3, w1); ShaNiQuad(11, w3, w0, w2);
+			ShaNiQuad(12, w0, w1, w3); ShaNiQuad(13, w1, w2, w0); ShaNiQuad(14, w2, w3, w1); ShaNiQuad(15, w3, w0, w2);
+#undef ShaNiQuad
+			state0 = _mm_add_epi32(state0, abef);
+			state1 = _mm_add_epi32(state1, cdgh);
+		}
+		tmp = _mm_shuffle_epi32(state0, 0x1B);
+		state1 = _mm_shuffle_epi32(state1, 0xB1);
+		state0 = _mm_blend_epi16(tmp, state1, 0xF0);
+		state1 = _mm_alignr_epi8(state1, tmp, 8);
+		_mm_storeu_si128(reinterpret_cast<__m128i*>(s), state0);
+		_mm_storeu_si128(reinterpret_cast<__m128i*>(s + 4), state1);
+	}
+
+	static bool HasShaNi()
+	{
+		uint32_t r[4] = {0};
+#ifdef _MSC_VER
+		int info[4];
+		__cpuid(info, 0);
+		if (info[0] < 7) return false;
+		__cpuid(info, 1);
+		r[2] = info[2];
+		__cpuidex(info, 7, 0);
+		r[1] = info[1];
+#else
+		if (__get_cpuid_max(0, nullptr) < 7) return false;
+		uint32_t a, b, c, d;
+		__get_cpuid(1, &a, &b, &c, &d);
+		r[2] = c;
+		__get_cpuid_count(7, 0, &a, &b, &c, &d);
+		r[1] = b;
+#endif
+		// SHA in leaf 7, SSSE3 and SSE4.1 in leaf 1.
+		return (r[1] >> 29 & 1) && (r[2] >> 9 & 1) && (r[2] >> 19 & 1);
+	}
+
+	static void (* const Compress)(uint32_t*, const uint8_t*, size_t);
+#else
+	static void CompressShaNi(uint32_t*, const uint8_t*, size_t) {}
+	static constexpr auto Compress = CompressScalar;
+#endif
+
+	uint32_t state[8];
+	uint8_t buf[64];
+	size_t bufLen = 0;
+	uint64_t total = 0;
+};
+
+const uint32_t Sha256::K[64] =
+{
+	0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+	0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+	0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+	0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+	0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+	0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+	0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+	0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+#ifdef ShaNiAvailable
+void (* const Sha256::Compress)(uint32_t*, const uint8_t*, size_t) = Sha256::HasShaNi() ? Sha256::CompressShaNi : Sha256::CompressScalar;
+#endif
+
+// XXH64, streaming.
+class Xxh64
+{
+public:
+	void Update(const char* data, size_t len)
+	{
+		total += len;
+		if (bufLen + len < 32)
+		{
+			memcpy(buf + bufLen, data, len);
+			bufLen += len;
+			return;
+		}
+		if (bufLen)
+		{
+			const auto n = 32 - bufLen;
+			memcpy(buf + bufLen, data, n);
+			Stripe(buf);
+			data += n;
+			len -= n;
+			bufLen = 0;
+		}
+		for (; len >= 32; data += 32, len -= 32) Stripe(data);
+		memcpy(buf, data, len);
+		bufLen = len;
+	}
+
+	uint64_t Final() const
+	{
+		auto h = total >= 32 ?
+			Merge(Merge(Merge(Merge(Rotl(v[0], 1) + Rotl(v[1], 7) + Rotl(v[2], 12) + Rotl(v[3], 18), v[0]), v[1]), v[2]), v[3]) :
+			v[2] + P5;
+		h += total;
+		size_t i = 0;
+		for (; i + 8 <= bufLen; i += 8) h = Rotl(h ^ Round(0, Read64(buf + i)), 27) * P1 + P4;
+		if (i + 4 <= bufLen)
+		{
+			uint32_t k;
+			memcpy(&k, buf + i, 4);
+			h = Rotl(h ^ k * P1, 23) * P2 + P3;
+			i += 4;
+		}
+		for (; i < bufLen; ++i) h = Rotl(h ^ static_cast<uint8_t>(buf[i]) * P5, 11) * P1;
+		h ^= h >> 33;
+		h *= P2;
+		h ^= h >> 29;
+		h *= P3;
+		return h ^ h >> 32;
+	}
+
+private:
+	static constexpr uint64_t P1 = 11400714785074694791ULL;
+	static constexpr uint64_t P2 = 14029467366897019727ULL;
+	static constexpr uint64_t P3 = 1609587929392839161ULL;
+	static constexpr uint64_t P4 = 9650029242287828579ULL;
+	static constexpr uint64_t P5 = 2870177450012600261ULL;
+
+	static uint64_t Rotl(const uint64_t x, const int n) { return x << n | x >> (64 - n); }
+	static uint64_t Round(const uint64_t acc, const uint64_t input) { return Rotl(acc + input * P2, 31) * P1; }
+	static uint64_t Merge(const uint64_t acc, const uint64_t val) { return (acc ^ Round(0, val)) * P1 + P4; }
+
+	static uint64_t Read64(const char* p)
+	{
+		uint64_t x;
+		memcpy(&x, p, 8);
+		return x;
+	}
+
+	void Stripe(const char* p)
+	{
+		for (auto i = 0; i < 4; ++i) v[i] = Round(v[i], Read64(p + 8 * i));
+	}
+
+	uint64_t v[4] = {P1 + P2, P2, 0, 0 - P1};
+	char buf[32];
+	size_t bufLen = 0;
+	uint64_t total = 0;
+};
+
+std::string HexString(const std::string& bytes)
+{
+	static const char* digits = "0123456789abcdef";
+	std::string out;
+	for (const auto c : bytes)
+	{
+		out += digits[static_cast<uint8_t>(c) >> 4];
+		out += digits[static_cast<uint8_t>(c) & 0xf];
+	}
+	return out;
+}
+
+std::string Base64Encode(const std::string& bytes)
+{
+	static const char* digits = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+	std::string out;
+	for (size_t i = 0; i < bytes.length(); i += 3)
+	{
+		const auto n = std::min<size_t>(3, bytes.length() - i);
+		uint32_t v = 0;
+		for (size_t k = 0; k < 3; ++k) v = v << 8 | (k < n ? static_cast<uint8_t>(bytes[i + k]) : 0);
+		for (size_t k = 0; k < 4; ++k) out += k <= n ? digits[v >> (18 - 6 * k) & 0x3f] : '=';
+	}
+	return out;
+}
+
+struct FileDigest
+{
+	int64_t mtime = 0;
+	uint64_t size = 0;
+	std::string sha256;
+	uint64_t xxh64 = 0;
+};
+
+class DigestCache
+{
+public:
+	explicit DigestCache(const size_t maxEntries) : maxEntries(maxEntries) {}
+
+	// The digest of path as it is now: from memory, from its xattr, or, when
+	// compute is set, by hashing it on the calling thread. Without compute a
+	// miss only queues the file for hashing on the disk stage.
+	bool Get(const std::string& path, FileDigest& digest, const bool compute)
+	{
+		std::string key;
+		int64_t mtime;
+		uint64_t size;
+		if (!Identify(path, key, mtime, size)) return false;
+		{
+			std::lock_guard<std::mutex> lock(mtx);
+			const auto it = entries.find(key);
+			if (it != entries.end() && it->second.digest.mtime == mtime && it->second.digest.size == size)
+			{
+				++hits;
+				++it->second.uses;
+				Memory::Hit(Memory::Digests);
+				digest = it->second.digest;
+				return true;
+			}
+		}
+		Memory::Miss(Memory::Digests);
+		if (LoadAttribute(path, mtime, size, digest))
+		{
+			++attributeHits;
+			Remember(key, digest);
+			return true;
+		}
+		if (!compute)
+		{
+			Prefetch(path, key, mtime, size);
+			return false;
+		}
+		return Compute(path, key, mtime, size, digest);
+	}
+
+	std::string Stats()
+	{
+		std::ostringstream oss;
+		size_t cached;
+		{
+			std::lock_guard<std::mutex> lock(mtx);
+			cached = entries.size();
+		}
+		oss << "digest kernel=" << Sha256::Kernel() <<
+			" cached=" << cached <<
+			" hits=" << hits.load() <<
+			" xattr-hits=" << attributeHits.load() <<
+			" hashed=" << hashed.load() <<
+			" hashed-bytes=" << hashedBytes.load();
+		return oss.str();
+	}
+
+	// Drops the entries used least per byte they hold until n bytes are gone, as the listing cache does.
+	int64_t Evict(const int64_t n)
+	{
+		std::lock_guard<std::mutex> lock(mtx);
+		std::vector<std::pair<double, std::string>> order;
+		order.reserve(entries.size());
+		int64_t held = 0;
+		for (const auto& e : entries)
+		{
+			const auto cost = Cost(e.first, e.second.digest);
+			order.emplace_back(e.second.uses / static_cast<double>(cost), e.first);
+			held += cost;
+		}
+		std::sort(order.begin(), order.end());
+		int64_t freed = 0;
+		for (const auto& o : order)
+		{
+			if (freed >= n) break;
+			const auto it = entries.find(o.second);
+			freed += Cost(it->first, it->second.digest);
+			entries.erase(it);
+		}
+		if (aging.Due(freed, held))
+		{
+			for (auto& e : entries) e.second.uses /= 2;
+		}
+		return freed;
+	}
+
+private:
+	// A file version is its inode (its path on Windows) with its mtime and size.
+	static bool Identify(const std::string& path, std::string& key, int64_t& mtime, uint64_t& size)
+	{
+#ifdef _MSC_VER
+		struct _stat64 st;
+		if (_stat64(path.c_str(), &st) < 0 || !(st.st_mode & _S_IFREG)) return false;
+		key = path;
+		mtime = static_cast<int64_t>(st.st_mtime) * 1000000000;
+#else
+		struct stat st;
+		if (stat(path.c_str(), &st) < 0 || !S_ISREG(st.st_mode)) return false;
+		key = std::to_string(st.st_dev) + ":" + std::to_string(st.st_ino);
+		mtime = static_cast<int64_t>(st.st_mtim.tv_sec) * 1000000000 + st.st_mtim.tv_nsec;
+#endif
+		size = st.st_size;
+		return true;
+	}
+
+	// Hash the file version Identify saw as key, mtime and size, before the file was opened.
+	bool Compute(const std::string& path, const std::string& key, const int64_t mtime, const uint64_t size, FileDigest& digest)
+	{
+		FILE* fp = fopen(path.c_str(), "rb");
+		if (!fp) return false;
+#ifndef _MSC_VER
+		// The path may have been replaced between the stat and the open.
+		struct stat st;
+		if (fstat(fileno(fp), &st) < 0 || std::to_string(st.st_dev) + ":" + std::to_string(st.st_ino) != key)
+		{
+			fclose(fp);
+			return false;
+		}
+#endif
+		Sha256 sha;
+		Xxh64 xxh;
+		std::vector<char> buf(TransferChunk);
+		uint64_t total = 0;
+		size_t len;
+		while ((len = fread(buf.data(), sizeof(char), buf.size(), fp)))
+		{
+			sha.Update(buf.data(), len);
+			xxh.Update(buf.data(), len);
+			total += len;
+		}
+		fclose(fp);
+		++hashed;
+		hashedBytes += total;
+		// Only a file that held still while it was read has this digest: same inode, mtime and size
+		// before the open and after the last read, and every byte of that size read.
+		std::string after;
+		if (!Identify(path, after, digest.mtime, digest.size) || after != key) return false;
+		if (digest.mtime != mtime || digest.size != size || total != size) return false;
+		digest.sha256 = sha.Final();
+		digest.xxh64 = xxh.Final();
+		Remember(key, digest);
+		StoreAttribute(path, digest);
+		return true;
+	}
+
+	void Prefetch(const std::string& path, const std::string& key, const int64_t mtime, const uint64_t size)
+	{
+		{
+			std::lock_guard<std::mutex> lock(mtx);
+			if (!hashing.insert(key).second) return;
+		}
+		DiskStage->Submit([this, path, key, mtime, size]()
+		{
+			FileDigest digest;
+			Compute(path, key, mtime, size, digest);
+			std::lock_guard<std::mutex> lock(mtx);
+			hashing.erase(key);
+		});
+	}
+
+	struct Cached
+	{
+		FileDigest digest;
+		// Lookups and stores, halved as Memory::Aging says.
+		uint64_t uses = 0;
+	};
+
+	// What an entry holds, with a guess at the map node around it.
+	static int64_t Cost(const std::string& key, const FileDigest& digest)
+	{
+		return sizeof(std::pair<const std::string, Cached>) + 32 + key.length() + digest.sha256.length();
+	}
+
+	void Remember(const std::string& key, const FileDigest& digest)
+	{
+		int64_t released = 0;
+		{
+			std::lock_guard<std::mutex> lock(mtx);
+			auto it = entries.find(key);
+			if (it != entries.end()) released += Cost(it->first, it->second.digest);
+			else
+			{
+				if (entries.size() >= maxEntries)
+				{
+					released += Cost(entries.begin()->first, entries.begin()->second.digest);
+					entries.erase(entries.begin());
+				}
+				it = entries.emplace(key, Cached()).first;
+			}
+			it->second.digest = digest;
+			++it->second.uses;
+		}
+		Memory::Release(Memory::Digests, released);
+		Memory::Charge(Memory::Digests, Cost(key, digest));
+	}
+
+#define DigestAttribute "user.hais.digest"
+
+	static bool LoadAttribute(const std::string& path, const int64_t mtime, const uint64_t size, FileDigest& digest)
+	{
+#ifdef _MSC_VER
+		return false;
+#else
+		char value[256];
+		const auto len = getxattr(path.c_str(), DigestAttribute, value, sizeof(value) - 1);
+		if (len <= 0) return false;
+		value[len] = 0;
+		long long t;
+		unsigned long long s, x;
+		char hex[65];
+		if (sscanf(value, "1 %lld %llu %64s %llx", &t, &s, hex, &x) != 4 || strlen(hex) != 64) return false;
+		if (t != mtime || s != size) return false;
+		digest.mtime = mtime;
+		digest.size = size;
+		digest.xxh64 = x;
+		digest.sha256.assign(32, '\0');
+		for (auto i = 0; i < 32; ++i) digest.sha256[i] = static_cast<char>(std::stoi(std::string(hex + 2 * i, 2), nullptr, 16));
+		return true;
+#endif
+	}
+
+	void StoreAttribute(const std::string& path, const FileDigest& digest)
+	{
+#ifndef _MSC_VER
+		char value[256];
+		const auto len = snprintf(
+			value, sizeof(value), "1 %lld %llu %s %016llx",
+			static_cast<long long>(digest.mtime),
+			static_cast<unsigned long long>(digest.size),
+			HexString(digest.sha256).c_str(),
+			static_cast<unsigned long long>(digest.xxh64));
+		// Read-only trees and filesystems without user xattrs just keep the memory copy.
+		if (setxattr(path.c_str(), DigestAttribute, value, len, 0) < 0 && !attributeWarned.exchange(true))
+		{
+			warn("Can't store digests in xattrs under %s", path.c_str());
+		}
+#endif
+	}
+
+	const size_t maxEntries;
+	std::mutex mtx;
+	std::map<std::string, Cached> entries;
+	Memory::Aging aging;
+	std::set<std::string> hashing;
+	std::atomic<uint64_t> hits{0};
+	std::atomic<uint64_t> attributeHits{0};
+	std::atomic<uint64_t> hashed{0};
+	std::atomic<uint64_t> hashedBytes{0};
+	std::atomic<bool> attributeWarned{false};
+};
+
+static DigestCache* Digests = nullptr;
+
+void HttpFile(
+	const std::shared_ptr<Connection>& conn,
+	const std::string& path,
+	const std::string& lastModified,
+	const uint64_t fileSize,
+	const uint64_t offset = 0,
+	const uint64_t size = 0,
+	std::function<void()> done = nullptr)
+{
+#define HttpHead(value, http, sm) \
+	std::regex_search(http, sm, std::regex(""#value": {0,1}.+?\\r{0,1}\\n", std::regex::icase)); \
+	const auto (value) = std::regex_replace((sm)[0].str(), std::regex("("#value": {0,1}|\\r{0,1}\\n)", std::regex::icase), "")
+
+	auto t = std::make_shared<Transfer>();
+	t->conn = conn;
+	t->done = std::move(done);
+	const auto opening = Tracer::Start(conn->trace);
+	t->fp = fopen(path.c_str(), "rb");
+	if (!t->fp) return;
+	Tracer::Record(conn->trace, "open", opening);
+	// Files up to --digest-inline are hashed before answering; bigger ones go without until hashed in the background.
+	FileDigest digest;
+	std::string reprDigest;
+	const auto hashing = Tracer::Start(conn->trace);
+	const auto digesting = Digests && conn->root && conn->root->OptionInt("digest", 0);
+	if (digesting && Digests->Get(path, digest, fileSize <= static_cast<uint64_t>(conn->root->OptionInt("digest-inline", 16 << 20))))
+	{
+		reprDigest = "\r\nRepr-Digest: sha-256=:" + Base64Encode(digest.sha256) + ":";
+	}
+	if (digesting) Tracer::Record(conn->trace, "digest", hashing);
+	std::ostringstream head;
+	if (!offset && !size)
+	{
+		t->remaining = fileSize;
+		head << "HTTP/1.1 200 OK\r\nContent-Length:" <<
+			std::to_string(fileSize) <<
+			"\r\nConnection: close"
+			"\r\nLast-Modified: " << lastModified <<
+			"\r\nContent-Type: " << GetContentType(path.c_str()) <<
+			"\r\nServer: iriszero/" VERSION <<
+			reprDigest <<
+			"\r\n\r\n";
+	}
+	else
+	{
+		t->offset = offset;
+		t->remaining = size;
+		fseek(t->fp, offset, SEEK_SET);
+		head << "HTTP/1.1 206 Partial Content\r\nAccept-Ranges: bytes\r\n" <<
+			"Server: iriszero/" VERSION "\r\n" <<
+			"Content-Type: " << GetContentType(path.c_str()) << "\r\n"
+			"Content-Length: " << std::to_string(size)
+			<< "\r\nContent-Range: bytes " <<
+			std::to_string(offset) << "-" <<
+			std::to_string(offset + size - 1) << "/" <<
+			std::to_string(fileSize) << "\r\nConnection: close" <<
+			reprDigest <<
+			"\r\n\r\n";
+	}
+	NetStage->Submit([t, head = head.str()]()
+	{
+		printf("<========================\n%s\n", head.c_str());
+		Tracer::Scope span(t->conn->trace, "head");
+		if (Send(*t->conn, head.c_str(), head.length()) < 0) return;
+		if (t->remaining) Pump(t);
+		else if (t->done) t->done();
+	});
+}
+
+void HttpRanges(
+	const std::shared_ptr<Connection>& conn,
+	const std::string& path,
+	const uint64_t fileSize,
+	std::list<std::tuple<uint64_t, uint64_t>> ranges)
+{
+	if (ranges.empty()) return;
+	const auto range = ranges.front();
+	ranges.pop_front();
+	HttpFile(conn, path, "", fileSize, std::get<0>(range), std::get<1>(range), [=]()
+	{
+		HttpRanges(conn, path, fileSize, ranges);
+	});
+}
+
+std::list<std::tuple<uint64_t, uint64_t>> GetOffsetAndSize(
+	const std::string& __range,
+	const uint64_t fileSize)
+{
+	std::list<std::tuple<uint64_t, uint64_t>> res{};
+	auto _range = __range.substr(6, __range.length() - 6);
+	auto pos = 0;
+	for (auto i = 0; i < _range.length(); ++i)
+	{
+		if (_range[i] == ',')
+		{
+			auto range = _range.substr(pos, i - pos);
+			const int _pos = range.find('-');
+			auto _start = range.substr(0, _pos);
+			auto _end = range.substr(_pos + 1, range.length() - _pos - 1);
+			if (_start.empty())
+			{
+				auto end = std::stoull(_end);
+				res.emplace_back(fileSize - end, end);
+			}
+			else if (_end.empty())
+			{
+				auto start = std::stoull(_start);
+				res.emplace_back(start, fileSize - start);
+			}
+			else
+			{
+				auto start = std::stoull(_start);
+				res.emplace_back(start, std::stoull(_end) - start + 1);
+			}
+			pos = i + 1;
+		}
+	}
+	const auto range = _range.substr(pos, _range.length() - pos);
+	const int _pos = range.find('-');
+	const auto _start = range.substr(0, _pos);
+	const auto _end = range.substr(_pos + 1, range.length() - _pos - 1);
+	if (_start.empty())
+	{
+		auto end = std::stoull(_end);
+		res.emplace_back(fileSize - end, end);
+	}
+	else if (_end.empty())
+	{
+		auto start = std::stoull(_start);
+		res.emplace_back(start, fileSize - start);
+	}
+	else
+	{
+		auto start = std::stoull(_start);
+		res.emplace_back(start, std::stoull(_end) - start + 1);
+	}
+	return res;
+}
+
+
+// Sequential Range streams. Video players and download accelerators fetch a file as a run of
+// small consecutive ranges, often each on a new connection. Per client address and file, up to
+// PrefetchRuns runs are followed; once a range continues one, the window after it is read into
+// the page cache on the disk stage, doubling while the run lasts, so the next range is served
+// from memory instead of a cold read. Runs idle for --prefetch-ttl are dropped.
+#define PrefetchRuns 4
+
+class RangePrefetcher
+{
+public:
+	RangePrefetcher(const uint64_t maxWindow, const int64_t ttl) : maxWindow(maxWindow), ttl(std::chrono::seconds(ttl)) {}
+
+	void Observe(const uint64_t trace, const uint32_t ip, const std::string& path, const uint64_t fileSize,
+		const std::list<std::tuple<uint64_t, uint64_t>>& ranges)
+	{
+		const auto now = std::chrono::steady_clock::now();
+		std::lock_guard<std::mutex> lock(mtx);
+		if (!(++observed % 256)) Sweep(now);
+		auto& runs = files[{ip, path}];
+		for (const auto& range : ranges)
+		{
+			const auto offset = std::get<0>(range);
+			const auto size = std::get<1>(range);
+			// A continuation may overlap the previous range a little or skip a chunk's worth ahead.
+			auto it = std::find_if(runs.begin(), runs.end(), [&](const std::shared_ptr<Run>& r)
+			{
+				return offset + size > r->next && offset <= r->next + TransferChunk;
+			});
+			if (it == runs.end())
+			{
+				if (runs.size() >= PrefetchRuns)
+				{
+					const auto oldest = std::min_element(runs.begin(), runs.end(), [](const std::shared_ptr<Run>& a, const std::shared_ptr<Run>& b)
+					{
+						return a->used < b->used;
+					});
+					Drop(**oldest);
+					runs.erase(oldest);
+				}
+				auto r = std::make_shared<Run>();
+				r->next = r->start = r->ready = r->end = offset + size;
+				r->used = now;
+				runs.push_back(r);
+				continue;
+			}
+			auto& r = **it;
+			if (!r.streak++) ++sequences;
+			if (offset >= r.start && offset + size <= r.ready)
+			{
+				++hits;
+				hitBytes += size;
+			}
+			else if (offset >= r.start && offset + size <= r.end) ++late;
+			else ++misses;
+			r.next = offset + size;
+			r.used = now;
+			const auto window = std::min<uint64_t>(maxWindow, size << std::min(r.streak, 16));
+			const auto end = std::min(fileSize, r.next + window);
+			if (end <= r.end) continue;
+			const auto from = std::max(r.end, r.next);
+			if (from > r.end) r.start = r.ready = from;
+			r.end = end;
+			++prefetches;
+			prefetchedBytes += end - from;
+			Read(trace, *it, path, from, end - from);
+		}
+		if (runs.empty()) files.erase({ip, path});
+	}
+
+	std::string Stats()
+	{
+		std::lock_guard<std::mutex> lock(mtx);
+		size_t runs = 0;
+		for (const auto& f : files) runs += f.second.size();
+		std::ostringstream oss;
+		oss << "prefetch runs=" << runs <<
+			" sequences=" << sequences <<
+			" prefetches=" << prefetches <<
+			" prefetched-bytes=" << prefetchedBytes <<
+			" hits=" << hits <<
+			" hit-bytes=" << hitBytes <<
+			" late=" << late <<
+			" misses=" << misses <<
+			" wasted-bytes=" << wastedBytes;
+		return oss.str();
+	}
+
+private:
+	// One run of consecutive ranges: next is where the last range ended, and [start, end) was
+	// prefetched, of which [start, ready) is in the page cache by now.
+	struct Run
+	{
+		uint64_t next = 0;
+		uint64_t start = 0;
+		uint64_t ready = 0;
+		uint64_t end = 0;
+		int streak = 0;
+		std::chrono::steady_clock::time_point used;
+	};
+
+	void Read(const uint64_t trace, const std::shared_ptr<Run>& run, const std::string& path, const uint64_t offset, const uint64_t len)
+	{
+		DiskStage->Submit([this, trace, run, path, offset, len]()
+		{
+			const auto reading = Tracer::Start(trace);
+#ifdef _MSC_VER
+			const auto fp = fopen(path.c_str(), "rb");
+			if (!fp) return;
+			std::vector<char> buf(TransferChunk);
+			_fseeki64(fp, offset, SEEK_SET);
+			for (uint64_t done = 0; done < len;)
+			{
+				const auto read = fread(buf.data(), sizeof(char), static_cast<size_t>(std::min<uint64_t>(len - done, buf.size())), fp);
+				if (!read) break;
+				done += read;
+			}
+			fclose(fp);
+#else
+			const auto fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+			if (fd < 0) return;
+			readahead(fd, offset, len);
+			::close(fd);
+#endif
+			Tracer::Record(trace, "prefetch", reading);
+			std::lock_guard<std::mutex> lock(mtx);
+			if (run->start <= offset && offset <= run->ready) run->ready = std::max(run->ready, offset + len);
+		});
+	}
+
+	// Counts what was prefetched past the end of the run and never asked for.
+	void Drop(const Run& r)
+	{
+		if (r.end > std::max(r.next, r.start)) wastedBytes += r.end - std::max(r.next, r.start);
+	}
+
+	void Sweep(const std::chrono::steady_clock::time_point now)
+	{
+		for (auto f = files.begin(); f != files.end();)
+		{
+			auto& runs = f->second;
+			for (auto r = runs.begin(); r != runs.end();)
+			{
+				if (now - (*r)->used < ttl)
+				{
+					++r;
+					continue;
+				}
+				Drop(**r);
+				r = runs.erase(r);
+			}
+			if (runs.empty()) f = files.erase(f);
+			else ++f;
+		}
+	}
+
+	const uint64_t maxWindow;
+	const std::chrono::steady_clock::duration ttl;
+	std::mutex mtx;
+	std::map<std::pair<uint32_t, std::string>, std::vector<std::shared_ptr<Run>>> files;
+	uint64_t observed = 0;
+	uint64_t sequences = 0;
+	uint64_t prefetches = 0;
+	uint64_t prefetchedBytes = 0;
+	uint64_t hits = 0;
+	uint64_t hitBytes = 0;
+	uint64_t late = 0;
+	uint64_t misses = 0;
+	uint64_t wastedBytes = 0;
+};
+
+static RangePrefetcher* Prefetch = nullptr;
+
+uint32_t Crc32(uint32_t crc, const char* buf, const size_t len)
+{
+	static const auto table = []()
+	{
+		std::valarray<uint32_t> t(256);
+		for (uint32_t i = 0; i < 256; ++i)
+		{
+			auto c = i;
+			for (auto k = 0; k < 8; ++k) c = c & 1 ? 0xEDB88320 ^ (c >> 1) : c >> 1;
+			t[i] = c;
+		}
+		return t;
+	}();
+	crc = ~crc;
+	for (size_t i = 0; i < len; ++i) crc = table[(crc ^ static_cast<uint8_t>(buf[i])) & 0xff] ^ (crc >> 8);
+	return ~crc;
+}
+
+void PutLittleEndian(std::string& s, uint64_t v, const int bytes)
+{
+	for (auto i = 0; i < bytes; ++i, v >>= 8) s.push_back(static_cast<char>(v & 0xff));
+}
+
+#define Put16(s, v) PutLittleEndian(s, v, 2)
+#define Put32(s, v) PutLittleEndian(s, v, 4)
+#define Put64(s, v) PutLittleEndian(s, v, 8)
+#define Round512(x) (((x) + 511) / 512 * 512)
+#define Max32 0xffffffffULL
+
+// A tar (ustar with GNU long names) or stored zip of a directory tree.
+// Only entry metadata is held; every header is generated when it is streamed,
+// and the stream is split into pieces of known length so any byte offset can be resumed.
+// Entry i owns pieces 3i (header), 3i+1 (file data), 3i+2 (tar padding or zip data descriptor).
+// They are followed by the zip central directory, one piece per entry, and one trailer piece.
+class Archive
+{
+public:
+	Archive(std::string root, std::string base, const bool zip, std::vector<ArchiveEntry> entries) :
+		root(std::move(root)), base(std::move(base)), zip(zip), entries(std::move(entries))
+	{
+		uint64_t pos = 0;
+		for (size_t i = 0; i < this->entries.size(); ++i)
+		{
+			this->entries[i].offset = pos;
+			pos += PieceLength(3 * i) + PieceLength(3 * i + 1) + PieceLength(3 * i + 2);
+		}
+		centralOffset = pos;
+		if (zip)
+		{
+			for (size_t i = 0; i < this->entries.size(); ++i) pos += PieceLength(3 * this->entries.size() + i);
+		}
+		centralSize = pos - centralOffset;
+		zip64 = this->entries.size() >= 0xffff || pos >= Max32;
+		length = pos + PieceLength(Pieces() - 1);
+	}
+
+	uint64_t Length() const { return length; }
+
+	size_t Pieces() const { return entries.size() * (zip ? 4 : 3) + 1; }
+
+	bool IsData(const size_t k) const { return k < 3 * entries.size() && k % 3 == 1 && !entries[k / 3].dir; }
+
+	bool NeedsCrc(const size_t k) const { return zip && k < Pieces() - 1 && (k >= 3 * entries.size() || k % 3 == 2); }
+
+	ArchiveEntry& Entry(const size_t k) { return entries[k < 3 * entries.size() ? k / 3 : k - 3 * entries.size()]; }
+
+	std::string Name(const ArchiveEntry& e) const
+	{
+		auto name = base + e.rel;
+		std::replace(name.begin(), name.end(), '\\', '/');
+		return name;
+	}
+
+	std::string Path(const ArchiveEntry& e) const
+	{
+		return PathCombine(root.c_str(), e.rel.c_str());
+	}
+
+	uint64_t PieceLength(const size_t k) const
+	{
+		const auto n = entries.size();
+		if (k == Pieces() - 1) return zip ? 22 + (zip64 ? 76 : 0) : 1024;
+		if (k >= 3 * n)
+		{
+			const auto& e = entries[k - 3 * n];
+			return 46 + Name(e).length() + CentralExtra(e);
+		}
+		const auto& e = entries[k / 3];
+		const auto nameLen = Name(e).length();
+		switch (k % 3)
+		{
+		case 0:
+			if (zip) return 30 + nameLen + (e.size >= Max32 ? 20 : 0);
+			return nameLen > 100 ? 1024 + Round512(nameLen + 1) : 512;
+		case 1:
+			return e.size;
+		default:
+			if (zip) return e.dir ? 0 : e.size >= Max32 ? 24 : 16;
+			return Round512(e.size) - e.size;
+		}
+	}
+
+	void PieceBytes(const size_t k, std::string& out) const
+	{
+		const auto n = entries.size();
+		if (k == Pieces() - 1)
+		{
+			if (zip) EndOfCentralDirectory(out);
+			else out.append(1024, '\0');
+			return;
+		}
+		if (k >= 3 * n)
+		{
+			CentralHeader(entries[k - 3 * n], out);
+			return;
+		}
+		const auto& e = entries[k / 3];
+		if (k % 3 == 0)
+		{
+			if (zip) LocalHeader(e, out);
+			else TarEntryHeader(e, out);
+		}
+		else if (!zip)
+		{
+			out.append(static_cast<size_t>(PieceLength(k)), '\0');
+		}
+		else if (!e.dir)
+		{
+			Put32(out, 0x08074b50);
+			Put32(out, e.crc);
+			if (e.size >= Max32)
+			{
+				Put64(out, e.size);
+				Put64(out, e.size);
+			}
+			else
+			{
+				Put32(out, e.size);
+				Put32(out, e.size);
+			}
+		}
+	}
+
+private:
+	static void TarNumber(char* field, const size_t width, uint64_t value)
+	{
+		if (value < 1ULL << 3 * (width - 1))
+		{
+			snprintf(field, width, "%0*llo", static_cast<int>(width - 1), static_cast<unsigned long long>(value));
+			return;
+		}
+		// GNU base-256 for sizes past the octal limit.
+		field[0] = '\x80';
+		for (auto i = width - 1; i > 0; --i, value >>= 8) field[i] = static_cast<char>(value & 0xff);
+	}
+
+	static std::string TarHeader(const std::string& name, const uint64_t size, const int64_t mtime, const char type)
+	{
+		std::string h(512, '\0');
+		memcpy(&h[0], name.c_str(), std::min<size_t>(name.length(), 100));
+		TarNumber(&h[100], 8, type == '5' ? 0755 : 0644);
+		TarNumber(&h[108], 8, 0);
+		TarNumber(&h[116], 8, 0);
+		TarNumber(&h[124], 12, size);
+		TarNumber(&h[136], 12, mtime < 0 ? 0 : mtime);
+		memset(&h[148], ' ', 8);
+		h[156] = type;
+		memcpy(&h[257], "ustar\0" "00", 8);
+		uint32_t sum = 0;
+		for (auto c : h) sum += static_cast<uint8_t>(c);
+		snprintf(&h[148], 8, "%06o", sum);
+		h[155] = ' ';
+		return h;
+	}
+
+	void TarEntryHeader(const ArchiveEntry& e, std::string& out) const
+	{
+		const auto name = Name(e);
+		const auto type = e.dir ? '5' : '0';
+		if (name.length() > 100)
+		{
+			out.append(TarHeader("././@LongLink", name.length() + 1, 0, 'L'));
+			out.append(name);
+			out.append(static_cast<size_t>(Round512(name.length() + 1) - name.length()), '\0');
+		}
+		out.append(TarHeader(name, e.dir ? 0 : e.size, e.mtime, type));
+	}
+
+	uint16_t Flags(const ArchiveEntry& e) const
+	{
+		return (e.dir ? 0 : 1 << 3) | (utf8 ? 1 << 11 : 0);
+	}
+
+	static uint32_t DosDateTime(const int64_t mtime)
+	{
+		const auto raw = static_cast<time_t>(mtime);
+		struct tm tm {};
+#ifdef _MSC_VER
+		localtime_s(&tm, &raw);
+#else
+		localtime_r(&raw, &tm);
+#endif
+		if (tm.tm_year < 80) return 1 << 21 | 1 << 16;
+		return (tm.tm_year - 80) << 25 | (tm.tm_mon + 1) << 21 | tm.tm_mday << 16 |
+			tm.tm_hour << 11 | tm.tm_min << 5 | tm.tm_sec / 2;
+	}
+
+	void LocalHeader(const ArchiveEntry& e, std::string& out) const
+	{
+		const auto name = Name(e);
+		const auto big = e.size >= Max32;
+		Put32(out, 0x04034b50);
+		Put16(out, big ? 45 : 20);
+		Put16(out, Flags(e));
+		Put16(out, 0);
+		Put32(out, DosDateTime(e.mtime));
+		Put32(out, 0);
+		Put32(out, big ? Max32 : 0);
+		Put32(out, big ? Max32 : 0);
+		Put16(out, name.length());
+		Put16(out, big ? 20 : 0);
+		out.append(name);
+		if (big)
+		{
+			Put16(out, 0x0001);
+			Put16(out, 16);
+			Put64(out, 0);
+			Put64(out, 0);
+		}
+	}
+
+	static uint64_t CentralExtra(const ArchiveEntry& e)
+	{
+		const auto len = (e.size >= Max32 ? 16 : 0) + (e.offset >= Max32 ? 8 : 0);
+		return len ? 4 + len : 0;
+	}
+
+	void CentralHeader(const ArchiveEntry& e, std::string& out) const
+	{
+		const auto name = Name(e);
+		const auto big = e.size >= Max32;
+		Put32(out, 0x02014b50);
+		Put16(out, 3 << 8 | 45);
+		Put16(out, big || e.offset >= Max32 ? 45 : 20);
+		Put16(out, Flags(e));
+		Put16(out, 0);
+		Put32(out, DosDateTime(e.mtime));
+		Put32(out, e.crc);
+		Put32(out, big ? Max32 : e.size);
+		Put32(out, big ? Max32 : e.size);
+		Put16(out, name.length());
+		Put16(out, CentralExtra(e));
+		Put16(out, 0);
+		Put16(out, 0);
+		Put16(out, 0);
+		Put32(out, e.dir ? (040755U << 16) | 0x10 : 0100644U << 16);
+		Put32(out, e.offset >= Max32 ? Max32 : e.offset);
+		out.append(name);
+		if (CentralExtra(e))
+		{
+			Put16(out, 0x0001);
+			Put16(out, CentralExtra(e) - 4);
+			if (big)
+			{
+				Put64(out, e.size);
+				Put64(out, e.size);
+			}
+			if (e.offset >= Max32) Put64(out, e.offset);
+		}
+	}
+
+	void EndOfCentralDirectory(std::string& out) const
+	{
+		const uint64_t count = entries.size();
+		if (zip64)
+		{
+			const auto recordOffset = centralOffset + centralSize;
+			Put32(out, 0x06064b50);
+			Put64(out, 44);
+			Put16(out, 45);
+			Put16(out, 45);
+			Put32(out, 0);
+			Put32(out, 0);
+			Put64(out, count);
+			Put64(out, count);
+			Put64(out, centralSize);
+			Put64(out, centralOffset);
+			Put32(out, 0x07064b50);
+			Put32(out, 0);
+			Put64(out, recordOffset);
+			Put32(out, 1);
+		}
+		Put32(out, 0x06054b50);
+		Put16(out, 0);
+		Put16(out, 0);
+		Put16(out, std::min<uint64_t>(count, 0xffff));
+		Put16(out, std::min<uint64_t>(count, 0xffff));
+		Put32(out, std::min<uint64_t>(centralSize, Max32));
+		Put32(out, std::min<uint64_t>(centralOffset, Max32));
+		Put16(out, 0);
+	}
+
+public:
+	bool utf8 = false;
+
+private:
+	std::string root;
+	std::string base;
+	bool zip;
+	bool zip64 = false;
+	std::vector<ArchiveEntry> entries;
+	uint64_t centralOffset = 0;
+	uint64_t centralSize = 0;
+	uint64_t length = 0;
+};
+
+struct ArchiveStream
+{
+	std::shared_ptr<Connection> conn;
+	std::shared_ptr<Archive> archive;
+	size_t piece = 0;
+	uint64_t skip = 0;
+	uint64_t remaining = 0;
+};
+
+void ComputeCrc(const Archive& archive, ArchiveEntry& e)
+{
+	const auto fp = fopen(archive.Path(e).c_str(), "rb");
+	if (fp)
+	{
+		char buf[TransferChunk];
+		size_t len;
+		while ((len = fread(buf, sizeof(uint8_t), TransferChunk, fp))) e.crc = Crc32(e.crc, buf, len);
+		fclose(fp);
+	}
+	e.crcKnown = true;
+}
+
+// Runs on the disk stage: coalesces generated headers into one send of up to a chunk,
+// and hands file data to a Transfer so it goes out through the same zero-copy path as HttpFile.
+void StreamArchive(const std::shared_ptr<ArchiveStream>& s)
+{
+	auto& archive = *s->archive;
+	std::string buf;
+	while (s->remaining && s->piece < archive.Pieces() && buf.length() < TransferChunk)
+	{
+		const auto len = archive.PieceLength(s->piece);
+		if (s->skip >= len)
+		{
+			s->skip -= len;
+			++s->piece;
+			continue;
+		}
+		const auto take = std::min(len - s->skip, s->remaining);
+		if (archive.IsData(s->piece))
+		{
+			if (!buf.empty()) break;
+			auto& e = archive.Entry(s->piece);
+			auto t = std::make_shared<Transfer>();
+			t->conn = s->conn;
+			t->fp = fopen(archive.Path(e).c_str(), "rb");
+			if (!t->fp) return;
+			t->offset = s->skip;
+			t->remaining = take;
+#ifdef _MSC_VER
+			_fseeki64(t->fp, s->skip, SEEK_SET);
+#endif
+			// The CRC can only be folded in while streaming when the file is sent from its first byte.
+			if (archive.NeedsCrc(s->piece + 1) && !s->skip && take == len)
+			{
+				e.crc = 0;
+				t->observe = [&e](const char* data, const size_t n) { e.crc = Crc32(e.crc, data, n); };
+			}
+			t->done = [s, take, &e, counted = static_cast<bool>(t->observe)]()
+			{
+				if (counted) e.crcKnown = true;
+				s->remaining -= take;
+				s->skip = 0;
+				++s->piece;
+				DiskStage->Submit([s]() { StreamArchive(s); });
+			};
+			Pump(t);
+			return;
+		}
+		if (archive.NeedsCrc(s->piece))
+		{
+			auto& e = archive.Entry(s->piece);
+			if (!e.dir && !e.crcKnown) ComputeCrc(archive, e);
+		}
+		std::string piece;
+		archive.PieceBytes(s->piece, piece);
+		buf.append(piece, static_cast<size_t>(s->skip), static_cast<size_t>(take));
+		s->remaining -= take;
+		s->skip = 0;
+		++s->piece;
+	}
+	if (buf.empty()) return;
+	NetStage->Submit([s, buf]()
+	{
+		if (Send(*s->conn, buf.c_str(), buf.length()) < 0) return;
+		DiskStage->Submit([s]() { StreamArchive(s); });
+	});
+}
+
+// Walk the tree on a disk thread, then stream it as one tar or zip response.
+// Content-Length is known up front, so a single Range resumes an interrupted download.
+void HttpArchive(
+	const std::shared_ptr<Connection>& conn,
+	const std::string& path,
+	const bool zip,
+	const char* coding,
+	const std::string& range)
+{
+	std::vector<ArchiveEntry> entries;
+	WalkTree(path, "", entries);
+	auto base = path;
+	while (base.length() > 1 && (base.back() == '/' || base.back() == '\\')) base.pop_back();
+	base = base.substr(base.find_last_of("/\\") + 1);
+	if (base.empty() || base.back() == ':') base = "root";
+	const auto archive = std::make_shared<Archive>(path, base + "/", zip, std::move(entries));
+	archive->utf8 = !strcasecmp(coding, "utf-8") || !strcasecmp(coding, "utf8");
+	auto s = std::make_shared<ArchiveStream>();
+	s->conn = conn;
+	s->archive = archive;
+	s->remaining = archive->Length();
+	const auto filename = base + (zip ? ".zip" : ".tar");
+	std::ostringstream head;
+	if (!range.empty())
+	{
+		const auto ranges = GetOffsetAndSize(range, archive->Length());
+		if (ranges.empty() || std::get<0>(ranges.front()) >= archive->Length())
+		{
+			std::ostringstream oss;
+			oss << "HTTP/1.1 416 Range Not Satisfiable\r\n"
+				"Content-Range: bytes */" << archive->Length() << "\r\n"
+				"Content-Length: 0\r\n"
+				"Server: iriszero/" VERSION "\r\n"
+				"Connection: close\r\n\r\n";
+			NetStage->Submit([conn, http = oss.str()]()
+			{
+				printf("<========================\n%s\n", http.c_str());
+				Send(*conn, http.c_str(), http.length());
+			});
+			return;
+		}
+		s->skip = std::get<0>(ranges.front());
+		s->remaining = std::get<1>(ranges.front());
+		if (s->skip + s->remaining > archive->Length()) s->remaining = archive->Length() - std::min(s->skip, archive->Length());
+		head << "HTTP/1.1 206 Partial Content\r\n"
+			"Content-Range: bytes " << s->skip << "-" << s->skip + s->remaining - 1 << "/" << archive->Length() << "\r\n";
+	}
+	else
+	{
+		head << "HTTP/1.1 200 OK\r\n";
+	}
+	head << "Accept-Ranges: bytes\r\n"
+		"Content-Length: " << s->remaining << "\r\n"
+		"Content-Type: " << (zip ? "application/zip" : "application/x-tar") << "\r\n"
+		"Content-Disposition: attachment; filename=\"" << filename << "\"\r\n"
+		"Server: iriszero/" VERSION "\r\n"
+		"Connection: close\r\n\r\n";
+	NetStage->Submit([s, head = head.str()]()
+	{
+		printf("<========================\n%s\n", head.c_str());
+		if (Send(*s->conn, head.c_str(), head.length()) < 0) return;
+		DiskStage->Submit([s]() { StreamArchive(s); });
+	});
+}
+
+// The listing page, compiled at startup from --listing-template (or the built-in markup below)
+// into literal segments and typed slots. Page slots are {{path}} and {{coding}}; {{#dir}}...{{/dir}}
+// and {{#file}}...{{/file}} give the markup of one entry, with {{href}}, {{name}} and {{size}}, and
+// stand where the entries go; {{?dir}}, {{?file}} and {{?search}} keep literal markup up to the
+// matching {{/...}} only when there are directories, files, or a path index to search.
+class ListingTemplate
+{
+public:
+	enum Slot
+	{
+		Text,
+		Path,
+		Coding,
+		Href,
+		Name,
+		Size,
+		Dirs,
+		Files,
+		IfDirs,
+		IfFiles,
+		IfSearch
+	};
+
+	struct Segment
+	{
+		Slot slot;
+		std::string text;
+	};
+
+	static const char* const Default;
+
+	bool Compile(const std::string& source, std::string& error)
+	{
+		static const std::map<std::string, Slot> sections =
+		{
+			{"#dir", Dirs}, {"#file", Files}, {"?dir", IfDirs}, {"?file", IfFiles}, {"?search", IfSearch}
+		};
+		static const std::map<std::string, Slot> variables =
+		{
+			{"path", Path}, {"coding", Coding}, {"href", Href}, {"name", Name}, {"size", Size}
+		};
+		page.clear();
+		dirRow.clear();
+		fileRow.clear();
+		auto out = &page;
+		std::vector<Segment> guard;
+		std::string open;
+		size_t pos = 0;
+		while (pos < source.length())
+		{
+			const auto start = source.find("{{", pos);
+			Append(*out, Text, source.substr(pos, start == std::string::npos ? std::string::npos : start - pos));
+			if (start == std::string::npos) break;
+			const auto end = source.find("}}", start);
+			if (end == std::string::npos)
+			{
+				error = "unterminated {{";
+				return false;
+			}
+			const auto tag = source.substr(start + 2, end - start - 2);
+			pos = end + 2;
+			const auto section = sections.find(tag);
+			const auto variable = variables.find(tag);
+			if (section != sections.end())
+			{
+				if (!open.empty())
+				{
+					error = "{{" + tag + "}} inside {{" + open + "}}";
+					return false;
+				}
+				open = tag;
+				page.push_back({section->second, std::string()});
+				if (section->second == Dirs) out = &dirRow;
+				else if (section->second == Files) out = &fileRow;
+				else out = &guard;
+			}
+			else if (tag[0] == '/')
+			{
+				if (open.empty() || tag.compare(1, std::string::npos, open, 1, std::string::npos))
+				{
+					error = "{{" + tag + "}} closes nothing";
+					return false;
+				}
+				for (const auto& s : guard) page.back().text += s.text;
+				guard.clear();
+				open.clear();
+				out = &page;
+			}
+			else if (variable == variables.end() ||
+				(out == &page) != (variable->second == Path || variable->second == Coding) || out == &guard)
+			{
+				error = "{{" + tag + "}} is not known" + (open.empty() ? std::string() : " inside {{" + open + "}}");
+				return false;
+			}
+			else out->push_back({variable->second, std::string()});
+		}
+		if (!open.empty())
+		{
+			error = "{{" + open + "}} is not closed";
+			return false;
+		}
+		return true;
+	}
+
+	// The markup of one entry.
+	std::string Entry(const bool dir, const std::string& href, const std::string& name, const uint64_t size) const
+	{
+		std::string out;
+		for (const auto& s : dir ? dirRow : fileRow)
+		{
+			if (s.slot == Text) out += s.text;
+			else if (s.slot == Href) out += href;
+			else if (s.slot == Name) out += name;
+			else if (s.slot == Size && !dir) out += std::to_string(size);
+		}
+		return out;
+	}
+
+	// The page as pieces for a gather write, in order. They point into path, coding and fragments,
+	// which must outlive them; each fragment holds an entry's markup with its directory flag.
+	template <typename Fragments>
+	void Assemble(const std::string& path, const std::string& coding, const Fragments& fragments,
+		const size_t dirs, const size_t files, std::vector<std::pair<const char*, size_t>>& pieces) const
+	{
+		for (const auto& s : page)
+		{
+			const std::string* text = &s.text;
+			if (s.slot == Path) text = &path;
+			else if (s.slot == Coding) text = &coding;
+			else if (s.slot == Dirs || s.slot == Files)
+			{
+				for (const auto& f : fragments)
+				{
+					if (f.dir == (s.slot == Dirs)) pieces.emplace_back(f.html->c_str(), f.html->length());
+				}
+				continue;
+			}
+			else if ((s.slot == IfDirs && !dirs) || (s.slot == IfFiles && !files) || (s.slot == IfSearch && !Paths)) continue;
+			if (!text->empty()) pieces.emplace_back(text->c_str(), text->length());
+		}
+	}
+
+private:
+	static void Append(std::vector<Segment>& out, const Slot slot, const std::string& text)
+	{
+		if (text.empty()) return;
+		if (!out.empty() && out.back().slot == Text) out.back().text += text;
+		else out.push_back({slot, text});
+	}
+
+	std::vector<Segment> page;
+	std::vector<Segment> dirRow;
+	std::vector<Segment> fileRow;
+};
+
+const char* const ListingTemplate::Default =
+	" <!DOCTYPE html>"
+	"<html>"
+	"<head><title>Index of {{path}}</title>"
+	"<meta charset=\"{{coding}}\"/>"
+	"</head>"
+	"<body>"
+	"<h1>Index of {{path}}</h1>"
+	"<a href=\"?archive=tar\">tar</a> <a href=\"?archive=zip\">zip</a>"
+	"{{?search}}<form><input name=\"search\"/><select name=\"mode\">"
+	"<option>substring</option><option>prefix</option><option>glob</option></select></form>{{/search}}"
+	"<hr>"
+	"{{#dir}}<a href=\"{{href}}\">{{name}}</a><br/>{{/dir}}"
+	"{{?dir}}<hr>{{/dir}}"
+	"<table>"
+	"{{?file}}<tr><th>File Name</th><th>Size</th></tr>{{/file}}"
+	"{{#file}}<tr><td><a href=\"{{href}}\">{{name}}</a></td><td align=\"right\">{{size}}</td></tr>{{/file}}"
+	"</table></body>"
+	"</html>";
+
+// Rendered listings by directory, one fragment of markup per entry. A refresh renders only the
+// entries that are new or changed size and shares the rest with the previous page, so the cost
+// of re-rendering follows the change, not the directory; pages are never concatenated but sent
+// as a gather write of the template's segments and the fragments.
+class ListingCache
+{
+public:
+	struct Fragment
+	{
+		std::string name;
+		bool dir = false;
+		uint64_t size = 0;
+		std::shared_ptr<const std::string> html;
+	};
+
+	struct Page
+	{
+		// In the order they were listed.
+		std::vector<Fragment> entries;
+		size_t dirs = 0;
+		size_t files = 0;
+		size_t bytes = 0;
+		// Charged to Memory::Listings while cached.
+		int64_t memory = 0;
+	};
+
+	ListingCache(const ListingTemplate& tmpl, const std::string& root, const size_t maxPages) :
+		tmpl(tmpl), root(root), maxPages(maxPages)
+	{
+	}
+
+	// The page of path holding exactly entries, as listed just now.
+	std::shared_ptr<const Page> Refresh(const std::string& path, const std::vector<ArchiveEntry>& entries)
+	{
+		std::shared_ptr<const Page> old;
+		{
+			std::lock_guard<std::mutex> lock(mtx);
+			const auto it = pages.find(path);
+			if (it != pages.end()) old = it->second.page;
+		}
+		if (old) Memory::Hit(Memory::Listings);
+		else Memory::Miss(Memory::Listings);
+		auto page = std::make_shared<Page>();
+		page->entries.reserve(entries.size());
+		// Entries of an unchanged directory come back in the same order; names are only indexed once they do not.
+		std::unordered_map<std::string, size_t> index;
+		size_t kept = 0, matched = 0;
+		for (size_t i = 0; i < entries.size(); ++i)
+		{
+			const auto& e = entries[i];
+			const Fragment* prev = nullptr;
+			if (old && i < old->entries.size() && old->entries[i].name == e.rel) prev = &old->entries[i];
+			else if (old)
+			{
+				if (index.empty())
+				{
+					for (size_t j = 0; j < old->entries.size(); ++j) index.emplace(old->entries[j].name, j);
+				}
+				const auto it = index.find(e.rel);
+				if (it != index.end()) prev = &old->entries[it->second];
+			}
+			page->entries.emplace_back();
+			auto& f = page->entries.back();
+			f.name = e.rel;
+			f.dir = e.dir;
+			f.size = e.size;
+			if (prev) ++matched;
+			if (prev && prev->dir == e.dir && prev->size == e.size)
+			{
+				f.html = prev->html;
+				++kept;
+			}
+			else
+			{
+				const auto full = PathCombine(path.c_str(), e.rel.c_str());
+				f.html = std::make_shared<const std::string>(tmpl.Entry(e.dir, PathHref(full), e.rel, e.size));
+				++rendered;
+			}
+			++(e.dir ? page->dirs : page->files);
+			page->bytes += f.html->length();
+			page->memory += sizeof(Fragment) + f.name.length() + f.html->length();
+		}
+		page->memory += sizeof(Page) + path.length();
+		reused += kept;
+		if (old) removed += old->entries.size() - matched;
+		int64_t released = 0;
+		{
+			std::lock_guard<std::mutex> lock(mtx);
+			auto it = pages.find(path);
+			if (it != pages.end()) released += it->second.page->memory;
+			else
+			{
+				if (pages.size() >= maxPages)
+				{
+					released += pages.begin()->second.page->memory;
+					pages.erase(pages.begin());
+				}
+				it = pages.emplace(path, Cached()).first;
+			}
+			it->second.page = page;
+			++it->second.uses;
+		}
+		Memory::Release(Memory::Listings, released);
+		Memory::Charge(Memory::Listings, page->memory);
+		return page;
+	}
+
+	// Drops the pages refreshed least per byte they hold until n bytes are gone. The counts of the
+	// rest age by Memory::Aging, so a directory that was busy once does not stay forever.
+	int64_t Evict(const int64_t n)
+	{
+		std::lock_guard<std::mutex> lock(mtx);
+		std::vector<std::pair<double, std::string>> order;
+		order.reserve(pages.size());
+		int64_t held = 0;
+		for (const auto& p : pages)
+		{
+			order.emplace_back(p.second.uses / static_cast<double>(p.second.page->memory), p.first);
+			held += p.second.page->memory;
+		}
+		std::sort(order.begin(), order.end());
+		int64_t freed = 0;
+		for (const auto& o : order)
+		{
+			if (freed >= n) break;
+			const auto it = pages.find(o.second);
+			freed += it->second.page->memory;
+			pages.erase(it);
+		}
+		if (aging.Due(freed, held))
+		{
+			for (auto& p : pages) p.second.uses /= 2;
+		}
+		return freed;
+	}
+
+	// Bytes the rendered pages hold, as charged to Memory::Listings.
+	int64_t Held()
+	{
+		std::lock_guard<std::mutex> lock(mtx);
+		int64_t held = 0;
+		for (const auto& p : pages) held += p.second.page->memory;
+		return held;
+	}
+
+	std::string Stats()
+	{
+		size_t cached, bytes = 0;
+		{
+			std::lock_guard<std::mutex> lock(mtx);
+			cached = pages.size();
+			for (const auto& p : pages) bytes += p.second.page->bytes;
+		}
+		std::ostringstream oss;
+		oss << "listing root=" << root <<
+			" pages=" << cached <<
+			" fragment-bytes=" << bytes <<
+			" rendered=" << rendered.load() <<
+			" reused=" << reused.load() <<
+			" removed=" << removed.load();
+		return oss.str();
+	}
+
+private:
+	struct Cached
+	{
+		std::shared_ptr<const Page> page;
+		// Refreshes, halved as Memory::Aging says.
+		uint64_t uses = 0;
+	};
+
+	const ListingTemplate& tmpl;
+	const std::string root;
+	size_t maxPages;
+	std::mutex mtx;
+	std::map<std::string, Cached> pages;
+	Memory::Aging aging;
+	std::atomic<uint64_t> rendered{0};
+	std::atomic<uint64_t> reused{0};
+	std::atomic<uint64_t> removed{0};
+};
+
+void IndexOf(Connection& conn, const std::string& path, const char* coding, const ListingCache::Page& page)
+{
+	const auto assembling = Tracer::Start(conn.trace);
+	const std::string charset = coding;
+	std::vector<std::pair<const char*, size_t>> pieces(1);
+	conn.root->listingTemplate->Assemble(path, charset, page.entries, page.dirs, page.files, pieces);
+	size_t length = 0;
+	for (const auto& p : pieces) length += p.second;
+	std::ostringstream head;
+	head << "HTTP/1.1 200 OK\r\nContent-length: " << std::to_string(length) <<
+		"\r\nServer: iriszero/" VERSION <<
+		"\r\nContent-Type: text/html\r\n\r\n";
+	const auto headText = head.str();
+	pieces[0] = {headText.c_str(), headText.length()};
+	Memory::Lease lease(Memory::Responses, headText.length() + pieces.size() * sizeof(pieces[0]));
+	Tracer::Record(conn.trace, "assemble", assembling);
+	printf("<========================\n%s\n", headText.c_str());
+	Tracer::Scope span(conn.trace, "send");
+	SendGather(conn, pieces);
+}
+
+// Walk the directory on a disk thread, then render and send it from a network thread.
+void AsyncIndexOf(const std::shared_ptr<Connection>& conn, const std::string& path, const char* coding)
+{
+	const auto listing = Tracer::Start(conn->trace);
+	std::vector<ArchiveEntry> entries;
+	const auto snap = CurrentSnapshot();
+	const auto idx = snap ? snap->Find(path) : TreeSnapshot::npos;
+	if (idx != TreeSnapshot::npos && !snap->Reconciled(idx)) snap->Render(idx, entries);
+	else GetFiles(path.c_str(), entries);
+	Tracer::Record(conn->trace, "list", listing, path);
+	const auto rendering = Tracer::Start(conn->trace);
+	const auto page = conn->root->listings->Refresh(path, entries);
+	Tracer::Record(conn->trace, "render", rendering);
+	const auto queued = Tracer::Start(conn->trace);
+	NetStage->Submit([conn, path, coding, queued, page]()
+	{
+		Tracer::Record(conn->trace, "net-queue", queued);
+		IndexOf(*conn, path, coding, *page);
+	});
+}
+
+// HTTP/2 over cleartext TCP (h2c), reached either by prior knowledge or by an
+// HTTP/1.1 Upgrade. Every stream is handed to the ordinary request handlers as
+// a Connection of its own; what they write is reframed onto the stream here.
+
+static const char* const H2Preface = "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n";
+#define H2PrefaceLength 24
+#define H2MaxStreams 100
+#define H2FrameMax 16384
+
+enum H2FrameType : uint8_t
+{
+	H2Data, H2Headers, H2Priority, H2RstStream, H2Settings,
+	H2PushPromise, H2Ping, H2GoAway, H2WindowUpdate, H2Continuation
+};
+
+enum H2Flags : uint8_t
+{
+	H2EndStream = 0x1, H2Ack = 0x1, H2EndHeaders = 0x4, H2Padded = 0x8, H2PriorityFlag = 0x20
+};
+
+enum H2ErrorCode : uint32_t
+{
+	H2NoError, H2ProtocolError, H2InternalError, H2FlowControlError, H2SettingsTimeout,
+	H2StreamClosed, H2FrameSizeError, H2RefusedStream, H2Cancel, H2CompressionError,
+	H2ConnectError, H2EnhanceYourCalm
+};
+
+static const char* const HpackStaticTable[61][2] =
+{
+	{":authority", ""}, {":method", "GET"}, {":method", "POST"}, {":path", "/"}, {":path", "/index.html"},
+	{":scheme", "http"}, {":scheme", "https"}, {":status", "200"}, {":status", "204"}, {":status", "206"},
+	{":status", "304"}, {":status", "400"}, {":status", "404"}, {":status", "500"}, {"accept-charset", ""},
+	{"accept-encoding", "gzip, deflate"}, {"accept-language", ""}, {"accept-ranges", ""}, {"accept", ""},
+	{"access-control-allow-origin", ""}, {"age", ""}, {"allow", ""}, {"authorization", ""},
+	{"cache-control", ""}, {"content-disposition", ""}, {"content-encoding", ""}, {"content-language", ""},
+	{"content-length", ""}, {"content-location", ""}, {"content-range", ""}, {"content-type", ""},
+	{"cookie", ""}, {"date", ""}, {"etag", ""}, {"expect", ""}, {"expires", ""}, {"from", ""},
+	{"host", ""}, {"if-match", ""}, {"if-modified-since", ""}, {"if-none-match", ""}, {"if-range", ""},
+	{"if-unmodified-since", ""}, {"last-modified", ""}, {"link", ""}, {"location", ""},
+	{"max-forwards", ""}, {"proxy-authenticate", ""}, {"proxy-authorization", ""}, {"range", ""},
+	{"referer", ""}, {"refresh", ""}, {"retry-after", ""}, {"server", ""}, {"set-cookie", ""},
+	{"strict-transport-security", ""}, {"transfer-encoding", ""}, {"user-agent", ""}, {"vary", ""},
+	{"via", ""}, {"www-authenticate", ""}
+};
+
+// {code, bits} for every octet and EOS, RFC 7541 Appendix B.
+static const uint32_t HpackHuffman[257][2] =
+{
+	{0x1ff8, 13}, {0x7fffd8, 23}, {0xfffffe2, 28}, {0xfffffe3, 28}, {0xfffffe4, 28}, {0xfffffe5, 28},
+	{0xfffffe6, 28}, {0xfffffe7, 28}, {0xfffffe8, 28}, {0xffffea, 24}, {0x3ffffffc, 30}, {0xfffffe9, 28},
+	{0xfffffea, 28}, {0x3ffffffd, 30}, {0xfffffeb, 28}, {0xfffffec, 28}, {0xfffffed, 28}, {0xfffffee, 28},
+	{0xfffffef, 28}, {0xffffff0, 28}, {0xffffff1, 28}, {0xffffff2, 28}, {0x3ffffffe, 30}, {0xffffff3, 28},
+	{0xffffff4, 28}, {0xffffff5, 28}, {0xffffff6, 28}, {0xffffff7, 28}, {0xffffff8, 28}, {0xffffff9, 28},
+	{0xffffffa, 28}, {0xffffffb, 28}, {0x14, 6}, {0x3f8, 10}, {0x3f9, 10}, {0xffa, 12},
+	{0x1ff9, 13}, {0x15, 6}, {0xf8, 8}, {0x7fa, 11}, {0x3fa, 10}, {0x3fb, 10},
+	{0xf9, 8}, {0x7fb, 11}, {0xfa, 8}, {0x16, 6}, {0x17, 6}, {0x18, 6},
+	{0x0, 5}, {0x1, 5}, {0x2, 5}, {0x19, 6}, {0x1a, 6}, {0x1b, 6},
+	{0x1c, 6}, {0x1d, 6}, {0x1e, 6}, {0x1f, 6}, {0x5c, 7}, {0xfb, 8},
+	{0x7ffc, 15}, {0x20, 6}, {0xffb, 12}, {0x3fc, 10}, {0x1ffa, 13}, {0x21, 6},
+	{0x5d, 7}, {0x5e, 7}, {0x5f, 7}, {0x60, 7}, {0x61, 7}, {0x62, 7},
+	{0x63, 7}, {0x64, 7}, {0x65, 7}, {0x66, 7}, {0x67, 7}, {0x68, 7},
+	{0x69, 7}, {0x6a, 7}, {0x6b, 7}, {0x6c, 7}, {0x6d, 7}, {0x6e, 7},
+	{0x6f, 7}, {0x70, 7}, {0x71, 7}, {0x72, 7}, {0xfc, 8}, {0x73, 7},
+	{0xfd, 8}, {0x1ffb, 13}, {0x7fff0, 19}, {0x1ffc, 13}, {0x3ffc, 14}, {0x22, 6},
+	{0x7ffd, 15}, {0x3, 5}, {0x23, 6}, {0x4, 5}, {0x24, 6}, {0x5, 5},
+	{0x25, 6}, {0x26, 6}, {0x27, 6}, {0x6, 5}, {0x74, 7}, {0x75, 7},
+	{0x28, 6}, {0x29, 6}, {0x2a, 6}, {0x7, 5}, {0x2b, 6}, {0x76, 7},
+	{0x2c, 6}, {0x8, 5}, {0x9, 5}, {0x2d, 6}, {0x77, 7}, {0x78, 7},
+	{0x79, 7}, {0x7a, 7}, {0x7b, 7}, {0x7ffe, 15}, {0x7fc, 11}, {0x3ffd, 14},
+	{0x1ffd, 13}, {0xffffffc, 28}, {0xfffe6, 20}, {0x3fffd2, 22}, {0xfffe7, 20}, {0xfffe8, 20},
+	{0x3fffd3, 22}, {0x3fffd4, 22}, {0x3fffd5, 22}, {0x7fffd9, 23}, {0x3fffd6, 22}, {0x7fffda, 23},
+	{0x7fffdb, 23}, {0x7fffdc, 23}, {0x7fffdd, 23}, {0x7fffde, 23}, {0xffffeb, 24}, {0x7fffdf, 23},
+	{0xffffec, 24}, {0xffffed, 24}, {0x3fffd7, 22}, {0x7fffe0, 23}, {0xffffee, 24}, {0x7fffe1, 23},
+	{0x7fffe2, 23}, {0x7fffe3, 23}, {0x7fffe4, 23}, {0x1fffdc, 21}, {0x3fffd8, 22}, {0x7fffe5, 23},
+	{0x3fffd9, 22}, {0x7fffe6, 23}, {0x7fffe7, 23}, {0xffffef, 24}, {0x3fffda, 22}, {0x1fffdd, 21},
+	{0xfffe9, 20}, {0x3fffdb, 22}, {0x3fffdc, 22}, {0x7fffe8, 23}, {0x7fffe9, 23}, {0x1fffde, 21},
+	{0x7fffea, 23}, {0x3fffdd, 22}, {0x3fffde, 22}, {0xfffff0, 24}, {0x1fffdf, 21}, {0x3fffdf, 22},
+	{0x7fffeb, 23}, {0x7fffec, 23}, {0x1fffe0, 21}, {0x1fffe1, 21}, {0x3fffe0, 22}, {0x1fffe2, 21},
+	{0x7fffed, 23}, {0x3fffe1, 22}, {0x7fffee, 23}, {0x7fffef, 23}, {0xfffea, 20}, {0x3fffe2, 22},
+	{0x3fffe3, 22}, {0x3fffe4, 22}, {0x7ffff0, 23}, {0x3fffe5, 22}, {0x3fffe6, 22}, {0x7ffff1, 23},
+	{0x3ffffe0, 26}, {0x3ffffe1, 26}, {0xfffeb, 20}, {0x7fff1, 19}, {0x3fffe7, 22}, {0x7ffff2, 23},
+	{0x3fffe8, 22}, {0x1ffffec, 25}, {0x3ffffe2, 26}, {0x3ffffe3, 26}, {0x3ffffe4, 26}, {0x7ffffde, 27},
+	{0x7ffffdf, 27}, {0x3ffffe5, 26}, {0xfffff1, 24}, {0x1ffffed, 25}, {0x7fff2, 19}, {0x1fffe3, 21},
+	{0x3ffffe6, 26}, {0x7ffffe0, 27}, {0x7ffffe1, 27}, {0x3ffffe7, 26}, {0x7ffffe2, 27}, {0xfffff2, 24},
+	{0x1fffe4, 21}, {0x1fffe5, 21}, {0x3ffffe8, 26}, {0x3ffffe9, 26}, {0xffffffd, 28}, {0x7ffffe3, 27},
+	{0x7ffffe4, 27}, {0x7ffffe5, 27}, {0xfffec, 20}, {0xfffff3, 24}, {0xfffed, 20}, {0x1fffe6, 21},
+	{0x3fffe9, 22}, {0x1fffe7, 21}, {0x1fffe8, 21}, {0x7ffff3, 23}, {0x3fffea, 22}, {0x3fffeb, 22},
+	{0x1ffffee, 25}, {0x1ffffef, 25}, {0xfffff4, 24}, {0xfffff5, 24}, {0x3ffffea, 26}, {0x7ffff4, 23},
+	{0x3ffffeb, 26}, {0x7ffffe6, 27}, {0x3ffffec, 26}, {0x3ffffed, 26}, {0x7ffffe7, 27}, {0x7ffffe8, 27},
+	{0x7ffffe9, 27}, {0x7ffffea, 27}, {0x7ffffeb, 27}, {0xffffffe, 28}, {0x7ffffec, 27}, {0x7ffffed, 27},
+	{0x7ffffee, 27}, {0x7ffffef, 27}, {0x7fffff0, 27}, {0x3ffffee, 26}, {0x3fffffff, 30}};
+
+typedef std::vector<std::pair<std::string, std::string>> HeaderList;
+
+class HpackHuffmanTree
+{
+public:
+	HpackHuffmanTree()
+	{
+		nodes.push_back({{0, 0}, -1});
+		for (auto sym = 0; sym < 257; ++sym)
+		{
+			auto node = 0;
+			for (auto bit = static_cast<int>(HpackHuffman[sym][1]) - 1; bit >= 0; --bit)
+			{
+				const auto b = (HpackHuffman[sym][0] >> bit) & 1;
+				if (!nodes[node].child[b])
+				{
+					nodes[node].child[b] = static_cast<int32_t>(nodes.size());
+					nodes.push_back({{0, 0}, -1});
+				}
+				node = nodes[node].child[b];
+			}
+			nodes[node].sym = sym;
+		}
+	}
+
+	bool Decode(const uint8_t* data, const size_t len, std::string& out) const
+	{
+		auto node = 0, depth = 0;
+		auto ones = true;
+		for (size_t i = 0; i < len; ++i)
+		{
+			for (auto bit = 7; bit >= 0; --bit)
+			{
+				const auto b = (data[i] >> bit) & 1;
+				node = nodes[node].child[b];
+				if (!node) return false;
+				++depth;
+				ones = ones && b;
+				if (nodes[node].sym < 0) continue;
+				if (nodes[node].sym == 256) return false;
+				out += static_cast<char>(nodes[node].sym);
+				node = depth = 0;
+				ones = true;
+			}
+		}
+		// Only a partial EOS, at most seven one bits, may pad the last octet.
+		return depth < 8 && ones;
+	}
+
+private:
+	struct Node
+	{
+		int32_t child[2];
+		int32_t sym;
+	};
+	std::vector<Node> nodes;
+};
+
+std::string HuffmanEncode(const std::string& s)
+{
+	std::string out;
+	uint64_t bits = 0;
+	auto count = 0;
+	for (const auto c : s)
+	{
+		const auto* code = HpackHuffman[static_cast<uint8_t>(c)];
+		bits = (bits << code[1]) | code[0];
+		count += code[1];
+		for (; count >= 8; count -= 8) out += static_cast<char>(bits >> (count - 8));
+	}
+	if (count) out += static_cast<char>((bits << (8 - count)) | (0xff >> count));
+	return out;
+}
+
+size_t HuffmanLength(const std::string& s)
+{
+	size_t bits = 0;
+	for (const auto c : s) bits += HpackHuffman[static_cast<uint8_t>(c)][1];
+	return (bits + 7) / 8;
+}
+
+bool HpackGetInt(const uint8_t*& p, const uint8_t* end, const int prefix, uint64_t& value)
+{
+	if (p >= end) return false;
+	const uint64_t max = (1u << prefix) - 1;
+	value = *p++ & max;
+	if (value < max) return true;
+	for (auto shift = 0; p < end && shift < 56; shift += 7)
+	{
+		const auto b = *p++;
+		value += static_cast<uint64_t>(b & 0x7f) << shift;
+		if (!(b & 0x80)) return true;
+	}
+	return false;
+}
+
+void HpackPutInt(std::string& out, const uint8_t flags, const int prefix, uint64_t value)
+{
+	const uint64_t max = (1u << prefix) - 1;
+	if (value < max)
+	{
+		out += static_cast<char>(flags | value);
+		return;
+	}
+	out += static_cast<char>(flags | max);
+	for (value -= max; value >= 0x80; value >>= 7) out += static_cast<char>(0x80 | (value & 0x7f));
+	out += static_cast<char>(value);
+}
+
+bool HpackGetString(const uint8_t*& p, const uint8_t* end, std::string& out)
+{
+	static const HpackHuffmanTree tree;
+	if (p >= end) return false;
+	const auto huffman = (*p & 0x80) != 0;
+	uint64_t len = 0;
+	if (!HpackGetInt(p, end, 7, len) || len > static_cast<uint64_t>(end - p)) return false;
+	out.clear();
+	if (huffman && !tree.Decode(p, len, out)) return false;
+	if (!huffman) out.assign(reinterpret_cast<const char*>(p), len);
+	p += len;
+	return true;
+}
+
+void HpackPutString(std::string& out, const std::string& s)
+{
+	const auto len = HuffmanLength(s);
+	if (len < s.length())
+	{
+		HpackPutInt(out, 0x80, 7, len);
+		out += HuffmanEncode(s);
+		return;
+	}
+	HpackPutInt(out, 0x00, 7, s.length());
+	out += s;
+}
+
+// The static table followed by one direction's dynamic table, newest entry first.
+class HpackTable
+{
+public:
+	bool Get(const uint64_t index, std::string& name, std::string& value) const
+	{
+		if (!index || index > 61 + entries.size()) return false;
+		if (index <= 61)
+		{
+			name = HpackStaticTable[index - 1][0];
+			value = HpackStaticTable[index - 1][1];
+			return true;
+		}
+		name = entries[index - 62].first;
+		value = entries[index - 62].second;
+		return true;
+	}
+
+	// The index of an exact match, else of the first entry with this name, else 0.
+	uint64_t Find(const std::string& name, const std::string& value, bool& nameOnly) const
+	{
+		uint64_t byName = 0;
+		for (auto i = 0; i < 61; ++i)
+		{
+			if (name != HpackStaticTable[i][0]) continue;
+			if (value == HpackStaticTable[i][1])
+			{
+				nameOnly = false;
+				return i + 1;
+			}
+			if (!byName) byName = i + 1;
+		}
+		for (size_t i = 0; i < entries.size(); ++i)
+		{
+			if (name != entries[i].first) continue;
+			if (value == entries[i].second)
+			{
+				nameOnly = false;
+				return i + 62;
+			}
+			if (!byName) byName = i + 62;
+		}
+		nameOnly = byName != 0;
+		return byName;
+	}
+
+	void Add(const std::string& name, const std::string& value)
+	{
+		entries.emplace_front(name, value);
+		size += name.length() + value.length() + 32;
+		Evict();
+	}
+
+	void Resize(const size_t max)
+	{
+		maxSize = max;
+		Evict();
+	}
+
+	size_t MaxSize() const
+	{
+		return maxSize;
+	}
+
+private:
+	void Evict()
+	{
+		while (size > maxSize && !entries.empty())
+		{
+			size -= entries.back().first.length() + entries.back().second.length() + 32;
+			entries.pop_back();
+		}
+	}
+
+	std::deque<std::pair<std::string, std::string>> entries;
+	size_t size = 0;
+	size_t maxSize = 4096;
+};
+
+bool HpackDecode(HpackTable& table, const std::string& block, HeaderList& headers)
+{
+	auto p = reinterpret_cast<const uint8_t*>(block.data());
+	const auto end = p + block.length();
+	while (p < end)
+	{
+		std::string name, value;
+		uint64_t index = 0;
+		if (*p & 0x80)
+		{
+			if (!HpackGetInt(p, end, 7, index) || !table.Get(index, name, value)) return false;
+			headers.emplace_back(name, value);
+			continue;
+		}
+		if ((*p & 0xe0) == 0x20)
+		{
+			if (!HpackGetInt(p, end, 5, index) || index > 4096) return false;
+			table.Resize(index);
+			continue;
+		}
+		const auto indexing = (*p & 0xc0) == 0x40;
+		if (!HpackGetInt(p, end, indexing ? 6 : 4, index)) return false;
+		if (index && !table.Get(index, name, value)) return false;
+		if (!index && !HpackGetString(p, end, name)) return false;
+		if (!HpackGetString(p, end, value)) return false;
+		if (indexing) table.Add(name, value);
+		headers.emplace_back(name, value);
+	}
+	return true;
+}
+
+std::string HpackEncode(HpackTable& table, const HeaderList& headers)
+{
+	std::string out;
+	for (const auto& h : headers)
+	{
+		auto nameOnly = false;
+		const auto index = table.Find(h.first, h.second, nameOnly);
+		if (index && !nameOnly)
+		{
+			HpackPutInt(out, 0x80, 7, index);
+			continue;
+		}
+		// Values that differ on nearly every response would only churn the table.
+		const auto indexing =
+			h.first != "content-length" &&
+			h.first != "content-range" &&
+			h.first != "content-disposition" &&
+			h.first != "last-modified";
+		HpackPutInt(out, indexing ? 0x40 : 0x00, indexing ? 6 : 4, index);
+		if (!index) HpackPutString(out, h.first);
+		HpackPutString(out, h.second);
+		if (indexing) table.Add(h.first, h.second);
+	}
+	return out;
+}
+
+std::string H2FrameHeader(const uint32_t len, const uint8_t type, const uint8_t flags, const uint32_t id)
+{
+	const char head[9] =
+	{
+		static_cast<char>(len >> 16), static_cast<char>(len >> 8), static_cast<char>(len),
+		static_cast<char>(type), static_cast<char>(flags),
+		static_cast<char>(id >> 24 & 0x7f), static_cast<char>(id >> 16), static_cast<char>(id >> 8), static_cast<char>(id)
+	};
+	return std::string(head, sizeof(head));
+}
+
+std::string H2Word(const uint32_t v)
+{
+	const char word[4] = {static_cast<char>(v >> 24), static_cast<char>(v >> 16), static_cast<char>(v >> 8), static_cast<char>(v)};
+	return std::string(word, sizeof(word));
+}
+
+uint32_t GetBigEndian32(const char* p)
+{
+	const auto u = reinterpret_cast<const uint8_t*>(p);
+	return static_cast<uint32_t>(u[0]) << 24 | u[1] << 16 | u[2] << 8 | u[3];
+}
+
+std::string Base64UrlDecode(const std::string& s)
+{
+	std::string out;
+	uint32_t bits = 0;
+	auto count = 0;
+	for (const auto c : s)
+	{
+		int v;
+		if (c >= 'A' && c <= 'Z') v = c - 'A';
+		else if (c >= 'a' && c <= 'z') v = c - 'a' + 26;
+		else if (c >= '0' && c <= '9') v = c - '0' + 52;
+		else if (c == '-' || c == '+') v = 62;
+		else if (c == '_' || c == '/') v = 63;
+		else continue;
+		bits = bits << 6 | v;
+		count += 6;
+		if (count >= 8)
+		{
+			count -= 8;
+			out += static_cast<char>(bits >> count);
+		}
+	}
+	return out;
+}
+
+void Dispatch(const std::shared_ptr<Connection>& conn, const std::string& http);
+
+class H2Session;
+
+// One request/response exchange on an HTTP/2 connection. The handler writes
+// an HTTP/1.1 response into it: the head becomes a HEADERS frame, and the body
+// becomes DATA frames bounded by the peer's flow-control windows.
+struct H2Stream
+{
+	// Body written while the flow-control windows were shut, sent as WINDOW_UPDATEs open them.
+	struct Parked
+	{
+		// From memory, the bytes from offset on; from a file, a handle of its own, as the writer may close fp first.
+		std::string data;
+		FILE* fp = nullptr;
+		uint64_t offset = 0;
+		size_t len = 0;
+		// Its last byte ends the stream.
+		bool end = false;
+	};
+
+	std::shared_ptr<H2Session> session;
+	uint32_t id = 0;
+	// Peer's receive window for this stream, guarded by the session mutex.
+	int64_t window = 0;
+	bool reset = false;
+	bool ended = false;
+	bool headOnly = false;
+	// Guarded by the session mutex: the parked body, whether a frame of it is being sent, whether the
+	// handler closed the stream behind it, and what to call once it is all sent.
+	std::deque<Parked> parked;
+	bool flushing = false;
+	bool closing = false;
+	std::function<void(bool)> resume;
+	// Only touched by the thread running the stream's handler.
+	std::string head;
+	bool headSent = false;
+	int64_t bodyLeft = -1;
+
+	int Write(const char* data, size_t len, FILE* fp = nullptr, uint64_t offset = 0);
+	// When body is parked, keep then to call once it has been sent (true) or dropped (false); else false.
+	bool Defer(std::function<void(bool)> then);
+	void Close();
+};
+
+class H2Session : public std::enable_shared_from_this<H2Session>
+{
+public:
+	~H2Session()
+	{
+		--Active;
+	}
+
+	// A session for conn, or null when --h2c-sessions are already open, as each has a reader thread of its own.
+	static std::shared_ptr<H2Session> Admit(std::shared_ptr<Connection> conn)
+	{
+		static const auto max = static_cast<uint64_t>(std::max<int64_t>(0, GetOptionInt("h2c-sessions", 256)));
+		auto active = Active.load();
+		do
+		{
+			if (max && active >= max)
+			{
+				++Rejected;
+				return nullptr;
+			}
+		} while (!Active.compare_exchange_weak(active, active + 1));
+		++Sessions;
+		return std::shared_ptr<H2Session>(new H2Session(std::move(conn)));
+	}
+
+	// Serve the connection until the peer goes away. pending holds bytes already
+	// read past the HTTP/1.1 request, if any; upgrade is that request when the
+	// client asked to switch with Upgrade: h2c, and it becomes stream 1.
+	void Run(std::string pending, const std::string& upgrade, const std::string& settings)
+	{
+		// Frames from many streams interleave on one socket; don't let Nagle hold a tail back until the next ACK.
+		const int one = 1;
+		setsockopt(conn->fd, IPPROTO_TCP, TCP_NODELAY, reinterpret_cast<const char*>(&one), sizeof(one));
+		std::string frame;
+		frame += H2FrameHeader(6, H2Settings, 0, 0);
+		frame += std::string("\0\x03", 2) + H2Word(H2MaxStreams);
+		if (WriteFrame(frame) < 0) return Shutdown();
+		if (!upgrade.empty())
+		{
+			ApplySettings(Base64UrlDecode(settings));
+			lastStream = 1;
+			Open(1, upgrade, false);
+		}
+		if (!Fill(pending, H2PrefaceLength) || pending.compare(0, H2PrefaceLength, H2Preface))
+		{
+			GoAway(H2ProtocolError);
+			return Shutdown();
+		}
+		pending.erase(0, H2PrefaceLength);
+		while (Fill(pending, 9))
+		{
+			const auto len = GetBigEndian32(pending.data()) >> 8;
+			const auto type = static_cast<uint8_t>(pending[3]);
+			const auto flags = static_cast<uint8_t>(pending[4]);
+			const auto id = GetBigEndian32(pending.data() + 5) & 0x7fffffff;
+			if (len > H2FrameMax)
+			{
+				GoAway(H2FrameSizeError);
+				break;
+			}
+			if (!Fill(pending, 9 + len)) break;
+			const auto payload = pending.substr(9, len);
+			pending.erase(0, 9 + len);
+			const auto error = OnFrame(type, flags, id, payload);
+			if (error != H2NoError)
+			{
+				GoAway(error);
+				break;
+			}
+		}
+		Shutdown();
+	}
+
+	// Send the response head collected on a stream as HEADERS (and CONTINUATION) frames.
+	int SendHead(H2Stream& s)
+	{
+		HeaderList headers;
+		auto status = std::string("200");
+		size_t pos = 0;
+		for (auto end = s.head.find("\r\n"); end != std::string::npos; pos = end + 2, end = s.head.find("\r\n", pos))
+		{
+			const auto line = s.head.substr(pos, end - pos);
+			if (!pos)
+			{
+				const auto sp = line.find(' ');
+				if (sp != std::string::npos) status = line.substr(sp + 1, 3);
+				continue;
+			}
+			const auto colon = line.find(':');
+			if (colon == std::string::npos) continue;
+			auto name = line.substr(0, colon);
+			std::transform(name.begin(), name.end(), name.begin(), [](unsigned char c) { return std::tolower(c); });
+			const auto start = line.find_first_not_of(' ', colon + 1);
+			const auto value = start == std::string::npos ? std::string() : line.substr(start);
+			if (name == "connection" || name == "keep-alive" || name == "transfer-encoding" ||
+				name == "upgrade" || name == "proxy-connection") continue;
+			if (name == "content-length") s.bodyLeft = std::strtoll(value.c_str(), nullptr, 10);
+			headers.emplace_back(name, value);
+		}
+		if (status == "204" || status == "304" || s.headOnly) s.bodyLeft = 0;
+		headers.insert(headers.begin(), {":status", status});
+		s.head.clear();
+		s.headSent = true;
+		// Retire the stream before its last frame leaves, so the peer may open another as soon as it sees it.
+		const auto end = s.bodyLeft == 0;
+		if (end) Finish(s);
+		{
+			std::lock_guard<std::mutex> lock(writeMtx);
+			std::string block;
+			if (encoderResize)
+			{
+				HpackPutInt(block, 0x20, 5, encoder.MaxSize());
+				encoderResize = false;
+			}
+			block += HpackEncode(encoder, headers);
+			std::string frames;
+			size_t off = 0;
+			do
+			{
+				const auto n = std::min<size_t>(block.length() - off, peerMaxFrame);
+				const auto type = off ? H2Continuation : H2Headers;
+				const auto flags = (off + n == block.length() ? H2EndHeaders : 0) | (!off && end ? H2EndStream : 0);
+				frames += H2FrameHeader(n, type, flags, s.id);
+				frames.append(block, off, n);
+				off += n;
+			} while (off < block.length());
+			if (WriteFrame(frames) < 0) return -1;
+		}
+		return 0;
+	}
+
+	// Send body bytes, from memory or straight from a file, as DATA frames. What the flow-control
+	// windows don't admit yet is parked on the stream for Drain, so the handler's thread never waits on the peer.
+	int SendBody(H2Stream& s, const char* data, size_t len, FILE* fp, uint64_t offset)
+	{
+		if (s.bodyLeft >= 0)
+		{
+			len = static_cast<size_t>(std::min<uint64_t>(len, s.bodyLeft));
+			s.bodyLeft -= len;
+		}
+		const auto last = s.bodyLeft == 0;
+		while (len)
+		{
+			size_t n;
+			bool end;
+			{
+				std::lock_guard<std::mutex> lock(mtx);
+				if (closed || s.reset) return -1;
+				if (!s.parked.empty() || s.flushing || s.window <= 0 || window <= 0) return Park(s, data, len, fp, offset, last);
+				n = static_cast<size_t>(std::min<int64_t>({static_cast<int64_t>(len), s.window, window, peerMaxFrame}));
+				s.window -= n;
+				window -= n;
+				end = last && n == len;
+				if (end) Retire(s);
+			}
+			if (SendData(s.id, end, data, n, fp, offset) < 0) return -1;
+			if (data) data += n;
+			offset += n;
+			len -= n;
+		}
+		return 0;
+	}
+
+	bool Defer(H2Stream& s, std::function<void(bool)>& then)
+	{
+		std::lock_guard<std::mutex> lock(mtx);
+		if (s.parked.empty() && !s.flushing) return false;
+		s.resume = std::move(then);
+		return true;
+	}
+
+	// The handler let go of the stream: end it cleanly if its length was open-ended, else reset it.
+	// With body still parked, Drain does this once the body is out.
+	void Close(H2Stream& s)
+	{
+		{
+			std::lock_guard<std::mutex> lock(mtx);
+			if (!s.parked.empty() || s.flushing)
+			{
+				s.closing = true;
+				return;
+			}
+		}
+		const auto open = !s.ended && !s.reset;
+		Finish(s);
+		if (!open || closed) return;
+		std::lock_guard<std::mutex> lock(writeMtx);
+		if (s.headSent && s.bodyLeft < 0) WriteFrame(H2FrameHeader(0, H2Data, H2EndStream, s.id));
+		else RstStream(s.id, H2InternalError);
+	}
+
+	static std::string Stats()
+	{
+		std::ostringstream oss;
+		oss << "h2c sessions=" << Sessions.load() <<
+			" active=" << Active.load() <<
+			" streams=" << Streams.load() <<
+			" refused=" << Refused.load() <<
+			" resets=" << Resets.load() <<
+			" parked=" << Parks.load() <<
+			" rejected=" << Rejected.load();
+		return oss.str();
+	}
+
+private:
+	explicit H2Session(std::shared_ptr<Connection> conn) :
+		conn(std::move(conn))
+	{
+	}
+
+	bool Fill(std::string& pending, const size_t want)
+	{
+		char buf[H2FrameMax];
+		while (pending.length() < want)
+		{
+			const auto len = recv(conn->fd, buf, sizeof(buf), 0);
+			if (len <= 0) return false;
+			pending.append(buf, len);
+		}
+		return true;
+	}
+
+	// Callers hold writeMtx. more holds the bytes back to leave with whatever is sent next.
+	int WriteFrame(const std::string& frame, const bool more = false)
+	{
+#ifdef MSG_MORE
+		const auto flags = more ? MSG_MORE : 0;
+#else
+		const auto flags = 0;
+#endif
+		if (closed || SendAll(conn->fd, frame.data(), frame.length(), flags) < 0) return Fail();
+		return 0;
+	}
+
+	int Fail()
+	{
+		closed = true;
+		shutdown(conn->fd, 2);
+		return -1;
+	}
+
+	// One DATA frame of n bytes, from data or from fp at offset.
+	int SendData(const uint32_t id, const bool end, const char* data, const size_t n, FILE* fp, const uint64_t offset)
+	{
+		std::lock_guard<std::mutex> lock(writeMtx);
+		auto frame = H2FrameHeader(n, H2Data, end ? H2EndStream : 0, id);
+		if (!fp) frame.append(data, n);
+		if (WriteFrame(frame, fp != nullptr) < 0) return -1;
+		if (fp && SendFileAll(conn->fd, fp, offset, n) < 0) return Fail();
+		return 0;
+	}
+
+	// Callers hold mtx. Keep the rest of a body write on the stream until the windows take it.
+	int Park(H2Stream& s, const char* data, const size_t len, FILE* fp, const uint64_t offset, const bool end)
+	{
+		H2Stream::Parked piece;
+		piece.len = len;
+		piece.end = end;
+		if (fp)
+		{
+			const auto fd = dup(fileno(fp));
+			piece.fp = fd < 0 ? nullptr : fdopen(fd, "rb");
+			if (!piece.fp)
+			{
+				if (fd >= 0) close(fd);
+				return -1;
+			}
+			piece.offset = offset;
+		}
+		else
+		{
+			piece.data.assign(data, len);
+			Memory::Charge(Memory::Responses, len);
+		}
+		s.parked.push_back(std::move(piece));
+		++Parks;
+		return 0;
+	}
+
+	static void Free(H2Stream::Parked& piece)
+	{
+		if (piece.fp) fclose(piece.fp);
+		piece.fp = nullptr;
+		Memory::Release(Memory::Responses, piece.data.length());
+		piece.data.clear();
+	}
+
+	// Callers hold mtx. Take the body out of a stream that is gone, to be freed once the lock is let go.
+	std::function<void(bool)> Drop(H2Stream& s, std::deque<H2Stream::Parked>& dropped)
+	{
+		for (auto& piece : s.parked) dropped.push_back(std::move(piece));
+		s.parked.clear();
+		std::function<void(bool)> resume;
+		resume.swap(s.resume);
+		return resume;
+	}
+
+	// A window opened: have Drain send what is parked, unless it is already at it.
+	void Wake()
+	{
+		{
+			std::lock_guard<std::mutex> lock(mtx);
+			if (draining || closed) return;
+			auto any = false;
+			for (const auto& s : streams) any = any || !s.second->parked.empty();
+			if (!any) return;
+			draining = true;
+		}
+		const auto self = shared_from_this();
+		NetStage->Submit([self]() { self->Drain(); });
+	}
+
+	// Send parked body as far as the windows allow, a frame from each stream in turn.
+	void Drain()
+	{
+		uint32_t after = 0;
+		while (true)
+		{
+			std::shared_ptr<H2Stream> s;
+			H2Stream::Parked sent;
+			std::string chunk;
+			FILE* fp = nullptr;
+			uint64_t offset = 0;
+			size_t n = 0;
+			auto end = false;
+			{
+				std::lock_guard<std::mutex> lock(mtx);
+				for (auto pass = 0; pass < 2 && !s && !closed && window > 0; ++pass)
+				{
+					for (auto it = pass ? streams.begin() : streams.upper_bound(after); it != streams.end() && !s; ++it)
+					{
+						if (!it->second->parked.empty() && it->second->window > 0) s = it->second;
+					}
+				}
+				if (!s)
+				{
+					draining = false;
+					return;
+				}
+				auto& piece = s->parked.front();
+				n = static_cast<size_t>(std::min<int64_t>({static_cast<int64_t>(piece.len), s->window, window, peerMaxFrame}));
+				s->window -= n;
+				window -= n;
+				end = piece.end && n == piece.len;
+				if (piece.fp) fp = piece.fp;
+				else chunk.assign(piece.data, piece.offset, n);
+				offset = piece.offset;
+				piece.offset += n;
+				piece.len -= n;
+				if (!piece.len)
+				{
+					sent = std::move(piece);
+					s->parked.pop_front();
+				}
+				if (end) Retire(*s);
+				s->flushing = true;
+				after = s->id;
+			}
+			const auto ok = SendData(s->id, end, chunk.data(), n, fp, offset) == 0;
+			Free(sent);
+			std::deque<H2Stream::Parked> dropped;
+			std::function<void(bool)> resume;
+			auto gone = false, close = false;
+			{
+				std::lock_guard<std::mutex> lock(mtx);
+				s->flushing = false;
+				gone = !ok || s->reset || closed;
+				if (gone) resume = Drop(*s, dropped);
+				else if (s->parked.empty())
+				{
+					resume.swap(s->resume);
+					close = s->closing;
+				}
+			}
+			for (auto& piece : dropped) Free(piece);
+			if (close) Close(*s);
+			if (resume) resume(!gone);
+		}
+	}
+
+	void RstStream(const uint32_t id, const uint32_t error)
+	{
+		auto frame = H2FrameHeader(4, H2RstStream, 0, id);
+		frame += H2Word(error);
+		WriteFrame(frame);
+	}
+
+	void GoAway(const uint32_t error)
+	{
+		auto frame = H2FrameHeader(8, H2GoAway, 0, 0);
+		frame += H2Word(lastStream);
+		frame += H2Word(error);
+		std::lock_guard<std::mutex> lock(writeMtx);
+		WriteFrame(frame);
+	}
+
+	void WindowUpdate(const uint32_t id, const uint32_t increment)
+	{
+		auto frame = H2FrameHeader(4, H2WindowUpdate, 0, id);
+		frame += H2Word(increment);
+		std::lock_guard<std::mutex> lock(writeMtx);
+		WriteFrame(frame);
+	}
+
+	// Callers hold mtx.
+	void Retire(H2Stream& s)
+	{
+		s.ended = true;
+		streams.erase(s.id);
+	}
+
+	void Finish(H2Stream& s)
+	{
+		std::lock_guard<std::mutex> lock(mtx);
+		Retire(s);
+	}
+
+	void Shutdown()
+	{
+		std::map<uint32_t, std::shared_ptr<H2Stream>> gone;
+		{
+			std::lock_guard<std::mutex> lock(mtx);
+			closed = true;
+			gone.swap(streams);
+		}
+		shutdown(conn->fd, 2);
+		for (const auto& s : gone)
+		{
+			std::deque<H2Stream::Parked> dropped;
+			std::function<void(bool)> resume;
+			{
+				std::lock_guard<std::mutex> lock(mtx);
+				// One Drain is sending from drops it itself.
+				if (!s.second->flushing) resume = Drop(*s.second, dropped);
+			}
+			for (auto& piece : dropped) Free(piece);
+			if (resume) resume(false);
+		}
+	}
+
+	uint32_t ApplySettings(const std::string& payload)
+	{
+		if (payload.length() % 6) return H2FrameSizeError;
+		for (size_t i = 0; i < payload.length(); i += 6)
+		{
+			const auto key = static_cast<uint8_t>(payload[i]) << 8 | static_cast<uint8_t>(payload[i + 1]);
+			const auto value = GetBigEndian32(payload.data() + i + 2);
+			if (key == 0x1)
+			{
+				std::lock_guard<std::mutex> lock(writeMtx);
+				encoder.Resize(std::min<uint32_t>(value, 4096));
+				encoderResize = true;
+			}
+			else if (key == 0x4)
+			{
+				if (value > 0x7fffffff) return H2FlowControlError;
+				{
+					std::lock_guard<std::mutex> lock(mtx);
+					for (auto& s : streams) s.second->window += static_cast<int64_t>(value) - peerInitialWindow;
+					peerInitialWindow = value;
+				}
+				Wake();
+			}
+			else if (key == 0x5)
+			{
+				if (value < H2FrameMax || value > 0xffffff) return H2ProtocolError;
+				std::lock_guard<std::mutex> lock(mtx);
+				peerMaxFrame = value;
+			}
+		}
+		return H2NoError;
+	}
+
+	uint32_t OnFrame(const uint8_t type, const uint8_t flags, const uint32_t id, std::string payload)
+	{
+		if (headerStream && (type != H2Continuation || id != headerStream)) return H2ProtocolError;
+		switch (type)
+		{
+		case H2Data:
+		case H2Headers:
+		{
+			if (!id) return H2ProtocolError;
+			const auto received = payload.length();
+			if (flags & H2Padded)
+			{
+				const size_t pad = payload.empty() ? 0 : static_cast<uint8_t>(payload[0]);
+				if (payload.empty() || pad >= payload.length()) return H2ProtocolError;
+				payload = payload.substr(1, payload.length() - 1 - pad);
+			}
+			if (type == H2Data)
+			{
+				// Request bodies are not consumed; hand the window straight back.
+				if (!received) return H2NoError;
+				WindowUpdate(0, received);
+				bool open;
+				{
+					std::lock_guard<std::mutex> lock(mtx);
+					open = streams.count(id) != 0;
+				}
+				if (open && !(flags & H2EndStream)) WindowUpdate(id, received);
+				return H2NoError;
+			}
+			if (flags & H2PriorityFlag)
+			{
+				if (payload.length() < 5) return H2ProtocolError;
+				payload.erase(0, 5);
+			}
+			headerBlock = payload;
+			headerStream = id;
+			break;
+		}
+		case H2Continuation:
+			if (!headerStream) return H2ProtocolError;
+			headerBlock += payload;
+			if (headerBlock.length() > 1 << 20) return H2ProtocolError;
+			break;
+		case H2RstStream:
+		{
+			std::shared_ptr<H2Stream> s;
+			std::deque<H2Stream::Parked> dropped;
+			std::function<void(bool)> resume;
+			{
+				std::lock_guard<std::mutex> lock(mtx);
+				const auto it = streams.find(id);
+				if (it == streams.end()) return H2NoError;
+				s = it->second;
+				s->reset = true;
+				streams.erase(it);
+				if (!s->flushing) resume = Drop(*s, dropped);
+			}
+			++Resets;
+			for (auto& piece : dropped) Free(piece);
+			if (resume) resume(false);
+			return H2NoError;
+		}
+		case H2Settings:
+		{
+			if (id) return H2ProtocolError;
+			if (flags & H2Ack) return H2NoError;
+			const auto error = ApplySettings(payload);
+			if (error != H2NoError) return error;
+			std::lock_guard<std::mutex> lock(writeMtx);
+			WriteFrame(H2FrameHeader(0, H2Settings, H2Ack, 0));
+			return H2NoError;
+		}
+		case H2Ping:
+		{
+			if (id || payload.length() != 8) return H2ProtocolError;
+			if (flags & H2Ack) return H2NoError;
+			std::lock_guard<std::mutex> lock(writeMtx);
+			WriteFrame(H2FrameHeader(8, H2Ping, H2Ack, 0) + payload);
+			return H2NoError;
+		}
+		case H2WindowUpdate:
+		{
+			if (payload.length() != 4) return H2FrameSizeError;
+			const auto increment = GetBigEndian32(payload.data()) & 0x7fffffff;
+			{
+				std::lock_guard<std::mutex> lock(mtx);
+				if (!id) window += increment;
+				else
+				{
+					const auto it = streams.find(id);
+					if (it != streams.end()) it->second->window += increment;
+				}
+			}
+			Wake();
+			return H2NoError;
+		}
+		case H2PushPromise:
+			return H2ProtocolError;
+		default:
+			// PRIORITY, GOAWAY and unknown frame types need nothing from a server that only answers.
+			return H2NoError;
+		}
+		if (!(flags & H2EndHeaders)) return H2NoError;
+		const auto streamId = headerStream;
+		headerStream = 0;
+		HeaderList headers;
+		if (!HpackDecode(decoder, headerBlock, headers)) return H2CompressionError;
+		if (!(streamId & 1) || streamId <= lastStream) return H2ProtocolError;
+		lastStream = streamId;
+		std::string method = "GET", target = "/", authority;
+		std::ostringstream fields;
+		for (const auto& h : headers)
+		{
+			if (h.first == ":method") method = h.second;
+			else if (h.first == ":path") target = h.second;
+			else if (h.first == ":authority") authority = h.second;
+			else if (h.first[0] != ':' && h.first != "host")
+			{
+				// Title-case the name, as the HTTP/1.1 handlers match it.
+				auto name = h.first;
+				for (size_t i = 0; i < name.length(); ++i)
+				{
+					if (!i || name[i - 1] == '-') name[i] = static_cast<char>(std::toupper(static_cast<unsigned char>(name[i])));
+				}
+				fields << name << ": " << h.second << "\r\n";
+			}
+		}
+		std::ostringstream http;
+		http << method << " " << target << " HTTP/1.1\r\n";
+		if (!authority.empty()) http << "Host: " << authority << "\r\n";
+		http << fields.str() << "\r\n";
+		Open(streamId, http.str(), method == "HEAD");
+		return H2NoError;
+	}
+
+	void Open(const uint32_t id, const std::string& http, const bool headOnly)
+	{
+		auto s = std::make_shared<H2Stream>();
+		s->session = shared_from_this();
+		s->id = id;
+		s->headOnly = headOnly;
+		{
+			std::lock_guard<std::mutex> lock(mtx);
+			if (streams.size() < H2MaxStreams)
+			{
+				s->window = peerInitialWindow;
+				streams[id] = s;
+			}
+			else s = nullptr;
+		}
+		if (!s)
+		{
+			++Refused;
+			std::lock_guard<std::mutex> lock(writeMtx);
+			RstStream(id, H2RefusedStream);
+			return;
+		}
+		++Streams;
+		auto c = std::make_shared<Connection>();
+		c->addr = conn->addr;
+		c->stream = s;
+		c->parent = conn;
+		NetStage->Submit([c, http]() { Dispatch(c, http); });
+	}
+
+	std::shared_ptr<Connection> conn;
+	// Orders frames on the socket and guards the HPACK encoder, whose state must follow frame order.
+	std::mutex writeMtx;
+	HpackTable encoder;
+	bool encoderResize = false;
+	// Guards streams, flow-control windows, parked bodies and peer settings.
+	std::mutex mtx;
+	std::map<uint32_t, std::shared_ptr<H2Stream>> streams;
+	bool draining = false;
+	int64_t window = 65535;
+	uint32_t peerInitialWindow = 65535;
+	uint32_t peerMaxFrame = H2FrameMax;
+	std::atomic<bool> closed{false};
+	// Reader thread only.
+	HpackTable decoder;
+	uint32_t lastStream = 0;
+	uint32_t headerStream = 0;
+	std::string headerBlock;
+
+	static std::atomic<uint64_t> Sessions, Active, Streams, Refused, Resets, Parks, Rejected;
+};
+
+std::atomic<uint64_t> H2Session::Sessions{0}, H2Session::Active{0}, H2Session::Streams{0}, H2Session::Refused{0}, H2Session::Resets{0},
+	H2Session::Parks{0}, H2Session::Rejected{0};
+
+int H2Stream::Write(const char* data, const size_t len, FILE* fp, const uint64_t offset)
+{
+	if (ended || reset) return -1;
+	if (headSent) return session->SendBody(*this, data, len, fp, offset);
+	if (fp) return -1;
+	head.append(data, len);
+	const auto end = head.find("\r\n\r\n");
+	if (end == std::string::npos) return 0;
+	const auto body = head.substr(end + 4);
+	head.resize(end + 2);
+	if (session->SendHead(*this) < 0) return -1;
+	if (body.empty() || ended) return 0;
+	return session->SendBody(*this, body.data(), body.length(), nullptr, 0);
+}
+
+bool H2Stream::Defer(std::function<void(bool)> then)
+{
+	return session->Defer(*this, then);
+}
+
+void H2Stream::Close()
+{
+	session->Close(*this);
+}
+
+#ifdef HAIS_TLS
+// HTTPS. OpenSSL does the handshake, and with kernel TLS the session keys are then handed to the
+// socket (TLS_TX/TLS_RX), so file bodies still leave by sendfile and the kernel encrypts them.
+// Where kTLS is unavailable for the kernel or the negotiated cipher, or with --ktls=0, records
+// are encrypted in user space and file bodies are read into a buffer to be written.
+class TlsContext
+{
+public:
+	TlsContext(const std::string& cert, const std::string& key, const bool ktls)
+	{
+		ctx = SSL_CTX_new(TLS_server_method());
+		if (!ctx) err(EXIT_FAILURE, "Can't create TLS context");
+		SSL_CTX_set_min_proto_version(ctx, TLS1_2_VERSION);
+		if (ktls) SSL_CTX_set_options(ctx, SSL_OP_ENABLE_KTLS);
+		if (SSL_CTX_use_certificate_chain_file(ctx, cert.c_str()) != 1 ||
+			SSL_CTX_use_PrivateKey_file(ctx, key.c_str(), SSL_FILETYPE_PEM) != 1 ||
+			SSL_CTX_check_private_key(ctx) != 1)
+		{
+			ERR_print_errors_fp(stderr);
+			err(EXIT_FAILURE, "Can't load certificate %s with key %s", cert.c_str(), key.c_str());
+		}
+	}
+
+	bool Accept(Connection& conn)
+	{
+		conn.ssl = SSL_new(ctx);
+		if (!conn.ssl || SSL_set_fd(conn.ssl, conn.fd) != 1 || SSL_accept(conn.ssl) != 1)
+		{
+			++failed;
+			ERR_clear_error();
+			return false;
+		}
+		++handshakes;
+		conn.ktlsSend = BIO_get_ktls_send(SSL_get_wbio(conn.ssl));
+		conn.ktlsRecv = BIO_get_ktls_recv(SSL_get_rbio(conn.ssl));
+		if (conn.ktlsSend) ++kernelSend;
+		if (conn.ktlsRecv) ++kernelRecv;
+		return true;
+	}
+
+	int Write(Connection& conn, const char* data, size_t len)
+	{
+		(conn.ktlsSend ? kernelBytes : userBytes) += len;
+		while (len)
+		{
+			const auto sent = SSL_write(conn.ssl, data, static_cast<int>(std::min<size_t>(len, INT_MAX)));
+			if (sent <= 0) return -1;
+			data += sent;
+			len -= sent;
+		}
+		return 0;
+	}
+
+	int SendFile(Connection& conn, FILE* fp, uint64_t offset, size_t len)
+	{
+#ifndef _MSC_VER
+		if (conn.ktlsSend)
+		{
+			sendfileBytes += len;
+			while (len)
+			{
+				const auto sent = SSL_sendfile(conn.ssl, fileno(fp), offset, len, 0);
+				if (sent <= 0) return -1;
+				offset += sent;
+				len -= sent;
+			}
+			return 0;
+		}
+#endif
+		thread_local std::vector<char> buf(TransferChunk);
+#ifdef _MSC_VER
+		_fseeki64(fp, offset, SEEK_SET);
+#endif
+		while (len)
+		{
+			const auto want = std::min(len, buf.size());
+#ifdef _MSC_VER
+			const auto read = fread(buf.data(), sizeof(char), want, fp);
+#else
+			const auto read = pread(fileno(fp), buf.data(), want, offset);
+#endif
+			if (read <= 0 || Write(conn, buf.data(), read) < 0) return -1;
+			offset += read;
+			len -= read;
+		}
+		return 0;
+	}
+
+	int Read(Connection& conn, char* buf, const int len)
+	{
+		const auto read = SSL_read(conn.ssl, buf, len);
+		return read > 0 ? read : -1;
+	}
+
+#ifndef _MSC_VER
+	// Decrypts up to len bytes of the request body into a pipe, for uploads without kTLS_RX.
+	ssize_t ReadToPipe(Connection& conn, const int pipe, const size_t len)
+	{
+		thread_local std::vector<char> buf(TransferChunk);
+		const auto read = Read(conn, buf.data(), static_cast<int>(std::min(len, buf.size())));
+		if (read <= 0) return read;
+		for (auto done = 0; done < read;)
+		{
+			const auto n = write(pipe, buf.data() + done, read - done);
+			if (n <= 0) return -1;
+			done += n;
+		}
+		return read;
+	}
+#endif
+
+	std::string Stats() const
+	{
+		std::ostringstream oss;
+		oss << "tls handshakes=" << handshakes.load() <<
+			" failed=" << failed.load() <<
+			" ktls-send=" << kernelSend.load() <<
+			" ktls-recv=" << kernelRecv.load() <<
+			" sendfile-bytes=" << sendfileBytes.load() <<
+			" ktls-bytes=" << kernelBytes.load() <<
+			" userspace-bytes=" << userBytes.load();
+		return oss.str();
+	}
+
+private:
+	SSL_CTX* ctx = nullptr;
+	std::atomic<uint64_t> handshakes{0};
+	std::atomic<uint64_t> failed{0};
+	std::atomic<uint64_t> kernelSend{0};
+	std::atomic<uint64_t> kernelRecv{0};
+	std::atomic<uint64_t> sendfileBytes{0};
+	std::atomic<uint64_t> kernelBytes{0};
+	std::atomic<uint64_t> userBytes{0};
+};
+
+static TlsContext* Tls = nullptr;
+#endif
+
+Connection::~Connection()
+{
+	if (trace) Tracer::Record(trace, "request", start, request.empty() ? "request" : request, true);
+#ifdef HAIS_TLS
+	if (ssl)
+	{
+		SSL_shutdown(ssl);
+		SSL_free(ssl);
+	}
+#endif
+	if (stream) stream->Close();
+	else if (fd >= 0) close(fd);
+	--Live;
+}
+
+int Send(Connection& conn, const char* data, const size_t len)
+{
+	if (conn.stream) return conn.stream->Write(data, len);
+#ifdef HAIS_TLS
+	if (conn.ssl) return Tls->Write(conn, data, len);
+#endif
+	return SendAll(conn.fd, data, len);
+}
+
+int SendFile(Connection& conn, FILE* fp, const uint64_t offset, const size_t len)
+{
+	if (conn.stream) return conn.stream->Write(nullptr, len, fp, offset);
+#ifdef HAIS_TLS
+	if (conn.ssl) return Tls->SendFile(conn, fp, offset, len);
+#endif
+	return SendFileAll(conn.fd, fp, offset, len);
+}
+
+// Whether then waits for body an HTTP/2 stream had to park, rather than being for the caller to call now.
+bool Defer(Connection& conn, std::function<void(bool)> then)
+{
+	return conn.stream && conn.stream->Defer(std::move(then));
+}
+
+int Recv(Connection& conn, char* buf, const int len)
+{
+#ifdef HAIS_TLS
+	if (conn.ssl) return Tls->Read(conn, buf, len);
+#endif
+	return recv(conn.fd, buf, len, 0);
+}
+
+// An upload in flight. Its body moves a pipe's worth at a time: socket to pipe
+// on the network stage once the poller sees the socket readable, pipe to a temp
+// file beside the target on the disk stage, all with splice and no copy through
+// user space. The temp file is renamed over the target once complete, so
+// readers never see a partial file.
+struct Upload
+{
+	std::shared_ptr<Connection> conn;
+	const char* root = "";
+	std::string target;
+	std::string temp;
+	FILE* fp = nullptr;
+	uint64_t remaining = 0;
+	// Bytes received but not yet on disk.
+	size_t pending = 0;
+	bool existed = false;
+#ifdef _MSC_VER
+	std::vector<char> buf = std::vector<char>(TransferChunk);
+#else
+	int pipe[2] = {-1, -1};
+	size_t pipeSize = 0;
+#endif
+
+	~Upload()
+	{
+		if (fp) fclose(fp);
+#ifndef _MSC_VER
+		if (pipe[0] >= 0) ::close(pipe[0]);
+		if (pipe[1] >= 0) ::close(pipe[1]);
+#endif
+		if (!temp.empty()) remove(temp.c_str());
+	}
+
+	static std::string Stats()
+	{
+		std::ostringstream oss;
+		oss << "upload count=" << Count.load() <<
+			" bytes=" << Bytes.load() <<
+			" failed=" << Failed.load() <<
+			" active=" << Active.load();
+		return oss.str();
+	}
+
+	static std::atomic<uint64_t> Count, Bytes, Failed, Active;
+};
+
+std::atomic<uint64_t> Upload::Count{0}, Upload::Bytes{0}, Upload::Failed{0}, Upload::Active{0};
+
+void HttpText(Connection& conn, const char* status, const std::string& body, const char* type = "text/plain")
+{
+	std::ostringstream oss;
+	oss << "HTTP/1.1 " << status << "\r\n"
+		"Content-Length: " << std::to_string(body.length()) << "\r\n"
+		"Content-Type: " << type << "\r\n"
+		"Server: iriszero/" VERSION "\r\n"
+		"Connection: close\r\n\r\n" <<
+		body;
+	const auto http = oss.str();
+	Send(conn, http.c_str(), http.length());
+}
+
+void HttpSearch(
+	const std::shared_ptr<Connection>& conn,
+	const PathIndex::Query& q,
+	const bool text,
+	const char* coding)
+{
+	const auto start = std::chrono::steady_clock::now();
+	Paths->Search(q, [=](std::vector<std::string> res)
+	{
+		const auto us = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count();
+		NetStage->Submit([conn, q, text, coding, res = std::move(res), us]()
+		{
+			std::ostringstream body;
+			if (text)
+			{
+				for (auto& r : res) body << PathHref(PathCombine(Paths->Root().c_str(), r.c_str())) << "\n";
+				HttpText(*conn, "200 OK", body.str());
+				return;
+			}
+			body << " <!DOCTYPE html>"
+				"<html>"
+				"<head><title>Search " << HtmlEscape(q.pattern) << "</title>"
+				"<meta charset=\"" << coding << "\"/>"
+				"</head>"
+				"<body>"
+				"<h1>" << HtmlEscape(q.mode) << " " << HtmlEscape(q.pattern) << "</h1>" <<
+				res.size() << " matches in " << us / 1000.0 << " ms<hr>";
+			for (auto& r : res)
+			{
+				const auto full = PathCombine(Paths->Root().c_str(), r.c_str());
+				body << "<a href=\"" << PathHref(full) << "\">" << HtmlEscape(full) << "</a><br/>";
+			}
+			body << "</body></html>";
+			const auto html = body.str();
+			std::ostringstream head;
+			head << "HTTP/1.1 200 OK\r\nContent-length: " << std::to_string(html.length()) <<
+				"\r\nServer: iriszero/" VERSION <<
+				"\r\nContent-Type: text/html\r\n\r\n";
+			printf("<========================\n%s\n", head.str().c_str());
+			Send(*conn, head.str().c_str(), head.str().length());
+			Send(*conn, html.c_str(), html.length());
+		});
+	});
+}
+
+// One sha256sum-style line per file below dir, the files hashed in slices across the disk stage.
+void HttpManifest(const std::shared_ptr<Connection>& conn, const std::string& dir, const bool xxh)
+{
+	std::vector<ArchiveEntry> entries;
+	WalkTree(dir, "", entries);
+	entries.erase(std::remove_if(entries.begin(), entries.end(), [](const ArchiveEntry& e) { return e.dir; }), entries.end());
+	if (entries.empty())
+	{
+		NetStage->Submit([conn]() { HttpText(*conn, "200 OK", ""); });
+		return;
+	}
+	struct State
+	{
+		std::vector<ArchiveEntry> files;
+		std::vector<std::string> lines;
+		std::atomic<size_t> left;
+	};
+	auto state = std::make_shared<State>();
+	state->files = std::move(entries);
+	state->lines.resize(state->files.size());
+	const auto slices = std::min<size_t>(state->files.size(), 256);
+	state->left = slices;
+	for (size_t i = 0; i < slices; ++i)
+	{
+		DiskStage->Submit([conn, dir, xxh, state, slices, i]()
+		{
+			for (auto k = i; k < state->files.size(); k += slices)
+			{
+				FileDigest digest;
+				const auto& rel = state->files[k].rel;
+				if (!Digests->Get(PathCombine(dir.c_str(), rel.c_str()), digest, true)) continue;
+				char hex[17];
+				snprintf(hex, sizeof(hex), "%016llx", static_cast<unsigned long long>(digest.xxh64));
+				state->lines[k] = (xxh ? std::string(hex) : HexString(digest.sha256)) + "  " + rel + "\n";
+			}
+			if (--state->left) return;
+			std::string body;
+			for (const auto& line : state->lines) body += line;
+			NetStage->Submit([conn, body]() { HttpText(*conn, "200 OK", body); });
+		});
+	}
+}
+
+// Something appeared at target under root: a snapshot listing of its directory is stale now, so mark
+// that directory reconciled to have it listed live from here on, and tell the path index.
+void ListingChanged(const char* root, const std::string& target, const bool dir)
+{
+	const auto parent = target.substr(0, target.rfind(SplitChar[0]) + 1);
+	const auto snap = CurrentSnapshot();
+	const auto idx = snap ? snap->Find(parent) : TreeSnapshot::npos;
+	if (idx != TreeSnapshot::npos) snap->MarkReconciled(idx);
+	if (!Paths || Roots.front()->path != root) return;
+	const auto rel = target.substr(PathCombine(root, "").length());
+	if (dir) Paths->AddDirectory(rel + SplitChar);
+	else Paths->Add(rel);
+}
+
+// Close a fully written temp file and rename it over target, so readers only ever see whole files.
+bool LandFile(const char* root, FILE* fp, const std::string& temp, const std::string& target)
+{
+	fflush(fp);
+#ifdef _MSC_VER
+	fclose(fp);
+	if (!MoveFileExA(temp.c_str(), target.c_str(), MOVEFILE_REPLACE_EXISTING)) return false;
+#else
+	fchmod(fileno(fp), 0644);
+	fclose(fp);
+	if (rename(temp.c_str(), target.c_str()) < 0) return false;
+#endif
+	ListingChanged(root, target, false);
+	return true;
+}
+
+// Whether dir, with its symlinks resolved, is still root or below it. CheckUrl only sees the
+// spelling of a path, and a link in the tree must not carry a write outside it.
+bool ResolvesInside(const char* root, const std::string& dir)
+{
+#ifdef _MSC_VER
+	return true;
+#else
+	char rootReal[PATH_MAX], dirReal[PATH_MAX];
+	if (!realpath(root, rootReal) || !realpath(dir.c_str(), dirReal)) return false;
+	const auto len = strlen(rootReal);
+	return !strncmp(rootReal, dirReal, len) && (rootReal[len - 1] == '/' || dirReal[len] == '/' || !dirReal[len]);
+#endif
+}
+
+void UploadFail(const std::shared_ptr<Upload>& u, const char* status)
+{
+	++Upload::Failed;
+	--Upload::Active;
+	if (!status) return;
+	NetStage->Submit([u, status]() { HttpText(*u->conn, status, std::string(status) + "\n"); });
+}
+
+void UploadDone(const std::shared_ptr<Upload>& u)
+{
+	const auto fp = u->fp;
+	u->fp = nullptr;
+	if (!LandFile(u->root, fp, u->temp, u->target)) return UploadFail(u, "500 Internal Server Error");
+	u->temp.clear();
+	++Upload::Count;
+	--Upload::Active;
+	const auto status = u->existed ? "204 No Content" : "201 Created";
+	NetStage->Submit([u, status]() { HttpText(*u->conn, status, ""); });
+}
+
+void UploadWrite(const std::shared_ptr<Upload>& u);
+void UploadReceive(const std::shared_ptr<Upload>& u);
+
+// Move what the socket holds of the body into the pipe; on Linux the poller has seen it readable, so this doesn't wait.
+void UploadRead(const std::shared_ptr<Upload>& u)
+{
+#ifdef _MSC_VER
+	const auto len = Recv(*u->conn, u->buf.data(), static_cast<int>(std::min<uint64_t>(u->remaining, u->buf.size())));
+#else
+	const auto want = std::min<uint64_t>(u->remaining, u->pipeSize);
+#ifdef HAIS_TLS
+	// A body decrypted in user space is copied into the pipe; only the kernel's plaintext can be spliced.
+	const auto len = u->conn->ssl && !u->conn->ktlsRecv ?
+		Tls->ReadToPipe(*u->conn, u->pipe[1], want) :
+		splice(u->conn->fd, nullptr, u->pipe[1], nullptr, want, SPLICE_F_MOVE | SPLICE_F_MORE | SPLICE_F_NONBLOCK);
+#else
+	const auto len = splice(u->conn->fd, nullptr, u->pipe[1], nullptr, want, SPLICE_F_MOVE | SPLICE_F_MORE | SPLICE_F_NONBLOCK);
+#endif
+	if (len < 0 && errno == EAGAIN) return UploadReceive(u);
+#endif
+	// The client went away mid-body; there is nobody left to answer.
+	if (len <= 0) return UploadFail(u, nullptr);
+	u->remaining -= len;
+	u->pending = len;
+	Upload::Bytes += len;
+	UploadWrite(u);
+}
+
+void UploadReceive(const std::shared_ptr<Upload>& u)
+{
+#ifdef _MSC_VER
+	NetStage->Submit([u]() { UploadRead(u); });
+#else
+#ifdef HAIS_TLS
+	// Records OpenSSL already read off the socket won't show in poll.
+	if (u->conn->ssl && SSL_pending(u->conn->ssl) > 0) return NetStage->Submit([u]() { UploadRead(u); });
+#endif
+	// The next bytes of the body are waited for on the poller, so a slow client holds no network thread.
+	Sockets->Watch(u->conn->fd, POLLIN, static_cast<int>(GetOptionInt("upload-timeout", 60)), [u](const bool ready)
+	{
+		if (!ready) return UploadFail(u, "408 Request Timeout");
+		UploadRead(u);
+	});
+#endif
+}
+
+void UploadWrite(const std::shared_ptr<Upload>& u)
+{
+	DiskStage->Submit([u]()
+	{
+		while (u->pending)
+		{
+#ifdef _MSC_VER
+			const auto len = fwrite(u->buf.data(), sizeof(char), u->pending, u->fp);
+			if (len != u->pending) return UploadFail(u, "500 Internal Server Error");
+#else
+			const auto len = splice(u->pipe[0], nullptr, fileno(u->fp), nullptr, u->pending, SPLICE_F_MOVE);
+			if (len <= 0) return UploadFail(u, errno == ENOSPC ? "507 Insufficient Storage" : "500 Internal Server Error");
+#endif
+			u->pending -= len;
+		}
+		if (u->remaining) UploadReceive(u);
+		else UploadDone(u);
+	});
+}
+
+// PUT url with a body of length bytes, of which head already holds the first.
+void HttpPut(
+	const std::shared_ptr<Connection>& conn,
+	const char* path,
+	const std::string& url,
+	const uint64_t length,
+	const std::string& head,
+	const bool expectContinue)
+{
+	auto u = std::make_shared<Upload>();
+	u->conn = conn;
+	u->root = path;
+	u->target = url;
+	u->remaining = length;
+	++Upload::Active;
+	const auto slash = url.rfind(SplitChar[0]);
+	const auto name = url.substr(slash + 1);
+	if (name.empty() || DirectoryExists(url.c_str())) return UploadFail(u, "409 Conflict");
+	if (!DirectoryExists(url.substr(0, slash + 1).c_str())) return UploadFail(u, "409 Conflict");
+	if (!ResolvesInside(path, url.substr(0, slash + 1))) return UploadFail(u, "403 Forbidden");
+	u->existed = FileExists(url.c_str());
+	u->temp = url.substr(0, slash + 1) + "." + name + ".upload.XXXXXX";
+#ifdef _MSC_VER
+	if (_mktemp_s(&u->temp[0], u->temp.length() + 1)) return UploadFail(u, "500 Internal Server Error");
+	u->fp = fopen(u->temp.c_str(), "wbx");
+#else
+	const auto fd = mkstemp(&u->temp[0]);
+	u->fp = fd < 0 ? nullptr : fdopen(fd, "wb");
+	if (fd >= 0 && !u->fp) ::close(fd);
+#endif
+	if (!u->fp)
+	{
+		const auto denied = errno == EACCES || errno == EPERM;
+		u->temp.clear();
+		return UploadFail(u, denied ? "403 Forbidden" : "500 Internal Server Error");
+	}
+#ifndef _MSC_VER
+	if (::pipe(u->pipe) < 0) return UploadFail(u, "500 Internal Server Error");
+	// A bigger pipe moves more per round trip through the stages; the kernel may grant less.
+	const auto size = fcntl(u->pipe[1], F_SETPIPE_SZ, 1 << 20);
+	u->pipeSize = size > 0 ? size : 1 << 16;
+#endif
+	const auto early = std::min<uint64_t>(head.length(), length);
+	if (early && fwrite(head.data(), sizeof(char), early, u->fp) != early) return UploadFail(u, "500 Internal Server Error");
+	u->remaining -= early;
+	Upload::Bytes += early;
+	if (!u->remaining) return UploadDone(u);
+	if (expectContinue)
+	{
+		static const std::string proceed = "HTTP/1.1 100 Continue\r\n\r\n";
+		if (Send(*conn, proceed.c_str(), proceed.length()) < 0) return UploadFail(u, nullptr);
+	}
+	// Anything buffered by fwrite must land before splice writes behind it.
+	fflush(u->fp);
+	UploadReceive(u);
+}
+
+// Read-through proxy to another HAIS instance (--upstream). A file missing
+// below IndexPath is fetched from the upstream once, written to a temp file as
+// it arrives, and streamed from there to every client that asks for it in the
+// meantime. A complete fetch lands in the local tree, which serves it from
+// then on.
+struct UpstreamFetch;
+
+struct UpstreamReader
+{
+	std::shared_ptr<Connection> conn;
+	std::shared_ptr<UpstreamFetch> fetch;
+	FILE* fp = nullptr;
+	uint64_t sent = 0;
+	bool headSent = false;
+
+	~UpstreamReader()
+	{
+		if (fp) fclose(fp);
+	}
+};
+
+struct UpstreamFetch
+{
+	std::string target;
+	std::string temp;
+	std::shared_ptr<Connection> up;
+	// Only touched by whichever stage task currently owns the fetch.
+	FILE* fp = nullptr;
+	std::string pendingHead;
+	bool cacheable = false;
+	std::string lastModified;
+	// Guarded by mtx, shared with the readers.
+	std::mutex mtx;
+	bool headKnown = false;
+	std::string head;
+	int64_t length = -1;
+	uint64_t have = 0;
+	bool done = false;
+	bool landed = false;
+	std::vector<std::shared_ptr<UpstreamReader>> waiting;
+
+	~UpstreamFetch()
+	{
+		if (fp) fclose(fp);
+		if (!temp.empty()) remove(temp.c_str());
+	}
+};
+
+class UpstreamCache
+{
+public:
+	UpstreamCache(const std::string& upstream, std::string remoteRoot, const char* root) :
+		remoteRoot(std::move(remoteRoot)), root(root), timeout(static_cast<int>(GetOptionInt("upstream-timeout", 30)))
+	{
+		const auto colon = upstream.rfind(':');
+		host = upstream.substr(0, colon);
+		port = colon == std::string::npos ? "80" : upstream.substr(colon + 1);
+	}
+
+	// Answer a request for target, which is missing locally. Runs on the disk stage.
+	void Serve(const std::shared_ptr<Connection>& conn, const std::string& target)
+	{
+		std::shared_ptr<UpstreamFetch> f;
+		auto fresh = false;
+		{
+			std::lock_guard<std::mutex> lock(mtx);
+			// A fetch may have landed the file since the caller looked.
+			if (!FileExists(target.c_str()))
+			{
+				auto& slot = fetches[target];
+				fresh = !slot;
+				if (fresh)
+				{
+					slot = std::make_shared<UpstreamFetch>();
+					slot->target = target;
+				}
+				f = slot;
+			}
+		}
+		if (!f)
+		{
+			HttpFile(conn, target, FileLastModified(target.c_str()), FileSize(target.c_str()));
+			return;
+		}
+		if (fresh) Start(f);
+		else ++collapsed;
+		auto r = std::make_shared<UpstreamReader>();
+		r->conn = conn;
+		r->fetch = f;
+		Pump(r);
+	}
+
+	std::string Stats()
+	{
+		size_t active;
+		{
+			std::lock_guard<std::mutex> lock(mtx);
+			active = fetches.size();
+		}
+		std::ostringstream oss;
+		oss << "upstream " << host << ":" << port <<
+			" fetches=" << started.load() <<
+			" collapsed=" << collapsed.load() <<
+			" landed=" << landed.load() <<
+			" failed=" << failed.load() <<
+			" bytes=" << bytes.load() <<
+			" active=" << active;
+		return oss.str();
+	}
+
+private:
+	// Create the temp file, resolve the upstream and connect to it; runs on the disk stage, as
+	// getaddrinfo blocks. The connect itself is waited for on the poller. The temp file sits at the
+	// root, since the target's directories may not exist yet, and is renamed into place once complete.
+	void Start(const std::shared_ptr<UpstreamFetch>& f)
+	{
+		++started;
+		f->temp = PathCombine(root, ".hais-upstream.XXXXXX");
+#ifdef _MSC_VER
+		f->fp = _mktemp_s(&f->temp[0], f->temp.length() + 1) ? nullptr : fopen(f->temp.c_str(), "wbx");
+#else
+		const auto fd = mkstemp(&f->temp[0]);
+		f->fp = fd < 0 ? nullptr : fdopen(fd, "wb");
+		if (fd >= 0 && !f->fp) ::close(fd);
+#endif
+		if (!f->fp)
+		{
+			f->temp.clear();
+			return Finish(f, false);
+		}
+		auto rel = f->target.substr(PathCombine(root, "").length());
+#ifdef _MSC_VER
+		for (auto& c : rel) if (c == '\\') c = '/';
+#endif
+		const auto url = PathCombine(remoteRoot.c_str(), "") + rel;
+		addrinfo hints{};
+		hints.ai_family = AF_INET;
+		hints.ai_socktype = SOCK_STREAM;
+		addrinfo* res = nullptr;
+		if (getaddrinfo(host.c_str(), port.c_str(), &hints, &res) || !res)
+		{
+			warn("Can't resolve upstream %s", host.c_str());
+			return Finish(f, false);
+		}
+		f->up = std::make_shared<Connection>();
+		const auto sock = f->up->fd = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
+#ifdef _MSC_VER
+		const auto connected = sock >= 0 && connect(sock, res->ai_addr, res->ai_addrlen) == 0;
+		freeaddrinfo(res);
+		if (!connected) return Finish(f, false);
+		const DWORD tv = static_cast<DWORD>(timeout * 1000);
+		setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, reinterpret_cast<const char*>(&tv), sizeof(tv));
+		NetStage->Submit([this, f, url]() { Request(f, url); });
+#else
+		const auto flags = sock < 0 ? -1 : fcntl(sock, F_GETFL);
+		const auto connecting = flags >= 0 && fcntl(sock, F_SETFL, flags | O_NONBLOCK) == 0 &&
+			(connect(sock, res->ai_addr, res->ai_addrlen) == 0 || errno == EINPROGRESS);
+		freeaddrinfo(res);
+		if (!connecting) return Finish(f, false);
+		Sockets->Watch(sock, POLLOUT, timeout, [this, f, url, sock, flags](const bool ready)
+		{
+			auto error = 0;
+			socklen_t len = sizeof(error);
+			if (!ready || getsockopt(sock, SOL_SOCKET, SO_ERROR, &error, &len) < 0 || error) return Finish(f, false);
+			// Back to blocking: the request fits the empty send buffer, and every recv follows a poll.
+			fcntl(sock, F_SETFL, flags);
+			Request(f, url);
+		});
+#endif
+	}
+
+	void Request(const std::shared_ptr<UpstreamFetch>& f, const std::string& url)
+	{
+		std::ostringstream request;
+		request << "GET " << UrlEncode(url.c_str(), url.length()) << " HTTP/1.1\r\n"
+			"Host: " << host << ":" << port << "\r\n"
+			"Connection: close\r\n\r\n";
+		const auto http = request.str();
+		if (Send(*f->up, http.c_str(), http.length()) < 0) return Finish(f, false);
+		Receive(f);
+	}
+
+	// Wait for the next piece of the response on the poller, giving up after --upstream-timeout.
+	void Receive(const std::shared_ptr<UpstreamFetch>& f)
+	{
+#ifdef _MSC_VER
+		NetStage->Submit([this, f]() { Read(f); });
+#else
+		Sockets->Watch(f->up->fd, POLLIN, timeout, [this, f](const bool ready)
+		{
+			if (!ready) return Finish(f, false);
+			Read(f);
+		});
+#endif
+	}
+
+	// Read what has arrived on the network stage; the head is parsed as it completes.
+	void Read(const std::shared_ptr<UpstreamFetch>& f)
+	{
+		std::vector<char> buf(TransferChunk);
+		const auto len = recv(f->up->fd, buf.data(), static_cast<int>(buf.size()), 0);
+		if (len < 0) return Finish(f, false);
+		if (!len) return Finish(f, f->headKnown && f->length < 0);
+		std::string data(buf.data(), len);
+		if (!f->headKnown)
+		{
+			f->pendingHead += data;
+			const auto end = f->pendingHead.find("\r\n\r\n");
+			if (end == std::string::npos)
+			{
+				if (f->pendingHead.length() > TransferChunk) return Finish(f, false);
+				return Receive(f);
+			}
+			data = f->pendingHead.substr(end + 4);
+			ParseHead(f, f->pendingHead.substr(0, end + 2));
+			f->pendingHead.clear();
+			Wake(f);
+		}
+		Write(f, std::move(data));
+	}
+
+	void ParseHead(const std::shared_ptr<UpstreamFetch>& f, const std::string& head)
+	{
+		std::ostringstream relay;
+		const auto lineEnd = head.find("\r\n");
+		const auto status = head.substr(0, lineEnd);
+		relay << status << "\r\n";
+		int64_t length = -1;
+		for (auto pos = lineEnd + 2, end = head.find("\r\n", pos); end != std::string::npos; pos = end + 2, end = head.find("\r\n", pos))
+		{
+			const auto line = head.substr(pos, end - pos);
+			const auto colon = line.find(':');
+			if (colon == std::string::npos) continue;
+			const auto name = line.substr(0, colon);
+			const auto start = line.find_first_not_of(' ', colon + 1);
+			const auto value = start == std::string::npos ? std::string() : line.substr(start);
+			if (!strcasecmp(name.c_str(), "Content-Length")) length = std::strtoll(value.c_str(), nullptr, 10);
+			else if (!strcasecmp(name.c_str(), "Last-Modified")) f->lastModified = value;
+			else if (strcasecmp(name.c_str(), "Content-Type") && strcasecmp(name.c_str(), "Repr-Digest")) continue;
+			relay << name << ": " << value << "\r\n";
+		}
+		relay << "Server: iriszero/" VERSION "\r\n"
+			"Connection: close\r\n\r\n";
+		// Only whole files are kept; directory listings and errors are passed through.
+		const auto sp = status.find(' ');
+		f->cacheable = sp != std::string::npos && !status.compare(sp + 1, 3, "200") && !f->lastModified.empty() && length >= 0;
+		std::lock_guard<std::mutex> lock(f->mtx);
+		f->head = relay.str();
+		f->length = length;
+		f->headKnown = true;
+	}
+
+	// Append a piece of the body to the temp file on the disk stage, then let the readers at it.
+	void Write(const std::shared_ptr<UpstreamFetch>& f, std::string data)
+	{
+		DiskStage->Submit([this, f, data = std::move(data)]()
+		{
+			if (!data.empty())
+			{
+				if (fwrite(data.data(), sizeof(char), data.length(), f->fp) != data.length() || fflush(f->fp)) return Finish(f, false);
+				bytes += data.length();
+				{
+					std::lock_guard<std::mutex> lock(f->mtx);
+					f->have += data.length();
+				}
+				Wake(f);
+			}
+			if (f->length >= 0 && f->have >= static_cast<uint64_t>(f->length)) Finish(f, true);
+			else Receive(f);
+		});
+	}
+
+	void Finish(const std::shared_ptr<UpstreamFetch>& f, const bool complete)
+	{
+		DiskStage->Submit([this, f, complete]()
+		{
+			f->up.reset();
+			const auto keep = complete && f->cacheable && f->have == static_cast<uint64_t>(f->length);
+			if (!complete) ++failed;
+			{
+				std::lock_guard<std::mutex> lock(f->mtx);
+				if (keep && Contained(f->target) && MakeParents(f->target) && Contained(f->target))
+				{
+#ifndef _MSC_VER
+					tm t{};
+					if (strptime(f->lastModified.c_str(), "%a, %d %b %Y %H:%M:%S GMT", &t))
+					{
+						const timespec times[2] = {{0, UTIME_OMIT}, {timegm(&t), 0}};
+						futimens(fileno(f->fp), times);
+					}
+#endif
+					const auto fp = f->fp;
+					f->fp = nullptr;
+					f->landed = LandFile(root, fp, f->temp, f->target);
+					if (f->landed)
+					{
+						f->temp.clear();
+						++landed;
+					}
+				}
+				f->done = true;
+			}
+			{
+				std::lock_guard<std::mutex> lock(mtx);
+				fetches.erase(f->target);
+			}
+			Wake(f);
+		});
+	}
+
+	// Whether the nearest directory above target that exists resolves inside the root. CheckUrl
+	// only saw the path as written, and a fetch below a symlinked directory must not land where the
+	// link points; such a fetch is passed through from the temp file instead. Checked again after
+	// MakeParents, for a link put in place meanwhile.
+	bool Contained(const std::string& target)
+	{
+		auto dir = target.substr(0, target.rfind(SplitChar[0]) + 1);
+		while (dir.length() > 1 && !DirectoryExists(dir.c_str())) dir = dir.substr(0, dir.rfind(SplitChar[0], dir.length() - 2) + 1);
+		return ResolvesInside(root, dir);
+	}
+
+	// Create the missing directories above target, as the upstream has them.
+	bool MakeParents(const std::string& target)
+	{
+		for (auto pos = PathCombine(root, "").length(); (pos = target.find(SplitChar[0], pos)) != std::string::npos; ++pos)
+		{
+			const auto dir = target.substr(0, pos);
+			if (DirectoryExists(dir.c_str())) continue;
+#ifdef _MSC_VER
+			if (!CreateDirectoryA(dir.c_str(), nullptr)) return false;
+#else
+			if (mkdir(dir.c_str(), 0755) < 0 && errno != EEXIST) return false;
+#endif
+			ListingChanged(root, dir, true);
+		}
+		return true;
+	}
+
+	void Wake(const std::shared_ptr<UpstreamFetch>& f)
+	{
+		std::vector<std::shared_ptr<UpstreamReader>> ready;
+		{
+			std::lock_guard<std::mutex> lock(f->mtx);
+			ready.swap(f->waiting);
+		}
+		for (const auto& r : ready) Pump(r);
+	}
+
+	// Send a reader whatever has arrived since its last turn, or park it until more does.
+	void Pump(const std::shared_ptr<UpstreamReader>& r)
+	{
+		NetStage->Submit([this, r]()
+		{
+			const auto& f = r->fetch;
+			std::string head;
+			uint64_t avail;
+			bool done;
+			{
+				std::lock_guard<std::mutex> lock(f->mtx);
+				done = f->done;
+				if (!f->headKnown && !done)
+				{
+					f->waiting.push_back(r);
+					return;
+				}
+				if (!r->headSent) head = f->head;
+				avail = f->have - r->sent;
+				if (!avail && !done && head.empty())
+				{
+					f->waiting.push_back(r);
+					return;
+				}
+				if (avail && !r->fp) r->fp = fopen(f->landed ? f->target.c_str() : f->temp.c_str(), "rb");
+			}
+			if (!r->headSent)
+			{
+				if (head.empty())
+				{
+					HttpText(*r->conn, "502 Bad Gateway", "upstream fetch failed\n");
+					return;
+				}
+				if (Send(*r->conn, head.c_str(), head.length()) < 0) return;
+				r->headSent = true;
+			}
+			// A fetch that ended short leaves the client with a short body, which it can tell by Content-Length.
+			if (!avail)
+			{
+				if (!done) Pump(r);
+				return;
+			}
+			if (!r->fp) return;
+			// What has arrived goes out as a transfer, scheduled and rate limited like any file. The
+			// reader lends it its file and takes it back once that much is sent.
+			auto t = std::make_shared<Transfer>();
+			t->conn = r->conn;
+			t->fp = r->fp;
+			t->offset = r->sent;
+			t->remaining = avail;
+			r->fp = nullptr;
+			const auto lent = t.get();
+			t->done = [this, r, lent, avail]()
+			{
+				r->fp = lent->fp;
+				lent->fp = nullptr;
+				r->sent += avail;
+				Pump(r);
+			};
+			::Pump(t);
+		});
+	}
+
+	std::string host;
+	std::string port;
+	const std::string remoteRoot;
+	const char* root;
+	const int timeout;
+	std::mutex mtx;
+	std::map<std::string, std::shared_ptr<UpstreamFetch>> fetches;
+	std::atomic<uint64_t> started{0};
+	std::atomic<uint64_t> collapsed{0};
+	std::atomic<uint64_t> landed{0};
+	std::atomic<uint64_t> failed{0};
+	std::atomic<uint64_t> bytes{0};
+};
+
+static UpstreamCache* Upstream = nullptr;
+
+// Batch fetch. POST /dir/?batch carries one path per line, relative to dir or starting with the
+// separator like any request path, and gets them back in one response: every item is a line
+// "<status> <size> <path>\n" followed by size bytes, and the response ends with "end <items>\n".
+// Disk threads open and stat up to BatchAhead items ahead of the one being sent, reading small
+// files whole on the way, so runs of small files go out as one gather write each; larger files,
+// and every file when a rate limit applies, are sent by the transfer scheduler.
+#define BatchAhead 64
+#define BatchMaxBody (4 << 20)
+#define BatchMaxItems 10000
+
+struct Batch
+{
+	struct Item
+	{
+		std::string name;
+		std::string path;
+		int status = 0;
+		uint64_t size = 0;
+		// Left open for the transfer scheduler.
+		FILE* fp = nullptr;
+		// The whole file, when it was read ahead.
+		std::string data;
+		std::unique_ptr<Memory::Lease> lease;
+		bool ready = false;
+	};
+
+	std::shared_ptr<Connection> conn;
+	std::vector<Item> items;
+	bool scheduled = false;
+	std::mutex mtx;
+	// Items handed to the disk stage, and the first not sent yet.
+	size_t opened = 0;
+	size_t next = 0;
+	// Set while the sender waits for items[next] to be opened.
+	bool waiting = false;
+
+	~Batch()
+	{
+		for (const auto& item : items)
+		{
+			if (item.fp) fclose(item.fp);
+		}
+		++Done;
+	}
+
+	static std::string Stats()
+	{
+		std::ostringstream oss;
+		oss << "batch requests=" << Requests.load() <<
+			" done=" << Done.load() <<
+			" items=" << Items.load() <<
+			" missing=" << Missing.load() <<
+			" read-ahead=" << ReadAhead.load() <<
+			" scheduled=" << Scheduled.load() <<
+			" bytes=" << Bytes.load();
+		return oss.str();
+	}
+
+	inline static std::atomic<uint64_t> Requests{0};
+	inline static std::atomic<uint64_t> Done{0};
+	inline static std::atomic<uint64_t> Items{0};
+	inline static std::atomic<uint64_t> Missing{0};
+	inline static std::atomic<uint64_t> ReadAhead{0};
+	inline static std::atomic<uint64_t> Scheduled{0};
+	inline static std::atomic<uint64_t> Bytes{0};
+};
+
+void BatchSend(const std::shared_ptr<Batch>& b);
+bool CheckUrl(const std::string& url, const char* path);
+
+// Stat and open item i on a disk thread, reading it whole if it fits in a chunk.
+void BatchOpen(const std::shared_ptr<Batch>& b, const size_t i)
+{
+	const auto opening = Tracer::Start(b->conn->trace);
+	auto& item = b->items[i];
+	if (!item.status)
+	{
+		item.status = 404;
+#ifdef _MSC_VER
+		const auto fp = FileExists(item.path.c_str()) ? fopen(item.path.c_str(), "rb") : nullptr;
+		if (fp) item.size = FileSize(item.path.c_str());
+#else
+		// One open and one fstat per item.
+		auto fp = fopen(item.path.c_str(), "rb");
+		struct stat st {};
+		if (fp && (fstat(fileno(fp), &st) < 0 || !S_ISREG(st.st_mode)))
+		{
+			fclose(fp);
+			fp = nullptr;
+		}
+		if (fp) item.size = st.st_size;
+#endif
+		if (fp)
+		{
+			item.status = 200;
+			// An empty file always goes with the gather write: a transfer of nothing would never finish.
+			if (!item.size || (item.size <= TransferChunk && !b->scheduled))
+			{
+				item.lease.reset(new Memory::Lease(Memory::Transfers, item.size));
+				item.data.resize(static_cast<size_t>(item.size));
+				item.data.resize(fread(&item.data[0], sizeof(char), item.data.size(), fp));
+				item.size = item.data.size();
+				fclose(fp);
+				++Batch::ReadAhead;
+			}
+			else item.fp = fp;
+		}
+	}
+	if (item.status != 200) ++Batch::Missing;
+	Tracer::Record(b->conn->trace, "open", opening, item.name);
+	std::lock_guard<std::mutex> lock(b->mtx);
+	item.ready = true;
+	if (b->waiting && b->items[b->next].ready)
+	{
+		b->waiting = false;
+		NetStage->Submit([b]() { BatchSend(b); });
+	}
+}
+
+// Keep the disk stage BatchAhead items ahead of the sender; the caller holds the batch mutex.
+void BatchFill(const std::shared_ptr<Batch>& b)
+{
+	for (; b->opened < b->items.size() && b->opened < b->next + BatchAhead; ++b->opened)
+	{
+		const auto i = b->opened;
+		DiskStage->Submit([b, i]() { BatchOpen(b, i); });
+	}
+}
+
+std::string BatchFrame(const Batch::Item& item)
+{
+	return std::to_string(item.status) + " " + std::to_string(item.size) + " " + item.name + "\n";
+}
+
+// Send every item ready from items[next] on, as one gather write up to the first that is not
+// opened yet or goes through the scheduler; runs on a network thread.
+void BatchSend(const std::shared_ptr<Batch>& b)
+{
+	for (;;)
+	{
+		std::unique_lock<std::mutex> lock(b->mtx);
+		BatchFill(b);
+		if (b->next < b->items.size() && !b->items[b->next].ready)
+		{
+			b->waiting = true;
+			return;
+		}
+		auto end = b->next;
+		while (end < b->items.size() && b->items[end].ready && !b->items[end].fp) ++end;
+		const auto begin = b->next;
+		lock.unlock();
+		std::vector<std::string> frames;
+		frames.reserve(end - begin + 1);
+		std::vector<std::pair<const char*, size_t>> pieces;
+		pieces.reserve(2 * (end - begin) + 1);
+		for (auto i = begin; i < end; ++i)
+		{
+			const auto& item = b->items[i];
+			frames.push_back(BatchFrame(item));
+			pieces.emplace_back(frames.back().c_str(), frames.back().length());
+			if (!item.data.empty()) pieces.emplace_back(item.data.c_str(), item.data.length());
+			Batch::Bytes += item.data.length();
+		}
+		Batch::Items += end - begin;
+		if (end == b->items.size())
+		{
+			frames.push_back("end " + std::to_string(b->items.size()) + "\n");
+			pieces.emplace_back(frames.back().c_str(), frames.back().length());
+		}
+		if (!pieces.empty())
+		{
+			Tracer::Scope span(b->conn->trace, "send");
+			if (SendGather(*b->conn, pieces) < 0) return;
+		}
+		for (auto i = begin; i < end; ++i)
+		{
+			b->items[i].data = std::string();
+			b->items[i].lease.reset();
+		}
+		if (end == b->items.size()) return;
+		lock.lock();
+		b->next = end;
+		// Opened meanwhile without being left open: it goes out with the next gather write.
+		if (!b->items[end].ready || !b->items[end].fp) continue;
+		auto& item = b->items[end];
+		auto t = std::make_shared<Transfer>();
+		t->conn = b->conn;
+		t->fp = item.fp;
+		item.fp = nullptr;
+		t->remaining = item.size;
+		t->done = [b, end]()
+		{
+			{
+				std::lock_guard<std::mutex> lock(b->mtx);
+				b->next = end + 1;
+			}
+			++Batch::Items;
+			BatchSend(b);
+		};
+		const auto frame = BatchFrame(item);
+		lock.unlock();
+		++Batch::Scheduled;
+		Batch::Bytes += item.size;
+		if (Send(*b->conn, frame.c_str(), frame.length()) < 0) return;
+		Pump(t);
+		return;
+	}
+}
+
+// Resolve the posted list against dir and start the batch; runs on a disk thread.
+void HttpBatch(const std::shared_ptr<Connection>& conn, const char* root, const std::string& dir, const std::string& body)
+{
+	Memory::Lease lease(Memory::Responses, body.length());
+	++Batch::Requests;
+	auto b = std::make_shared<Batch>();
+	b->conn = conn;
+	b->scheduled = (conn->root && conn->root->rateConn > 0) || GetOptionInt("rate-ip", 0) > 0;
+	std::istringstream lines(body);
+	std::string line;
+	while (std::getline(lines, line))
+	{
+		if (!line.empty() && line.back() == '\r') line.pop_back();
+		if (line.empty()) continue;
+		if (b->items.size() == BatchMaxItems)
+		{
+			NetStage->Submit([conn]() { HttpText(*conn, "413 Payload Too Large", "413 Payload Too Large: at most " + std::to_string(BatchMaxItems) + " paths\n"); });
+			return;
+		}
+		Batch::Item item;
+		item.name = line;
+#ifdef _MSC_VER
+		item.path = line[0] == '/' ? ToWindowsPath(line.c_str()) : PathCombine(dir.c_str(), ToWindowsPath(line.c_str()).c_str());
+#else
+		item.path = line[0] == '/' ? line : PathCombine(dir.c_str(), line.c_str());
+#endif
+		if (!CheckUrl(item.path, root)) item.status = 403;
+		b->items.push_back(std::move(item));
+	}
+	std::ostringstream head;
+	head << "HTTP/1.1 200 OK\r\n"
+		"Content-Type: application/x-hais-batch\r\n"
+		"Server: iriszero/" VERSION "\r\n"
+		"Connection: close\r\n\r\n";
+	const auto headText = head.str();
+	{
+		std::lock_guard<std::mutex> lock(b->mtx);
+		BatchFill(b);
+	}
+	NetStage->Submit([b, headText]()
+	{
+		printf("<========================\n%s\n", headText.c_str());
+		if (Send(*b->conn, headText.c_str(), headText.length()) < 0) return;
+		BatchSend(b);
+	});
+}
+
+// Read the rest of a posted list, then start the batch on the disk stage. The list is small next
+// to what it fetches, so it is gathered whole rather than streamed, but like an upload body each
+// read waits on the poller, so a client sending it slowly holds no network thread.
+void BatchReceive(
+	const std::shared_ptr<Connection>& conn,
+	const char* root,
+	const std::string& dir,
+	const std::shared_ptr<std::string>& body,
+	const uint64_t length)
+{
+	if (body->length() >= length)
+	{
+		DiskStage->Submit([conn, root, dir, body]() { HttpBatch(conn, root, dir, *body); });
+		return;
+	}
+	const auto read = [conn, root, dir, body, length]()
+	{
+		std::vector<char> buf(TransferChunk);
+		const auto len = Recv(*conn, buf.data(), static_cast<int>(std::min<uint64_t>(buf.size(), length - body->length())));
+		if (len <= 0) return;
+		body->append(buf.data(), len);
+		BatchReceive(conn, root, dir, body, length);
+	};
+#ifdef _MSC_VER
+	NetStage->Submit(read);
+#else
+#ifdef HAIS_TLS
+	// Records OpenSSL already read off the socket won't show in poll.
+	if (conn->ssl && SSL_pending(conn->ssl) > 0) return NetStage->Submit(read);
+#endif
+	Sockets->Watch(conn->fd, POLLIN, static_cast<int>(GetOptionInt("upload-timeout", 60)), [conn, read](const bool ready)
+	{
+		if (!ready) return HttpText(*conn, "408 Request Timeout", "408 Request Timeout\n");
+		read();
+	});
+#endif
+}
+
+// Set once the listening socket was handed to a new instance.
+static std::atomic<bool> Draining{false};
+
+std::string StatsReport()
+{
+	std::ostringstream oss;
+	oss << "connections live=" << Connection::Live.load() << (Draining ? " draining" : "") << "\n";
+	oss << NetStage->Stats() << "\n" <<
+		DiskStage->Stats() << "\n";
+	oss << Scheduler->Stats() << "\n";
+#ifndef _MSC_VER
+	oss << Sockets->Stats() << "\n";
+#endif
+	oss << Memory::Stats() << "\n";
+	if (Paths) oss << Paths->Stats() << "\n";
+	const auto snap = CurrentSnapshot();
+	if (snap) oss << snap->Stats() << "\n";
+	if (GetOptionInt("h2c", 1)) oss << H2Session::Stats() << "\n";
+	if (AnyRoot("upload")) oss << Upload::Stats() << "\n";
+	oss << Batch::Stats() << "\n";
+	if (Digests) oss << Digests->Stats() << "\n";
+	if (Upstream) oss << Upstream->Stats() << "\n";
+	for (const auto r : Roots) oss << r->listings->Stats() << "\n";
+	if (Prefetch) oss << Prefetch->Stats() << "\n";
+#ifdef HAIS_TLS
+	if (Tls) oss << Tls->Stats() << "\n";
+#endif
+	if (Tracer::Enabled()) oss << Tracer::Stats() << "\n";
+	return oss.str();
+}
+
+void HttpStats(Connection& conn)
+{
+	HttpText(conn, "200 OK", StatsReport());
+}
+
+// url must be path itself or lie below it, with no ".." component to climb back out.
+bool CheckUrl(const std::string& url, const char* path)
+{
+	const auto root = PathCombine(path, "");
+	if (url.compare(0, root.length(), root) && url + SplitChar != root) return false;
+	for (size_t pos = 0; pos < url.length();)
+	{
+		auto end = url.find(SplitChar[0], pos);
+		if (end == std::string::npos) end = url.length();
+		if (!url.compare(pos, end - pos, "..")) return false;
+		pos = end + 1;
+	}
+	return true;
+}
+
+std::string ReadText(const std::string& file)
+{
+	const auto fp = fopen(file.c_str(), "rb");
+	if (!fp) err(EXIT_FAILURE, "Can't open %s", file.c_str());
+	std::string text;
+	char buf[4096];
+	size_t len;
+	while ((len = fread(buf, sizeof(char), sizeof(buf), fp))) text.append(buf, len);
+	fclose(fp);
+	return text;
+}
+
+Root* NewRoot(const std::string& path, const std::string& coding, const std::string& icoPath, const std::map<std::string, std::string>& options)
+{
+	auto root = new Root;
+	root->path = path;
+	root->coding = coding;
+	root->icoPath = icoPath;
+	root->options = options;
+	const auto hosts = options.find("host");
+	if (hosts != options.end())
+	{
+		std::istringstream iss(hosts->second);
+		std::string host;
+		while (std::getline(iss, host, ','))
+		{
+			std::transform(host.begin(), host.end(), host.begin(), ::tolower);
+			host = host.substr(0, host.find(':'));
+			if (!host.empty()) root->hosts.push_back(host);
+		}
+	}
+	const auto templateFile = root->Option("listing-template", "");
+	const auto source = templateFile.empty() ? std::string(ListingTemplate::Default) : ReadText(templateFile);
+	std::string error;
+	root->listingTemplate = new ListingTemplate;
+	if (!root->listingTemplate->Compile(source, error)) err(EXIT_FAILURE, "Bad listing template %s: %s", templateFile.c_str(), error.c_str());
+	root->listings = new ListingCache(*root->listingTemplate, path, root->OptionInt("listing-cache", 1024));
+	root->rateConn = root->OptionInt("rate-conn", 0);
+	return root;
+}
+
+// Every line of a --roots file adds a root, as IndexPath Coding [IcoPath] followed by the options
+// that may differ between roots; blank lines and lines starting with # are skipped.
+void LoadRoots(const std::string& file)
+{
+	static const std::set<std::string> perRoot = {
+		"host", "listing-template", "listing-cache", "upload", "digest", "digest-inline", "rate-conn"};
+	std::istringstream lines(ReadText(file));
+	std::string line;
+	for (auto number = 1; std::getline(lines, line); ++number)
+	{
+		std::istringstream iss(line);
+		std::vector<std::string> args;
+		std::map<std::string, std::string> options;
+		std::string token;
+		while (iss >> token)
+		{
+			if (args.empty() && options.empty() && token[0] == '#') break;
+			if (token.compare(0, 2, "--"))
+			{
+				args.push_back(token);
+				continue;
+			}
+			const auto eq = token.find('=');
+			const auto name = token.substr(2, eq == std::string::npos ? std::string::npos : eq - 2);
+			if (!perRoot.count(name)) err(EXIT_FAILURE, "%s:%d: --%s can't be set per root", file.c_str(), number, name.c_str());
+			options[name] = eq == std::string::npos ? "1" : token.substr(eq + 1);
+		}
+		if (args.empty() && options.empty()) continue;
+		if (args.size() != 2 && args.size() != 3) err(EXIT_FAILURE, "%s:%d: expected IndexPath Coding [IcoPath]", file.c_str(), number);
+		if (!DirectoryExists(args[0].c_str())) err(EXIT_FAILURE, "%s:%d: %s is not a directory", file.c_str(), number, args[0].c_str());
+		Roots.push_back(NewRoot(args[0], args[1], args.size() == 3 ? args[2] : "", options));
+	}
 }
 
-std::string GetHttpUrlWithoutGet(const char* http, const uint32_t size)
+// The root a request is for: the one listing its Host, else the deepest one its path lies below,
+// else the first. A request matched by Host is confined to that root like any other.
+const Root& SelectRoot(const std::string& http, const std::string& url)
 {
-	auto start = 0, end = 0;
-	for (auto i = 0; i < size; ++i)
+	if (Roots.size() == 1) return *Roots.front();
+	std::smatch sm;
+	const auto head = http.substr(0, http.find("\r\n\r\n"));
+	if (std::regex_search(head, sm, std::regex("\r\nHost: *([^\r\n:]+)", std::regex::icase)))
 	{
-		if (http[i] == ' ')
+		auto host = sm[1].str();
+		std::transform(host.begin(), host.end(), host.begin(), ::tolower);
+		for (const auto r : Roots)
 		{
-			start = i + 1;
-			break;
+			if (std::find(r->hosts.begin(), r->hosts.end(), host) != r->hosts.end()) return *r;
 		}
 	}
-	for (auto i = start; i < size; ++i)
+	auto best = Roots.front();
+	size_t depth = 0;
+	for (const auto r : Roots)
 	{
-		if (http[i] == ' ' || http[i] == '?')
+		if (r->path.length() > depth && CheckUrl(url, r->path.c_str()))
 		{
-			end = i;
-			break;
+			best = r;
+			depth = r->path.length();
 		}
 	}
-	return !start && !end ? std::string() : std::string(http + start, end - start);
+	return *best;
 }
 
-void HttpNotFound(const int fd)
+std::string GetHttpQuery(const char* http, const uint32_t size)
 {
-
-	static const auto html =
-		"<html><head><title>404 Not Found</title></head>"
-		"<body>"
-		"<center><h1>404 Not Found</h1></center>"
-		"<hr><center>iriszero/" VERSION "</center>"
-		"</body></html>";
-	static const auto len = strlen(html);
-	std::ostringstream oss;
-	oss <<
-		"HTTP/1.1 404 Not Found\r\n"
-		"Content-Length: " << std::to_string(len) << "\r\n"
-		"Content-Type: text/html\r\n"
-		"Server: iriszero/" VERSION "\r\n"
-		"Connection: close\r\n\r\n" <<
-		html;
-	const auto http = oss.str();
-	printf("<========================\n%s\n", http.c_str());
-	send(fd, http.c_str(), http.length(), 0);
+	uint32_t i = 0;
+	for (; i < size && http[i] != ' '; ++i);
+	for (++i; i < size && http[i] != ' ' && http[i] != '?'; ++i);
+	if (i >= size || http[i] != '?') return std::string();
+	const auto start = ++i;
+	for (; i < size && http[i] != ' '; ++i);
+	return std::string(http + start, i - start);
 }
 
-void HttpNotModified(const int fd, const char* lastModified)
+bool GetQueryParam(const std::string& query, const char* key, std::string& value)
 {
-	std::ostringstream oss;
-	oss << "HTTP/1.1 304 Not Modified\r\n"
-		"Server: iriszero/" VERSION "\r\n"
-		"Last-Modified: " << lastModified << "\r\n"
-		"Connection: close\r\n\r\n";
-	const auto http = oss.str();
-	printf("<========================\n%s\n", http.c_str());
-	send(fd, http.c_str(), http.length(), 0);
+	const auto keyLen = strlen(key);
+	size_t pos = 0;
+	while (pos <= query.length())
+	{
+		auto end = query.find('&', pos);
+		if (end == std::string::npos) end = query.length();
+		const auto item = query.substr(pos, end - pos);
+		if (!item.compare(0, keyLen, key) && (item.length() == keyLen || item[keyLen] == '='))
+		{
+			value = item.length() == keyLen ? std::string() : UrlDecode(item.c_str() + keyLen + 1, item.length() - keyLen - 1);
+			return true;
+		}
+		pos = end + 1;
+	}
+	return false;
 }
 
-void HttpFile(
-	const int fd,
-	const char* path,
-	const char* lastModified,
-	const uint64_t fileSize,
-	const uint64_t offset = 0,
-	uint64_t size = 0)
+void Dispatch(const std::shared_ptr<Connection>& conn, const std::string& http)
 {
-#define HttpHead(value, http, sm) \
-	std::regex_search(http, sm, std::regex(""#value": {0,1}.+?\\r{0,1}\\n", std::regex::icase)); \
-	const auto (value) = std::regex_replace((sm)[0].str(), std::regex("("#value": {0,1}|\\r{0,1}\\n)", std::regex::icase), "")
+	printf(
+		"%s:%d%s===================>\n%s\n",
+		inet_ntoa(conn->addr.sin_addr),
+		ntohs(conn->addr.sin_port),
+		conn->stream ? " (h2c)" : "",
+		http.c_str());
+	conn->trace = Tracer::Sample();
+	if (conn->trace)
+	{
+		conn->request = http.substr(0, std::min(http.find("\r\n"), http.find(" HTTP/")));
+		Tracer::Record(conn->trace, "recv", conn->start);
+	}
+	const auto parsing = Tracer::Start(conn->trace);
+	std::smatch sm;
+	auto _url = GetHttpUrlWithoutGet(http.c_str(), http.length());
+	if (_url.empty()) return;
+	const auto query = GetHttpQuery(http.c_str(), http.length());
+	std::string value;
+	if (GetQueryParam(query, "stats", value))
+	{
+		HttpStats(*conn);
+		return;
+	}
+	if (GetQueryParam(query, "trace", value))
+	{
+		if (Tracer::Enabled()) HttpText(*conn, "200 OK", Tracer::Export(), "application/json");
+		else HttpText(*conn, "503 Service Unavailable", "tracing is disabled\n");
+		return;
+	}
+#ifdef _MSC_VER
+	auto url = ToWindowsPath(
+		UrlDecode(_url.c_str(), _url.length()).c_str());
+#else
+	auto url = UrlDecode(_url.c_str(), _url.length());
+#endif
+	const auto root = &SelectRoot(http, url);
+	conn->root = root;
+	const auto path = root->path.c_str();
+	const auto coding = root->coding.c_str();
+	const auto icoPath = root->icoPath.c_str();
+	std::string archive;
+	GetQueryParam(query, "archive", archive);
+	PathIndex::Query search{"", "substring", "", 1000};
+	const auto searching = GetQueryParam(query, "search", search.pattern);
+	if (searching)
+	{
+		if (root != Roots.front())
+		{
+			HttpText(*conn, "503 Service Unavailable", "the path index covers the first root only\n");
+			return;
+		}
+		if (!Paths || !Paths->Ready())
+		{
+			HttpText(*conn, "503 Service Unavailable", Paths ? "path index is building\n" : "path index is disabled\n");
+			return;
+		}
+		GetQueryParam(query, "mode", search.mode);
+		if (GetQueryParam(query, "limit", value)) search.limit = std::min<int64_t>(SearchMaxLimit, std::max<int64_t>(1, std::strtoll(value.c_str(), nullptr, 10)));
+	}
+	const auto text = GetQueryParam(query, "format", value) && value == "text";
+	std::string manifest;
+	const auto manifesting = GetQueryParam(query, "manifest", manifest);
+	if (manifesting && (!Digests || !root->OptionInt("digest", 0)))
+	{
+		HttpText(*conn, "503 Service Unavailable", "digests are disabled\n");
+		return;
+	}
+	if (!http.compare(0, 5, "POST "))
+	{
+		if (!GetQueryParam(query, "batch", value))
+		{
+			HttpText(*conn, "405 Method Not Allowed", "POST is only for ?batch\n");
+			return;
+		}
+		if (conn->stream)
+		{
+			HttpText(*conn, "501 Not Implemented", "batches need HTTP/1.1\n");
+			return;
+		}
+		const auto dir = _url == "/" ? std::string(path) : url;
+		if (!CheckUrl(dir, path))
+		{
+			HttpText(*conn, "403 Forbidden", "403 Forbidden\n");
+			return;
+		}
+		const auto headEnd = http.find("\r\n\r\n");
+		const auto head = http.substr(0, headEnd);
+		if (headEnd == std::string::npos ||
+			!std::regex_search(head, sm, std::regex("\r\nContent-Length: *([0-9]+)", std::regex::icase)))
+		{
+			HttpText(*conn, "411 Length Required", "411 Length Required\n");
+			return;
+		}
+		const auto length = std::strtoull(sm[1].str().c_str(), nullptr, 10);
+		if (length > BatchMaxBody)
+		{
+			HttpText(*conn, "413 Payload Too Large", "413 Payload Too Large\n");
+			return;
+		}
+		if (std::regex_search(head, sm, std::regex("\r\nExpect: *100-continue", std::regex::icase)))
+		{
+			static const std::string proceed = "HTTP/1.1 100 Continue\r\n\r\n";
+			if (Send(*conn, proceed.c_str(), proceed.length()) < 0) return;
+		}
+		Tracer::Record(conn->trace, "parse", parsing);
+		BatchReceive(conn, path, dir, std::make_shared<std::string>(http.substr(headEnd + 4, length)), length);
+		return;
+	}
+	if (!http.compare(0, 4, "PUT "))
+	{
+		if (!root->OptionInt("upload", 0))
+		{
+			HttpText(*conn, "405 Method Not Allowed", "uploads are disabled\n");
+			return;
+		}
+		if (conn->stream)
+		{
+			HttpText(*conn, "501 Not Implemented", "uploads need HTTP/1.1\n");
+			return;
+		}
+		if (!CheckUrl(url, path))
+		{
+			HttpText(*conn, "403 Forbidden", "403 Forbidden\n");
+			return;
+		}
+		const auto headEnd = http.find("\r\n\r\n");
+		const auto head = http.substr(0, headEnd);
+		if (headEnd == std::string::npos ||
+			!std::regex_search(head, sm, std::regex("\r\nContent-Length: *([0-9]+)", std::regex::icase)))
+		{
+			HttpText(*conn, "411 Length Required", "411 Length Required\n");
+			return;
+		}
+		const auto length = std::strtoull(sm[1].str().c_str(), nullptr, 10);
+		const auto expectContinue = std::regex_search(head, sm, std::regex("\r\nExpect: *100-continue", std::regex::icase));
+		const auto body = http.substr(headEnd + 4);
+		DiskStage->Submit([=]() { HttpPut(conn, path, url, length, body, expectContinue); });
+		return;
+	}
+	HttpHead(Range, http, sm);
+	std::regex_search(
+		http,
+		sm,
+		std::regex("If-Modified-Since: {0,1}.+?\\r{0,1}\\n", std::regex::icase));
+	const auto lastModified = std::regex_replace(
+		sm[0].str(),
+		std::regex("(If-Modified-Since: {0,1}|\\r{0,1}\\n)", std::regex::icase),
+		"");
+	Tracer::Record(conn->trace, "parse", parsing);
+	const auto queued = Tracer::Start(conn->trace);
+	DiskStage->Submit([=]()
+	{
+		Tracer::Record(conn->trace, "disk-queue", queued);
+		const auto iconPath = PathCombine(path, "favicon.ico");
+		if (searching)
+		{
+			auto q = search;
+			if (_url != "/" && CheckUrl(url, path) && DirectoryExists(url.c_str()))
+			{
+				q.scope = PathCombine(url.c_str(), "").substr(PathCombine(path, "").length());
+			}
+			HttpSearch(conn, q, text, coding);
+			return;
+		}
+		if (manifesting)
+		{
+			if (_url == "/") HttpManifest(conn, path, manifest == "xxh64");
+			else if (CheckUrl(url, path) && DirectoryExists(url.c_str())) HttpManifest(conn, url, manifest == "xxh64");
+			else NetStage->Submit([conn]() { HttpNotFound(*conn); });
+			return;
+		}
+		if (_url == "/")
+		{
+			if (archive == "tar" || archive == "zip") HttpArchive(conn, path, archive == "zip", coding, Range);
+			else AsyncIndexOf(conn, path, coding);
+			return;
+		}
+		if (_url == "/favicon.ico" && !FileExists(iconPath.c_str()))
+		{
+			if (!icoPath[0]) NetStage->Submit([conn]() { HttpNotFound(*conn); });
+			else HttpFile(
+				conn,
+				icoPath,
+				FileLastModified(icoPath),
+				FileSize(icoPath));
+			return;
+		}
+		const auto checking = Tracer::Start(conn->trace);
+		const auto urlStatus = CheckUrl(url, path);
+		const auto isDirectory = urlStatus && DirectoryExists(url.c_str());
+		const auto isFile = urlStatus && !isDirectory && FileExists(url.c_str());
+		Tracer::Record(conn->trace, "check", checking);
+		if (isDirectory)
+		{
+			if (archive == "tar" || archive == "zip") HttpArchive(conn, url, archive == "zip", coding, Range);
+			else AsyncIndexOf(conn, url, coding);
+		}
+		else if (isFile)
+		{
+			const auto stating = Tracer::Start(conn->trace);
+			const auto fileSize = FileSize(url.c_str());
+			if (!Range.empty())
+			{
+				Tracer::Record(conn->trace, "stat", stating);
+				const auto ranges = GetOffsetAndSize(Range, fileSize);
+				if (Prefetch) Prefetch->Observe(conn->trace, conn->addr.sin_addr.s_addr, url, fileSize, ranges);
+				HttpRanges(conn, url, fileSize, ranges);
+				return;
+			}
+			auto fileLastModified = FileLastModified(url.c_str());
+			Tracer::Record(conn->trace, "stat", stating);
+			if (lastModified == fileLastModified)
+			{
+				NetStage->Submit([conn, fileLastModified]()
+				{
+					HttpNotModified(*conn, fileLastModified.c_str());
+				});
+			}
+			else
+			{
+				HttpFile(conn, url, fileLastModified, fileSize);
+			}
+		}
+		else if (Upstream && urlStatus && root == Roots.front())
+		{
+			Upstream->Serve(conn, url);
+		}
+		else
+		{
+			AsyncIndexOf(conn, path, coding);
+		}
+	});
+}
 
-#define IfErrorThenReturn(fun, fp) if((fun) < 0) { fclose(fp); return; }
+void HandleRequest(const std::shared_ptr<Connection>& conn)
+{
+#ifdef HAIS_TLS
+	if (Tls && !Tls->Accept(*conn)) return;
+#endif
 	char buf[4096] = {0};
-	size_t len = 0;
-	const auto fp = fopen(path, "rb");
-	if (!offset && !size)
+	auto len = 0;
+	std::string http;
+	// Stop at the end of the head: a request body is left in the socket for whoever consumes it.
+	while ((len = Recv(*conn, buf, 4096)) > 0)
 	{
-		std::ostringstream head;
-		head << "HTTP/1.1 200 OK\r\nContent-Length:" <<
-			std::to_string(fileSize) <<
-			"\r\nConnection: close"
-			"\r\nLast-Modified: " << lastModified <<
-			"\r\nContent-Type: " << GetContentType(path) <<
-			"\r\nServer: iriszero/" VERSION
-			"\r\n\r\n";
-		printf("<========================\n%s\n", head.str().c_str());
-		IfErrorThenReturn(send(fd, head.str().c_str(), head.str().length(), 0), fp);
-		while ((len = fread(buf, sizeof(uint8_t), 4096, fp)) == 4096)
-			IfErrorThenReturn(send(fd, buf, 4096, 0), fp);
-		IfErrorThenReturn(send(fd, buf, len, 0), fp);
+		http.append(buf, len);
+		if (len < 4096 || http.find("\r\n\r\n") != std::string::npos) break;
 	}
-	else
+#ifdef HAIS_TLS
+	// HTTP/2 over TLS would be negotiated by ALPN, which is not offered; HTTPS clients stay on HTTP/1.1.
+	if (GetOptionInt("h2c", 1) && !conn->ssl)
+#else
+	if (GetOptionInt("h2c", 1))
+#endif
 	{
-		fseek(fp, offset, SEEK_SET);
-		std::ostringstream head;
-		head << "HTTP/1.1 206 Partial Content\r\nAccept-Ranges: bytes\r\n" <<
-			"Server: iriszero/" VERSION "\r\n" <<
-			"Content-Type: " << GetContentType(path) << "\r\n"
-			"Content-Length: " << std::to_string(size)
-			<< "\r\nContent-Range: bytes " <<
-			std::to_string(offset) << "-" <<
-			std::to_string(offset + size - 1) << "/" <<
-			std::to_string(fileSize) << "\r\nConnection: close\r\n\r\n";
-		printf("<========================\n%s\n", head.str().c_str());
-		IfErrorThenReturn(send(fd, head.str().c_str(), head.str().length(), 0), fp);
-		for (; size > 4096; size -= len)
+		std::string upgrade, settings;
+		const auto prior = !http.compare(0, H2PrefaceLength, H2Preface);
+		if (!prior)
+		{
+			std::smatch sm;
+			const auto head = http.substr(0, http.find("\r\n\r\n"));
+			if (!std::regex_search(head, sm, std::regex("\r\nUpgrade: *h2c *\r?(\n|$)", std::regex::icase))) return Dispatch(conn, http);
+			if (!std::regex_search(head, sm, std::regex("\r\nHTTP2-Settings: *([A-Za-z0-9_=-]*)", std::regex::icase))) return Dispatch(conn, http);
+			settings = sm[1].str();
+			upgrade = head + "\r\n\r\n";
+		}
+		// The session reads the socket for as long as the client keeps it open, so it gets its own thread.
+		const auto session = H2Session::Admit(conn);
+		if (!session)
+		{
+			// Too many already: an upgrade is answered over HTTP/1.1, and a client that started with the preface is told to back off.
+			if (!prior) return Dispatch(conn, http);
+			const auto away = H2FrameHeader(0, H2Settings, 0, 0) + H2FrameHeader(8, H2GoAway, 0, 0) + H2Word(0) + H2Word(H2EnhanceYourCalm);
+			Send(*conn, away.c_str(), away.length());
+			return;
+		}
+		if (!prior)
 		{
-			len = fread(buf, sizeof(uint8_t), 4096, fp);
-			IfErrorThenReturn(send(fd, buf, len, 0), fp);
+			http.erase(0, upgrade.length());
+			static const std::string switching =
+				"HTTP/1.1 101 Switching Protocols\r\n"
+				"Connection: Upgrade\r\n"
+				"Upgrade: h2c\r\n\r\n";
+			if (Send(*conn, switching.c_str(), switching.length()) < 0) return;
 		}
-		len = fread(buf, sizeof(uint8_t), size, fp);
-		IfErrorThenReturn(send(fd, buf, len, 0), fp);
+		std::thread([session, http, upgrade, settings]() { session->Run(http, upgrade, settings); }).detach();
+		return;
 	}
+	Dispatch(conn, http);
 }
 
-void IndexOf(const int fd, const char* path, const char* coding)
+// Graceful restart. A new instance started with --handoff=Path asks the running one, over a
+// unix socket at Path, for its listening socket. The old instance first rewrites the --snapshot
+// file so the new one starts with warm listings, keeps serving meanwhile, then passes the socket
+// with SCM_RIGHTS, stops accepting, and exits once its connections are done or --drain-timeout
+// has passed. A listening socket passed systemd-style (LISTEN_FDS) is taken as is.
+#ifndef _MSC_VER
+static int DrainWake[2] = {-1, -1};
+
+int InheritedSocket()
 {
-	std::ostringstream dirs;
-	std::ostringstream files;
-	GetFiles(path, dirs, files);
-	std::ostringstream html;
-	html << " <!DOCTYPE html>"
-		"<html>" <<
-		"<head><title>Index of " << path << "</title>"
-		"<meta charset=\"" << coding << "\"/>"
-		"</head>"
-		"<body>"
-		"<h1>Index of " << path << "</h1><hr>" <<
-		dirs.str() << (dirs.str().empty() ? "" : "<hr>") <<
-		"<table>" <<
-		(files.str().empty() ? "" : "<tr><th>File Name</th><th>Size</th></tr>") <<
-		files.str() <<
-		"</table></body>"
-		"</html>";
-	std::ostringstream head;
-	head << "HTTP/1.1 200 OK\r\nContent-length: " << std::to_string(html.str().length()) <<
-		"\r\nServer: iriszero/" VERSION <<
-		"\r\nContent-Type: text/html\r\n\r\n";
-	printf("<========================\n%s\n", head.str().c_str());
-	send(fd, head.str().c_str(), head.str().length(), 0);
-	send(fd, html.str().c_str(), html.str().length(), 0);
+	const auto pid = getenv("LISTEN_PID");
+	const auto fds = getenv("LISTEN_FDS");
+	if (!pid || !fds || std::strtoll(pid, nullptr, 10) != getpid() || std::strtoll(fds, nullptr, 10) < 1) return -1;
+	unsetenv("LISTEN_PID");
+	unsetenv("LISTEN_FDS");
+	unsetenv("LISTEN_FDNAMES");
+	fcntl(3, F_SETFD, FD_CLOEXEC);
+	return 3;
 }
 
-bool CheckUrl(const std::string& url, const char* path)
+sockaddr_un ControlAddress(const std::string& control)
 {
-	std::regex_replace(url, std::regex("\\.\\."), "");
-	return !memcmp(url.c_str(), path, strlen(path) - 1);
+	sockaddr_un addr{};
+	addr.sun_family = AF_UNIX;
+	if (control.length() >= sizeof(addr.sun_path)) err(EXIT_FAILURE, "Handoff path too long: %s", control.c_str());
+	strcpy(addr.sun_path, control.c_str());
+	return addr;
 }
 
-std::list<std::tuple<uint64_t, uint64_t>> GetOffsetAndSize(
-	const std::string& __range,
-	const uint64_t fileSize)
+// The listening socket of the instance answering at control, or -1 when none is running.
+int TakeOver(const std::string& control)
 {
-	std::list<std::tuple<uint64_t, uint64_t>> res{};
-	auto _range = __range.substr(6, __range.length() - 6);
-	auto pos = 0;
-	for (auto i = 0; i < _range.length(); ++i)
+	const auto addr = ControlAddress(control);
+	const auto fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd < 0 || connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0)
 	{
-		if (_range[i] == ',')
+		if (fd >= 0) close(fd);
+		return -1;
+	}
+	char buf[256] = {0};
+	char cmsgBuf[CMSG_SPACE(sizeof(int))] = {0};
+	iovec iov{buf, sizeof(buf) - 1};
+	msghdr msg{};
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = cmsgBuf;
+	msg.msg_controllen = sizeof(cmsgBuf);
+	const auto len = SendAll(fd, "takeover\n", 9) < 0 ? -1 : recvmsg(fd, &msg, MSG_CMSG_CLOEXEC);
+	close(fd);
+	auto sock = -1;
+	const auto cmsg = CMSG_FIRSTHDR(&msg);
+	if (len > 0 && cmsg && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) memcpy(&sock, CMSG_DATA(cmsg), sizeof(int));
+	if (sock < 0) err(EXIT_FAILURE, "Handoff from %s failed", addr.sun_path);
+	printf("took over the listening socket: %s", buf);
+	return sock;
+}
+
+// Answers the next instance's takeover at control with sock.
+void ServeHandoff(const std::string& control, const int sock, const char* path)
+{
+	const auto addr = ControlAddress(control);
+	unlink(addr.sun_path);
+	const auto listener = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (listener < 0 || bind(listener, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(listener, 1) < 0)
+		err(EXIT_FAILURE, "Can't listen for handoff on %s", addr.sun_path);
+	std::thread([listener, sock, path]()
+	{
+		while (true)
 		{
-			auto range = _range.substr(pos, i - pos);
-			const int _pos = range.find('-');
-			auto _start = range.substr(0, _pos);
-			auto _end = range.substr(_pos + 1, range.length() - _pos - 1);
-			if (_start.empty())
-			{
-				auto end = std::stoull(_end);
-				res.emplace_back(fileSize - end, end);
-			}
-			else if (_end.empty())
+			const auto fd = accept4(listener, nullptr, nullptr, SOCK_CLOEXEC);
+			if (fd < 0) continue;
+			char buf[16] = {0};
+			if (recv(fd, buf, sizeof(buf) - 1, 0) < 8 || strncmp(buf, "takeover", 8))
 			{
-				auto start = std::stoull(_start);
-				res.emplace_back(start, fileSize - start);
+				close(fd);
+				continue;
 			}
-			else
+			const auto snapshot = GetOption("snapshot", "");
+			const auto warm = !snapshot.empty() && WriteSnapshot(path, snapshot, nullptr, nullptr);
+			const auto reply = "hais/" + std::to_string(getpid()) + " snapshot=" + (warm ? snapshot : "none") + "\n";
+			char cmsgBuf[CMSG_SPACE(sizeof(int))] = {0};
+			iovec iov{const_cast<char*>(reply.c_str()), reply.length()};
+			msghdr msg{};
+			msg.msg_iov = &iov;
+			msg.msg_iovlen = 1;
+			msg.msg_control = cmsgBuf;
+			msg.msg_controllen = sizeof(cmsgBuf);
+			const auto cmsg = CMSG_FIRSTHDR(&msg);
+			cmsg->cmsg_level = SOL_SOCKET;
+			cmsg->cmsg_type = SCM_RIGHTS;
+			cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+			memcpy(CMSG_DATA(cmsg), &sock, sizeof(int));
+			const auto sent = sendmsg(fd, &msg, MSG_NOSIGNAL);
+			close(fd);
+			if (sent < 0)
 			{
-				auto start = std::stoull(_start);
-				res.emplace_back(start, std::stoull(_end) - start + 1);
+				warn("Handoff failed");
+				continue;
 			}
-			pos = i + 1;
+			close(listener);
+			Draining = true;
+			const auto wake = write(DrainWake[1], "x", 1);
+			(void)wake;
+			return;
 		}
-	}
-	const auto range = _range.substr(pos, _range.length() - pos);
-	const int _pos = range.find('-');
-	const auto _start = range.substr(0, _pos);
-	const auto _end = range.substr(_pos + 1, range.length() - _pos - 1);
-	if (_start.empty())
-	{
-		auto end = std::stoull(_end);
-		res.emplace_back(fileSize - end, end);
-	}
-	else if (_end.empty())
-	{
-		auto start = std::stoull(_start);
-		res.emplace_back(start, fileSize - start);
-	}
-	else
-	{
-		auto start = std::stoull(_start);
-		res.emplace_back(start, std::stoull(_end) - start + 1);
-	}
-	return res;
+	}).detach();
 }
+#endif
 
 void Index(const char* path, const int port, const int threadNum, const char* coding, const char* icoPath)
 {
 	UrlEncodeTable['/'] = '/';
-	sockaddr_in svrAddr{}, cliAddr{};
+	sockaddr_in svrAddr{};
 	svrAddr.sin_family = AF_INET;
 	svrAddr.sin_addr.s_addr = INADDR_ANY;
 	svrAddr.sin_port = htons(port);
-	char one[4] = {0};
-	socklen_t sinLen = sizeof(cliAddr);
+	const int one = 1;
+	Tracer::Configure(GetOptionInt("trace", 0), GetOptionInt("trace-buffer", 16384));
+	Memory::Configure(GetOptionInt("memory", Memory::Share()));
 #ifdef _MSC_VER
 	WSADATA wsaData;
 	if (WSAStartup(MAKEWORD(2, 2), &wsaData) < 0)
@@ -910,142 +7778,179 @@ void Index(const char* path, const int port, const int threadNum, const char* co
 	auto sock = socket(AF_INET, SOCK_STREAM, 0);
 	if (sock == INVALID_SOCKET)
 	err(EXIT_FAILURE, "Can't open socket");
+	const auto inherited = false;
 #else
 	struct sigaction action;
 	action.sa_handler = [](int) {};
 	sigemptyset(&action.sa_mask);
 	action.sa_flags = 0;
 	sigaction(SIGPIPE, &action, nullptr);
-	auto sock = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+	if (Tracer::Enabled())
+	{
+		// Blocked before any other thread exists, so SIGUSR1 only ever reaches the waiter, which dumps the trace.
+		sigset_t usr1;
+		sigemptyset(&usr1);
+		sigaddset(&usr1, SIGUSR1);
+		pthread_sigmask(SIG_BLOCK, &usr1, nullptr);
+		std::thread([usr1]()
+		{
+			const auto file = GetOption("trace-file", "hais-trace.json");
+			auto sig = 0;
+			while (!sigwait(&usr1, &sig))
+			{
+				const auto json = Tracer::Export();
+				const auto fp = fopen(file.c_str(), "wb");
+				if (!fp)
+				{
+					warn("Can't write %s", file.c_str());
+					continue;
+				}
+				fwrite(json.c_str(), sizeof(char), json.length(), fp);
+				fclose(fp);
+				printf("trace written to %s\n", file.c_str());
+			}
+		}).detach();
+	}
+	auto sock = InheritedSocket();
+	const auto handoff = GetOption("handoff", "");
+	if (sock < 0 && !handoff.empty()) sock = TakeOver(handoff);
+	const auto inherited = sock >= 0;
+	if (!inherited) sock = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
 	if (sock <= 0) err(EXIT_FAILURE, "Can't open socket");
+	// Accept without blocking: a socket shared with the next instance may have had its connection taken.
+	fcntl(sock, F_SETFL, fcntl(sock, F_GETFL) | O_NONBLOCK);
+	if (pipe2(DrainWake, O_CLOEXEC) < 0) err(EXIT_FAILURE, "Can't create pipe");
 #endif
-	setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, one, sizeof(one));
-	if (bind(sock, (struct sockaddr *)&svrAddr, sizeof(svrAddr)) < 0)
-	{
-		close(sock);
-		err(1, "Can't bind");
-	}
-	listen(sock, threadNum);
-	std::valarray<std::thread> pool(threadNum);
-	std::generate(begin(pool), end(pool), [&]()
-	{
-		return std::thread([&]()
-		{
-			const auto iconPath = PathCombine(path, "favicon.ico");
-			while (true)
-			{
-				const auto clientFd = accept(sock, (struct sockaddr *)&cliAddr, &sinLen);
-				char buf[4096] = {0};
-				auto len = 0;
-				std::ostringstream _http;
-				while ((len = recv(clientFd, buf, 4096, 0)) == 4096)
-					_http << buf;
-				_http.write(buf, len);
-				auto http = _http.str();
-				printf(
-					"%s:%d===================>\n%s\n",
-					inet_ntoa(cliAddr.sin_addr),
-					ntohs(cliAddr.sin_port),
-					http.c_str());
-				std::smatch sm;
-				auto _url = GetHttpUrlWithoutGet(http.c_str(), http.length());
-#ifdef _MSC_VER
-				auto url = ToWindowsPath(
-					UrlDecode(_url.c_str(), _url.length()).c_str());
+	if (!inherited)
+	{
+		setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, reinterpret_cast<const char*>(&one), sizeof(one));
+		if (bind(sock, (struct sockaddr *)&svrAddr, sizeof(svrAddr)) < 0)
+		{
+			close(sock);
+			err(1, "Can't bind");
+		}
+		listen(sock, threadNum);
+	}
+	NetStage = new Stage("network", threadNum);
+	DiskStage = new Stage("disk", GetOptionInt("disk-threads", threadNum));
+#ifndef _MSC_VER
+	Sockets = new Poller();
+#endif
+	Scheduler = new TransferScheduler(
+		GetOptionInt("transfer-slots", std::max<int64_t>(1, GetOptionInt("disk-threads", threadNum) / 2)),
+		GetOptionInt("rate-conn", 0),
+		GetOptionInt("rate-ip", 0),
+		GetOptionInt("small-transfer", 1 << 20));
+	const auto snapshotFile = GetOption("snapshot", "");
+	std::shared_ptr<TreeSnapshot> snap;
+	if (!snapshotFile.empty())
+	{
+		snap = TreeSnapshot::Load(snapshotFile, path);
+		if (snap) printf("%s\n", snap->Stats().c_str());
+		std::lock_guard<std::mutex> lock(SnapMtx);
+		Snap = snap;
+	}
+	if (GetOptionInt("path-index", 0)) Paths = new PathIndex(path);
+	Roots.push_back(NewRoot(path, coding, icoPath, {}));
+	const auto rootsFile = GetOption("roots", "");
+	if (!rootsFile.empty()) LoadRoots(rootsFile);
+	if (AnyRoot("digest")) Digests = new DigestCache(GetOptionInt("digest-cache", 100000));
+	Memory::SetEvictor(Memory::Listings, [](const int64_t n)
+	{
+		// Each root gives once, in proportion to what it holds.
+		std::vector<int64_t> held;
+		int64_t total = 0;
+		for (const auto r : Roots)
+		{
+			held.push_back(r->listings->Held());
+			total += held.back();
+		}
+		int64_t freed = 0;
+		for (size_t i = 0; i < Roots.size() && total > 0; ++i)
+		{
+			if (held[i]) freed += Roots[i]->listings->Evict(static_cast<int64_t>(static_cast<double>(n) * held[i] / total) + 1);
+		}
+		return freed;
+	});
+	if (Digests) Memory::SetEvictor(Memory::Digests, [](const int64_t n) { return Digests->Evict(n); });
+	if (GetOptionInt("prefetch-window", 8 << 20) > 0)
+	{
+		Prefetch = new RangePrefetcher(GetOptionInt("prefetch-window", 8 << 20), GetOptionInt("prefetch-ttl", 10));
+	}
+	const auto cert = GetOption("tls-cert", "");
+	if (!cert.empty())
+	{
+#ifdef HAIS_TLS
+		Tls = new TlsContext(cert, GetOption("tls-key", cert.c_str()), GetOptionInt("ktls", 1) != 0);
 #else
-						auto url = UrlDecode(_url.c_str(), _url.length());
+		err(EXIT_FAILURE, "--tls-cert needs a build with OpenSSL (HAIS_TLS)");
 #endif
-				auto urlStatus = false;
-				if (_url.empty()) continue;
-				if (_url == "/") goto index;
-				if (_url == "/favicon.ico" && !FileExists(iconPath.c_str()))
-				{
-					if (!icoPath[0]) HttpNotFound(clientFd);
-					else HttpFile(
-						clientFd, 
-						icoPath,
-						FileLastModified(iconPath.c_str()).c_str(),
-						FileSize(iconPath.c_str()));
-					close(clientFd);
-					continue;
-				}
-				urlStatus = CheckUrl(url, path);
-				if (urlStatus && DirectoryExists(url.c_str()))
-				{
-					IndexOf(clientFd, url.c_str(), coding);
-				}
-				else if (urlStatus && FileExists(url.c_str()))
-				{
-					HttpHead(Range, http, sm);
-					if (Range.empty())
-					{
-						std::regex_search(
-							http, 
-							sm, 
-							std::regex("If-Modified-Since: {0,1}.+?\\r{0,1}\\n", std::regex::icase));
-						auto fileLastModified = FileLastModified(url.c_str());
-						auto lastModified = std::regex_replace(
-							sm[0].str(), 
-							std::regex("(If-Modified-Since: {0,1}|\\r{0,1}\\n)", std::regex::icase),
-							"");
-						if(lastModified == fileLastModified)
-						{
-							HttpNotModified(clientFd, fileLastModified.c_str());
-						}
-						else
-						{
-							HttpFile(
-								clientFd,
-								url.c_str(),
-								FileLastModified(url.c_str()).c_str(),
-								FileSize(url.c_str()));
-						}
-					}
-					else
-					{
-						for (auto& i : GetOffsetAndSize(Range, FileSize(url.c_str())))
-						{
-							HttpFile(
-								clientFd,
-								url.c_str(),
-								nullptr,
-								FileSize(url.c_str()),
-								std::get<0>(i),
-								std::get<1>(i));
-						}
-					}
-				}
-				else
-				{
-				index:;
-					IndexOf(clientFd, path, coding);
-				}
-				close(clientFd);
+	}
+	const auto upstream = GetOption("upstream", "");
+	if (!upstream.empty()) Upstream = new UpstreamCache(upstream, GetOption("upstream-root", path), path);
+	if (Paths || !snapshotFile.empty())
+	{
+		std::thread([path, snapshotFile, snap]()
+		{
+			if (Paths)
+			{
+				if (snap) Paths->BuildFrom(*snap);
+				else Paths->Build();
+				printf("path index built: %s\n", Paths->Stats().c_str());
+				std::thread([]() { Paths->Watch(); }).detach();
 			}
+			if (!snapshotFile.empty()) ReconcileSnapshot(path, snapshotFile, snap, Paths != nullptr);
+		}).detach();
+	}
+#ifndef _MSC_VER
+	if (!handoff.empty()) ServeHandoff(handoff, sock, path);
+#endif
+	while (!Draining)
+	{
+#ifndef _MSC_VER
+		pollfd fds[2] = {{sock, POLLIN, 0}, {DrainWake[0], POLLIN, 0}};
+		if (poll(fds, 2, -1) <= 0 || !(fds[0].revents & POLLIN)) continue;
+#endif
+		auto conn = std::make_shared<Connection>();
+		socklen_t sinLen = sizeof(conn->addr);
+		conn->fd = accept(sock, (struct sockaddr *)&conn->addr, &sinLen);
+		if (conn->fd < 0) continue;
+		conn->start = Tracer::Now();
+		NetStage->Submit([conn]()
+		{
+			HandleRequest(conn);
 		});
-	});
-	for (auto& t : pool) t.join();
+	}
+	close(sock);
+	const auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(GetOptionInt("drain-timeout", 60));
+	printf("handed off, draining %llu connections\n", static_cast<unsigned long long>(Connection::Live.load()));
+	while (Connection::Live && std::chrono::steady_clock::now() < deadline) std::this_thread::sleep_for(std::chrono::milliseconds(100));
+	if (Connection::Live) fprintf(stderr, "drain timed out with %llu connections open\n", static_cast<unsigned long long>(Connection::Live.load()));
+	exit(EXIT_SUCCESS);
 }
 
 int main(const int argc, char* argv[])
 {
-	if (argc == 5)
+	std::vector<char*> args;
+	for (auto i = 1; i < argc; ++i)
 	{
-		Index(
-			argv[1],
-			strtol(argv[2], &argv[2], 10),
-			strtol(argv[3], &argv[3], 10),
-			argv[4],
-			"");
+		if (strncmp(argv[i], "--", 2))
+		{
+			args.push_back(argv[i]);
+			continue;
+		}
+		const auto eq = strchr(argv[i], '=');
+		if (eq) Options[std::string(argv[i] + 2, eq)] = eq + 1;
+		else Options[argv[i] + 2] = "1";
 	}
-	if (argc == 6)
+	if (args.size() == 4 || args.size() == 5)
 	{
 		Index(
-			argv[1],
-			strtol(argv[2], &argv[2], 10),
-			strtol(argv[3], &argv[3], 10),
-			argv[4],
-			argv[5]);
+			args[0],
+			strtol(args[1], &args[1], 10),
+			strtol(args[2], &args[2], 10),
+			args[3],
+			args.size() == 5 ? args[4] : "");
 	}
-	err(EXIT_FAILURE, "%s IndexPath Port threadNum Coding [IcoPath]\n", argv[0]);
+	err(EXIT_FAILURE, "%s IndexPath Port threadNum Coding [IcoPath] [--disk-threads=N] [--path-index] [--snapshot=File [--snapshot-interval=Seconds]] [--rate-conn=B/s] [--rate-ip=B/s] [--h2c=0] [--upload] [--digest] [--upstream=Host:Port [--upstream-root=Path]] [--listing-template=File] [--roots=File] [--memory=B] [--prefetch-window=B] [--tls-cert=File [--tls-key=File] [--ktls=0]] [--handoff=Path [--drain-timeout=Seconds]] [--trace=N [--trace-file=File]]\n", argv[0]);
 }
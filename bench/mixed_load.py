@@ -0,0 +1,87 @@
+#!/usr/bin/env python3
+# Mixed workload against a running HttpAutoIndexServer: a few clients pulling a large file over and
+# over while others fetch small paths (listings, small files) one after another. Reports the
+# latency of the small requests and the throughput of the bulk ones, which is what the transfer
+# scheduler trades between; run it once per --transfer-slots / --rate-* setting to compare.
+#
+#   python3 bench/mixed_load.py --port 8080 --bulk-path /srv/data/big.iso --small-path /srv/data/ --small-path /srv/data/README
+import argparse
+import socket
+import threading
+import time
+
+
+def fetch(host, port, path):
+    """GET path on a fresh connection, as every request is answered with Connection: close; returns the bytes read."""
+    s = socket.create_connection((host, port))
+    try:
+        s.sendall(("GET %s HTTP/1.1\r\nHost: %s\r\n\r\n" % (path, host)).encode())
+        total = 0
+        while True:
+            chunk = s.recv(1 << 16)
+            if not chunk:
+                return total
+            total += len(chunk)
+    finally:
+        s.close()
+
+
+def percentile(values, p):
+    if not values:
+        return 0.0
+    values = sorted(values)
+    return values[min(len(values) - 1, int(len(values) * p / 100))]
+
+
+def main():
+    parser = argparse.ArgumentParser()
+    parser.add_argument("--host", default="127.0.0.1")
+    parser.add_argument("--port", type=int, required=True)
+    parser.add_argument("--bulk-path", required=True, help="large file the bulk clients download in a loop")
+    parser.add_argument("--small-path", action="append", required=True, help="path the small clients cycle through; repeatable")
+    parser.add_argument("--bulk", type=int, default=16, help="bulk clients, default 16")
+    parser.add_argument("--small", type=int, default=2, help="small-request clients, default 2")
+    parser.add_argument("--duration", type=float, default=10, help="seconds, default 10")
+    args = parser.parse_args()
+
+    stop = time.monotonic() + args.duration
+    lock = threading.Lock()
+    latencies = []
+    bulk = {"bytes": 0, "files": 0}
+
+    def bulk_client():
+        while time.monotonic() < stop:
+            n = fetch(args.host, args.port, args.bulk_path)
+            with lock:
+                bulk["bytes"] += n
+                bulk["files"] += 1
+
+    def small_client(offset):
+        i = offset
+        while time.monotonic() < stop:
+            start = time.monotonic()
+            fetch(args.host, args.port, args.small_path[i % len(args.small_path)])
+            with lock:
+                latencies.append((time.monotonic() - start) * 1000)
+            i += 1
+
+    threads = [threading.Thread(target=bulk_client) for _ in range(args.bulk)]
+    threads += [threading.Thread(target=small_client, args=(i,)) for i in range(args.small)]
+    begin = time.monotonic()
+    for t in threads:
+        t.start()
+    for t in threads:
+        t.join()
+    elapsed = time.monotonic() - begin
+
+    print("small requests=%d p50=%.1fms p95=%.1fms p99=%.1fms max=%.1fms" % (
+        len(latencies),
+        percentile(latencies, 50),
+        percentile(latencies, 95),
+        percentile(latencies, 99),
+        max(latencies) if latencies else 0))
+    print("bulk files=%d throughput=%.1fMB/s" % (bulk["files"], bulk["bytes"] / elapsed / 1e6))
+
+
+if __name__ == "__main__":
+    main()
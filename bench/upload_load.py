@@ -0,0 +1,83 @@
+#!/usr/bin/env python3
+# PUT throughput against a running HttpAutoIndexServer started with --upload: a few clients upload
+# the same generated body over and over to names of their own below --dir (upload-load-*, left
+# there). Reports the upload rate and, given the server's --pid on the same host, the CPU it spent
+# per GB received.
+#
+#   python3 bench/upload_load.py --port 8080 --dir /srv/data/incoming --size 400000000 --pid $(pidof HttpAutoIndexServer.out)
+import argparse
+import os
+import socket
+import threading
+import time
+
+
+def put(host, port, path, body):
+    """PUT body to path on a fresh connection; returns the status code."""
+    s = socket.create_connection((host, port))
+    try:
+        s.sendall(("PUT %s HTTP/1.1\r\nHost: %s\r\nContent-Length: %d\r\n\r\n" % (path, host, len(body))).encode())
+        view = memoryview(body)
+        while view:
+            view = view[s.send(view):]
+        response = b""
+        while b"\r\n" not in response:
+            chunk = s.recv(4096)
+            if not chunk:
+                break
+            response += chunk
+        return int(response.split(b" ", 2)[1]) if response else 0
+    finally:
+        s.close()
+
+
+def cpu_seconds(pid):
+    """utime + stime of pid, from /proc."""
+    with open("/proc/%d/stat" % pid) as f:
+        fields = f.read().rsplit(")", 1)[1].split()
+    return (int(fields[11]) + int(fields[12])) / os.sysconf("SC_CLK_TCK")
+
+
+def main():
+    parser = argparse.ArgumentParser()
+    parser.add_argument("--host", default="127.0.0.1")
+    parser.add_argument("--port", type=int, required=True)
+    parser.add_argument("--dir", required=True, help="existing directory below IndexPath, as a request path")
+    parser.add_argument("--size", type=int, default=100 << 20, help="bytes per upload, default 100 MiB")
+    parser.add_argument("--clients", type=int, default=4, help="concurrent uploaders, default 4")
+    parser.add_argument("--count", type=int, default=4, help="uploads per client, default 4")
+    parser.add_argument("--pid", type=int, help="server process, to report its CPU time")
+    args = parser.parse_args()
+
+    body = os.urandom(min(args.size, 1 << 20)) * (args.size >> 20 or 1)
+    body = body[:args.size]
+    lock = threading.Lock()
+    result = {"bytes": 0, "failed": 0}
+
+    def client(n):
+        for i in range(args.count):
+            status = put(args.host, args.port, "%s/upload-load-%d-%d" % (args.dir.rstrip("/"), n, i), body)
+            with lock:
+                if status in (200, 201, 204):
+                    result["bytes"] += len(body)
+                else:
+                    result["failed"] += 1
+
+    cpu = cpu_seconds(args.pid) if args.pid else 0
+    threads = [threading.Thread(target=client, args=(n,)) for n in range(args.clients)]
+    begin = time.monotonic()
+    for t in threads:
+        t.start()
+    for t in threads:
+        t.join()
+    elapsed = time.monotonic() - begin
+
+    print("uploads=%d failed=%d throughput=%.1fMB/s" % (
+        args.clients * args.count - result["failed"], result["failed"], result["bytes"] / elapsed / 1e6))
+    if args.pid and result["bytes"]:
+        cpu = cpu_seconds(args.pid) - cpu
+        print("server cpu=%.2fs per-GB=%.2fs" % (cpu, cpu / result["bytes"] * 1e9))
+
+
+if __name__ == "__main__":
+    main()